@@ -29,8 +29,13 @@ LOCAL_VENDOR_MODULE := true
 
 LOCAL_SRC_FILES := audio_hw.c \
     audio_aec.c \
-    fifo_wrapper.cpp \
-    fir_filter.c
+    audio_aec_trace.c \
+    audio_fft.c \
+    beamformer.c \
+    capture_dsp.c \
+    fir_filter.c \
+    stream_stats.c \
+    volume_ramp.c
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioroute libaudioutils
 LOCAL_CFLAGS := -Wno-unused-parameter
 LOCAL_C_INCLUDES += \
@@ -40,4 +45,12 @@ LOCAL_C_INCLUDES += \
         system/media/audio_utils/include \
         system/media/audio_effects/include
 
+# Echo cancellation in the HAL, with the in-tree canceller
+ifeq ($(TARGET_AUDIO_AEC_HAL),true)
+LOCAL_SRC_FILES += audio_aec_process.c
+LOCAL_CFLAGS += -DAEC_HAL
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -67,10 +67,13 @@
 // #define LOG_NDEBUG 0
 
 #include <audio_utils/primitives.h>
+#include <cutils/properties.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <tinyalsa/asoundlib.h>
 #include <unistd.h>
@@ -90,21 +93,30 @@
 
 #define MAX_READ_WAIT_TIME_MSEC 80
 
+/* Smoothing factor of the per-period energies used for the ERLE estimate */
+#define ERLE_ENERGY_SMOOTHING 0.95
+
 uint64_t timespec_to_usec(struct timespec ts) {
     return (ts.tv_sec * 1e6L + ts.tv_nsec/1000);
 }
 
-void get_reference_audio_in_place(struct aec_t *aec, size_t frames) {
+/* Copy 'frames' reference frames from 'src' to 'dst', downmixing to mono if needed.
+ * 'dst' may alias 'src'. */
+static void copy_reference_audio(struct aec_t *aec, const int16_t *src, int16_t *dst,
+                                 size_t frames) {
     if (aec->num_reference_channels == aec->spk_num_channels) {
         /* Reference count equals speaker channels, nothing to do here. */
+        if (dst != src) {
+            memcpy(dst, src, frames * aec->spk_frame_size_bytes);
+        }
         return;
     } else if (aec->num_reference_channels != 1) {
         /* We don't have  a rule for non-mono references, show error on log */
         ALOGE("Invalid reference count - must be 1 or match number of playback channels!");
         return;
     }
-    int16_t *src_Nch = &aec->spk_buf_playback_format[0];
-    int16_t *dst_1ch = &aec->spk_buf_playback_format[0];
+    const int16_t *src_Nch = src;
+    int16_t *dst_1ch = dst;
     int32_t num_channels = (int32_t)aec->spk_num_channels;
     size_t frame, ch;
     for (frame = 0; frame < frames; frame++) {
@@ -117,9 +129,35 @@ void get_reference_audio_in_place(struct aec_t *aec, size_t frames) {
     }
 }
 
+/* Consume 'bytes' from the speaker FIFO into spk_buf_playback_format, converting
+ * to the reference channel layout straight out of the ring where possible.
+ * Returns -EOVERFLOW if playback overwrote the reference while it was being copied. */
+static ssize_t read_reference_audio(struct aec_t *aec, size_t bytes) {
+    struct audio_ring_span span[2];
+    ssize_t read_bytes = audio_ring_read_obtain(aec->spk_fifo, span, bytes);
+    if (read_bytes <= 0) {
+        return 0;
+    }
+    const size_t frame_size = aec->spk_frame_size_bytes;
+    int16_t *dst = aec->spk_buf_playback_format;
+    if ((span[0].bytes % frame_size) == 0) {
+        copy_reference_audio(aec, (const int16_t *)span[0].data, dst,
+                             span[0].bytes / frame_size);
+        dst += span[0].bytes / frame_size * aec->num_reference_channels;
+        copy_reference_audio(aec, (const int16_t *)span[1].data, dst,
+                             span[1].bytes / frame_size);
+    } else {
+        /* A frame straddles the wrap point, gather it first */
+        memcpy(dst, span[0].data, span[0].bytes);
+        memcpy((uint8_t *)dst + span[0].bytes, span[1].data, span[1].bytes);
+        copy_reference_audio(aec, dst, dst, read_bytes / frame_size);
+    }
+    return audio_ring_read_release(aec->spk_fifo, read_bytes);
+}
+
 void print_queue_status_to_log(struct aec_t *aec, bool write_side) {
-    ssize_t q1 = fifo_available_to_read(aec->spk_fifo);
-    ssize_t q2 = fifo_available_to_read(aec->ts_fifo);
+    ssize_t q1 = audio_ring_available_to_read(aec->spk_fifo);
+    ssize_t q2 = audio_ring_available_to_read(aec->ts_fifo);
 
     ALOGV("Queue available %s: Spk %zd (count %zd) TS %zd (count %zd)",
         (write_side) ? "(POST-WRITE)" : "(PRE-READ)",
@@ -133,11 +171,11 @@ void flush_aec_fifos(struct aec_t *aec) {
     }
     if (aec->spk_fifo != NULL) {
         ALOGV("Flushing AEC Spk FIFO...");
-        fifo_flush(aec->spk_fifo);
+        audio_ring_flush(aec->spk_fifo);
     }
     if (aec->ts_fifo != NULL) {
         ALOGV("Flushing AEC Timestamp FIFO...");
-        fifo_flush(aec->ts_fifo);
+        audio_ring_flush(aec->ts_fifo);
     }
     /* Reset FIFO read-write offset tracker */
     aec->read_write_diff_bytes = 0;
@@ -151,26 +189,92 @@ bool aec_get_spk_running_no_lock(struct aec_t* aec) {
     return aec->spk_running;
 }
 
+/* FIFOs are kept for reuse by the next reference config; see release_aec_fifos() */
 void destroy_aec_reference_config_no_lock(struct aec_t* aec) {
     if (!aec->spk_initialized) {
         return;
     }
     aec_set_spk_running_no_lock(aec, false);
-    fifo_release(aec->spk_fifo);
-    fifo_release(aec->ts_fifo);
     memset(&aec->last_spk_info, 0, sizeof(struct aec_info));
     aec->spk_initialized = false;
 }
 
+static void release_aec_fifos(struct aec_t* aec) {
+    if (aec->spk_fifo != NULL) {
+        audio_ring_release(aec->spk_fifo);
+        aec->spk_fifo = NULL;
+        aec->spk_fifo_size_bytes = 0;
+    }
+    if (aec->ts_fifo != NULL) {
+        audio_ring_release(aec->ts_fifo);
+        aec->ts_fifo = NULL;
+        aec->ts_fifo_size_bytes = 0;
+    }
+}
+
+/* Make sure the arena holds at least 'bytes'. Only allocates if it has to grow. */
+static int reserve_aec_arena(struct aec_t* aec, size_t bytes) {
+    if (bytes <= aec->arena_size_bytes) {
+        return 0;
+    }
+    if (aec->arena != NULL) {
+        ALOGW("AEC: growing buffer arena from %zu to %zu bytes", aec->arena_size_bytes, bytes);
+    }
+    void* arena = NULL;
+    if (posix_memalign(&arena, AEC_ARENA_ALIGNMENT, bytes)) {
+        ALOGE("AEC: Failed to allocate %zu byte buffer arena", bytes);
+        return -ENOMEM;
+    }
+    free(aec->arena);
+    aec->arena = arena;
+    aec->arena_size_bytes = bytes;
+    return 0;
+}
+
+static size_t arena_align(size_t bytes) {
+    return (bytes + AEC_ARENA_ALIGNMENT - 1) & ~((size_t)AEC_ARENA_ALIGNMENT - 1);
+}
+
+static double erle_db(const struct aec_stats* stats) {
+    if ((stats->out_energy <= 0.0) || (stats->mic_energy <= 0.0)) {
+        return 0.0;
+    }
+    return 10.0 * log10(stats->mic_energy / stats->out_energy);
+}
+
+void aec_dump(const struct aec_t* aec, int fd) {
+    if (aec == NULL) {
+        return;
+    }
+    const struct aec_stats* stats = &aec->stats;
+    dprintf(fd, "  AEC:\n");
+    dprintf(fd, "    Periods: %" PRIu64 ", processed: %" PRIu64 "\n", stats->periods,
+            stats->processed_periods);
+    dprintf(fd, "    FIFO flushes: %" PRIu64 ", timestamp resets: %" PRIu64
+            ", reference timeouts: %" PRIu64 ", reference overruns: %" PRIu64 "\n",
+            stats->fifo_flushes, stats->timestamp_resets, stats->reference_timeouts,
+            stats->reference_overruns);
+    if (stats->processed_periods) {
+        dprintf(fd, "    CPU per period (usec): avg %" PRIu64 ", max %" PRIu64 "\n",
+                stats->cpu_time_nsec / stats->processed_periods / 1000,
+                stats->max_cpu_time_nsec / 1000);
+        dprintf(fd, "    ERLE (dB): %.1f\n", erle_db(stats));
+    }
+    dprintf(fd, "    Mic - speaker timestamp (usec): last %" PRId64 ", max %" PRId64 "\n",
+            stats->last_time_diff_usec, stats->max_time_diff_usec);
+    aec_trace_dump(aec->trace, fd);
+}
+
+/* Buffers point into the arena and the resampler stays cached; nothing is freed here */
 void destroy_aec_mic_config_no_lock(struct aec_t* aec) {
     if (!aec->mic_initialized) {
         return;
     }
-    release_resampler(aec->spk_resampler);
-    free(aec->mic_buf);
-    free(aec->spk_buf);
-    free(aec->spk_buf_playback_format);
-    free(aec->spk_buf_resampler_out);
+    aec->spk_resampler = NULL;
+    aec->mic_buf = NULL;
+    aec->spk_buf = NULL;
+    aec->spk_buf_playback_format = NULL;
+    aec->spk_buf_resampler_out = NULL;
     memset(&aec->last_mic_info, 0, sizeof(struct aec_info));
     aec->mic_initialized = false;
 }
@@ -182,6 +286,10 @@ struct aec_t *init_aec_interface() {
         ALOGE("Failed to allocate memory for AEC interface!");
     } else {
         pthread_mutex_init(&aec->lock, NULL);
+        aec->trace = aec_trace_init();
+        if (aec->trace != NULL && property_get_bool(AEC_TRACE_PROPERTY, false)) {
+            aec_trace_set_enabled(aec->trace, true);
+        }
     }
 
     ALOGV("%s exit", __func__);
@@ -193,7 +301,13 @@ void release_aec_interface(struct aec_t *aec) {
     pthread_mutex_lock(&aec->lock);
     destroy_aec_mic_config_no_lock(aec);
     destroy_aec_reference_config_no_lock(aec);
+    release_aec_fifos(aec);
+    if (aec->resampler_cache != NULL) {
+        release_resampler(aec->resampler_cache);
+    }
+    free(aec->arena);
     pthread_mutex_unlock(&aec->lock);
+    aec_trace_release(aec->trace);
     free(aec);
     ALOGV("%s exit", __func__);
 }
@@ -213,6 +327,8 @@ int init_aec(int sampling_rate, int num_reference_channels,
     struct aec_t *aec = init_aec_interface();
     if (!ret) {
         aec->num_reference_channels = num_reference_channels;
+        aec->engine_sampling_rate = sampling_rate;
+        aec->engine_mic_channels = num_microphone_channels;
         /* Set defaults, will be overridden by settings in init_aec_(mic|referece_config) */
         /* Capture uses 2-ch, 32-bit frames */
         aec->mic_sampling_rate = CAPTURE_CODEC_SAMPLING_RATE;
@@ -223,6 +339,19 @@ int init_aec(int sampling_rate, int num_reference_channels,
         aec->spk_sampling_rate = PLAYBACK_CODEC_SAMPLING_RATE;
         aec->spk_frame_size_bytes = CHANNEL_STEREO * sizeof(int16_t);
         aec->spk_num_channels = CHANNEL_STEREO;
+
+        /* Preallocate for the largest default config, so stream start never allocates */
+        size_t ref_frame_bytes = num_reference_channels * sizeof(int32_t);
+        size_t spk_frame_bytes = (ref_frame_bytes > AEC_MAX_SPK_FRAME_BYTES) ?
+                ref_frame_bytes : AEC_MAX_SPK_FRAME_BYTES;
+        size_t arena_bytes =
+                arena_align(AEC_MAX_PERIOD_FRAMES * AEC_MAX_MIC_FRAME_BYTES) +
+                arena_align(AEC_MAX_PERIOD_FRAMES * spk_frame_bytes) +
+                arena_align(AEC_MAX_RATE_RATIO * AEC_MAX_PERIOD_FRAMES * spk_frame_bytes) +
+                arena_align(AEC_MAX_PERIOD_FRAMES * spk_frame_bytes);
+        if (reserve_aec_arena(aec, arena_bytes)) {
+            ret = -ENOMEM;
+        }
     }
 
     (*aec_ptr) = aec;
@@ -253,23 +382,34 @@ int init_aec_reference_config(struct aec_t *aec, struct alsa_stream_out *out) {
         destroy_aec_reference_config_no_lock(aec);
     }
 
-    aec->spk_fifo = fifo_init(
-            out->config.period_count * out->config.period_size *
-                audio_stream_out_frame_size(&out->stream),
-            false /* reader_throttles_writer */);
-    if (aec->spk_fifo == NULL) {
-        ALOGE("AEC: Speaker loopback FIFO Init failed!");
-        ret = -EINVAL;
-        goto exit;
-    }
-    aec->ts_fifo = fifo_init(
-            out->config.period_count * sizeof(struct aec_info),
-            false /* reader_throttles_writer */);
-    if (aec->ts_fifo == NULL) {
-        ALOGE("AEC: Speaker timestamp FIFO Init failed!");
-        ret = -EINVAL;
-        fifo_release(aec->spk_fifo);
-        goto exit;
+    /* Everything the PCM can queue, and a timestamp per write for it. Writes are at least
+     * PLAYBACK_PERIOD_SIZE frames, but a normal stream moved to the deep buffer queues
+     * many of them per period. */
+    const size_t buffer_frames = out->config.period_count * out->config.period_size;
+    size_t spk_fifo_bytes = buffer_frames * audio_stream_out_frame_size(&out->stream);
+    size_t ts_fifo_bytes = (buffer_frames + PLAYBACK_PERIOD_SIZE - 1) / PLAYBACK_PERIOD_SIZE *
+                           sizeof(struct aec_info);
+    if ((aec->spk_fifo != NULL) && (aec->spk_fifo_size_bytes == spk_fifo_bytes) &&
+        (aec->ts_fifo != NULL) && (aec->ts_fifo_size_bytes == ts_fifo_bytes)) {
+        /* Same geometry as last time: reuse the FIFOs */
+        flush_aec_fifos(aec);
+    } else {
+        release_aec_fifos(aec);
+        aec->spk_fifo = audio_ring_init(spk_fifo_bytes, false /* reader_throttles_writer */);
+        if (aec->spk_fifo == NULL) {
+            ALOGE("AEC: Speaker loopback FIFO Init failed!");
+            ret = -EINVAL;
+            goto exit;
+        }
+        aec->ts_fifo = audio_ring_init(ts_fifo_bytes, false /* reader_throttles_writer */);
+        if (aec->ts_fifo == NULL) {
+            ALOGE("AEC: Speaker timestamp FIFO Init failed!");
+            ret = -EINVAL;
+            release_aec_fifos(aec);
+            goto exit;
+        }
+        aec->spk_fifo_size_bytes = spk_fifo_bytes;
+        aec->ts_fifo_size_bytes = ts_fifo_bytes;
     }
 
     aec->spk_sampling_rate = out->config.rate;
@@ -300,16 +440,17 @@ int write_to_reference_fifo(struct aec_t* aec, void* buffer, struct aec_info* in
     size_t bytes = info->bytes;
 
     /* Write audio samples to FIFO */
-    ssize_t written_bytes = fifo_write(aec->spk_fifo, buffer, bytes);
+    ssize_t written_bytes = audio_ring_write(aec->spk_fifo, buffer, bytes);
     if (written_bytes != bytes) {
         ALOGE("Could only write %zu of %zu bytes", written_bytes, bytes);
+        aec->stats.reference_overruns++;
         ret = -ENOMEM;
     }
 
     /* Write timestamp to FIFO */
     info->bytes = written_bytes;
     ALOGV("Speaker timestamp: %ld s, %ld nsec", info->timestamp.tv_sec, info->timestamp.tv_nsec);
-    ssize_t ts_bytes = fifo_write(aec->ts_fifo, info, sizeof(struct aec_info));
+    ssize_t ts_bytes = audio_ring_write(aec->ts_fifo, info, sizeof(struct aec_info));
     ALOGV("Wrote TS bytes: %zu", ts_bytes);
     print_queue_status_to_log(aec, true);
     ALOGV("%s exit", __func__);
@@ -330,12 +471,12 @@ void get_spk_timestamp(struct aec_t* aec, ssize_t read_bytes, uint64_t* spk_time
     } else {
         /* If read_write_diff_bytes > 0, there are no new writes, so there won't be timestamps in
          * the FIFO, and the check below will fail. */
-        if (!fifo_available_to_read(aec->ts_fifo)) {
+        if (!audio_ring_available_to_read(aec->ts_fifo)) {
             ALOGE("Timestamp error: no new timestamps!");
             return;
         }
         /* We just read valid data, so if we're here, we should have a valid timestamp to use. */
-        ssize_t ts_bytes = fifo_read(aec->ts_fifo, &aec->last_spk_info, sizeof(struct aec_info));
+        ssize_t ts_bytes = audio_ring_read(aec->ts_fifo, &aec->last_spk_info, sizeof(struct aec_info));
         ALOGV("Read TS bytes: %zd, expected %zu", ts_bytes, sizeof(struct aec_info));
         aec->read_write_diff_bytes -= aec->last_spk_info.bytes;
     }
@@ -348,12 +489,12 @@ void get_spk_timestamp(struct aec_t* aec, ssize_t read_bytes, uint64_t* spk_time
         /* If read_write_diff_bytes > 0, it means that there are more write packet timestamps
          * in FIFO (since there we read more valid data the size of the current timestamp's
          * packet). Keep reading timestamps from FIFO to get to the most recent one. */
-        if (!fifo_available_to_read(aec->ts_fifo)) {
+        if (!audio_ring_available_to_read(aec->ts_fifo)) {
             /* There are no more timestamps, we have the most recent one. */
             ALOGV("At the end of timestamp FIFO, breaking...");
             break;
         }
-        fifo_read(aec->ts_fifo, &spk_info, sizeof(struct aec_info));
+        audio_ring_read(aec->ts_fifo, &spk_info, sizeof(struct aec_info));
         ALOGV("Fast-forwarded timestamp by %zd bytes, remaining bytes: %zd,"
               " new timestamp (usec) %" PRIu64,
               spk_info.bytes, aec->read_write_diff_bytes, timespec_to_usec(spk_info.timestamp));
@@ -362,48 +503,59 @@ void get_spk_timestamp(struct aec_t* aec, ssize_t read_bytes, uint64_t* spk_time
     aec->last_spk_info = spk_info;
 }
 
-int get_reference_samples(struct aec_t* aec, void* buffer, struct aec_info* info) {
+/* Called with aec->lock held. The lock is dropped while waiting for playback to fill
+ * the FIFO, during which the reference may be reconfigured (see
+ * init_aec_reference_config()), so the FIFO and its geometry are re-read after each wait. */
+static int get_reference_samples_no_lock(struct aec_t* aec, void* buffer,
+                                         struct aec_info* info) {
     ALOGV("%s enter", __func__);
 
-    if (!aec->spk_initialized) {
-        ALOGE("%s called with no reference initialized", __func__);
-        return -EINVAL;
-    }
-
     size_t bytes = info->bytes;
     const size_t frames = bytes / aec->mic_frame_size_bytes;
-    const size_t sample_rate_ratio = aec->spk_sampling_rate / aec->mic_sampling_rate;
+    size_t sample_rate_ratio;
 
     /* Read audio samples from FIFO */
-    const size_t req_bytes = frames * sample_rate_ratio * aec->spk_frame_size_bytes;
+    size_t req_bytes;
     ssize_t available_bytes = 0;
     unsigned int wait_count = MAX_READ_WAIT_TIME_MSEC;
     while (true) {
-        available_bytes = fifo_available_to_read(aec->spk_fifo);
+        if (!aec->spk_initialized) {
+            ALOGE("%s called with no reference initialized", __func__);
+            return -EINVAL;
+        }
+        sample_rate_ratio = aec->spk_sampling_rate / aec->mic_sampling_rate;
+        req_bytes = frames * sample_rate_ratio * aec->spk_frame_size_bytes;
+        available_bytes = audio_ring_available_to_read(aec->spk_fifo);
         if (available_bytes >= req_bytes) {
             break;
         } else if (available_bytes < 0) {
-            ALOGE("fifo_read returned code %zu ", available_bytes);
+            ALOGE("Reference FIFO overrun, code %zd", available_bytes);
             return -ENOMEM;
         }
 
         ALOGV("Sleeping, required bytes: %zu, available bytes: %zd", req_bytes, available_bytes);
+        pthread_mutex_unlock(&aec->lock);
         usleep(1000);
+        pthread_mutex_lock(&aec->lock);
         if ((wait_count--) == 0) {
             ALOGE("Timed out waiting for read from reference FIFO");
+            aec->stats.reference_timeouts++;
             return -ETIMEDOUT;
         }
     }
 
-    const size_t read_bytes = fifo_read(aec->spk_fifo, aec->spk_buf_playback_format, req_bytes);
+    /* Get reference - could be mono, downmixed from multichannel.
+     * Reference stored at spk_buf_playback_format */
+    const ssize_t read_bytes = read_reference_audio(aec, req_bytes);
+    if (read_bytes < 0) {
+        ALOGE("Reference FIFO overrun while reading, code %zd", read_bytes);
+        return -ENOMEM;
+    }
 
     /* Get timestamp*/
     get_spk_timestamp(aec, read_bytes, &info->timestamp_usec);
 
-    /* Get reference - could be mono, downmixed from multichannel.
-     * Reference stored at spk_buf_playback_format */
     const size_t resampler_in_frames = frames * sample_rate_ratio;
-    get_reference_audio_in_place(aec, resampler_in_frames);
 
     int16_t* resampler_out_buf;
     /* Resample to mic sampling rate (16-bit resampler) */
@@ -438,14 +590,15 @@ int get_reference_samples(struct aec_t* aec, void* buffer, struct aec_info* info
     return 0;
 }
 
+int get_reference_samples(struct aec_t* aec, void* buffer, struct aec_info* info) {
+    pthread_mutex_lock(&aec->lock);
+    int ret = get_reference_samples_no_lock(aec, buffer, info);
+    pthread_mutex_unlock(&aec->lock);
+    return ret;
+}
+
 int init_aec_mic_config(struct aec_t *aec, struct alsa_stream_in *in) {
     ALOGV("%s enter", __func__);
-#if DEBUG_AEC
-    remove("/data/local/traces/aec_in.pcm");
-    remove("/data/local/traces/aec_out.pcm");
-    remove("/data/local/traces/aec_ref.pcm");
-    remove("/data/local/traces/aec_timestamps.txt");
-#endif /* #if DEBUG_AEC */
 
     if (!aec) {
         ALOGE("AEC: No valid interface found!");
@@ -458,55 +611,79 @@ int init_aec_mic_config(struct aec_t *aec, struct alsa_stream_in *in) {
         destroy_aec_mic_config_no_lock(aec);
     }
     aec->mic_sampling_rate = in->config.rate;
-    aec->mic_frame_size_bytes = audio_stream_in_frame_size(&in->stream);
+    /* The PCM's frame size, in_read() may convert for the client afterwards */
+    aec->mic_frame_size_bytes = in->config.channels * pcm_format_to_bits(in->config.format) / 8;
     aec->mic_num_channels = in->config.channels;
 
-    aec->mic_buf_size_bytes = in->config.period_size * audio_stream_in_frame_size(&in->stream);
-    aec->mic_buf = (int32_t *)malloc(aec->mic_buf_size_bytes);
-    if (aec->mic_buf == NULL) {
-        ret = -ENOMEM;
-        goto exit;
-    }
-    memset(aec->mic_buf, 0, aec->mic_buf_size_bytes);
+    aec->mic_buf_size_bytes = in->config.period_size * aec->mic_frame_size_bytes;
     /* Reference buffer is the same number of frames as mic,
      * only with a different number of channels in the frame. */
     aec->spk_buf_size_bytes = in->config.period_size * aec->spk_frame_size_bytes;
-    aec->spk_buf = (int32_t *)malloc(aec->spk_buf_size_bytes);
-    if (aec->spk_buf == NULL) {
-        ret = -ENOMEM;
-        goto exit_1;
-    }
-    memset(aec->spk_buf, 0, aec->spk_buf_size_bytes);
-
     /* Pre-resampler buffer */
     size_t spk_frame_out_format_bytes = aec->spk_sampling_rate / aec->mic_sampling_rate *
                                             aec->spk_buf_size_bytes;
-    aec->spk_buf_playback_format = (int16_t *)malloc(spk_frame_out_format_bytes);
-    if (aec->spk_buf_playback_format == NULL) {
-        ret = -ENOMEM;
-        goto exit_2;
-    }
-    /* Resampler is 16-bit */
-    aec->spk_buf_resampler_out = (int16_t *)malloc(aec->spk_buf_size_bytes);
-    if (aec->spk_buf_resampler_out == NULL) {
-        ret = -ENOMEM;
-        goto exit_3;
+    size_t mic_bytes = arena_align(aec->mic_buf_size_bytes);
+    size_t spk_bytes = arena_align(aec->spk_buf_size_bytes);
+    size_t playback_bytes = arena_align(spk_frame_out_format_bytes);
+    /* Resampler is 16-bit, output has the size of spk_buf */
+    ret = reserve_aec_arena(aec, mic_bytes + spk_bytes + playback_bytes + spk_bytes);
+    if (ret) {
+        goto exit;
     }
+    uint8_t *arena = (uint8_t *)aec->arena;
+    aec->mic_buf = (int32_t *)arena;
+    aec->spk_buf = (int32_t *)(arena + mic_bytes);
+    aec->spk_buf_playback_format = (int16_t *)(arena + mic_bytes + spk_bytes);
+    aec->spk_buf_resampler_out = (int16_t *)(arena + mic_bytes + spk_bytes + playback_bytes);
+    memset(aec->mic_buf, 0, aec->mic_buf_size_bytes);
+    memset(aec->spk_buf, 0, aec->spk_buf_size_bytes);
 
     /* Don't use resampler if it's not required */
     if (in->config.rate == aec->spk_sampling_rate) {
         aec->spk_resampler = NULL;
+    } else if ((aec->resampler_cache != NULL) &&
+               (aec->resampler_in_rate == aec->spk_sampling_rate) &&
+               (aec->resampler_out_rate == in->config.rate) &&
+               (aec->resampler_channels == aec->num_reference_channels)) {
+        /* Same conversion as last time: reuse the resampler */
+        aec->resampler_cache->reset(aec->resampler_cache);
+        aec->spk_resampler = aec->resampler_cache;
     } else {
+        if (aec->resampler_cache != NULL) {
+            release_resampler(aec->resampler_cache);
+            aec->resampler_cache = NULL;
+        }
         int resampler_ret = create_resampler(
                 aec->spk_sampling_rate, in->config.rate, aec->num_reference_channels,
                 RESAMPLER_QUALITY_MAX - 1, /* MAX - 1 is the real max */
                 NULL,                      /* resampler_buffer_provider */
-                &aec->spk_resampler);
+                &aec->resampler_cache);
         if (resampler_ret) {
             ALOGE("AEC: Resampler initialization failed! Error code %d", resampler_ret);
+            aec->resampler_cache = NULL;
             ret = resampler_ret;
-            goto exit_4;
+            goto exit;
+        }
+        aec->resampler_in_rate = aec->spk_sampling_rate;
+        aec->resampler_out_rate = in->config.rate;
+        aec->resampler_channels = aec->num_reference_channels;
+        aec->spk_resampler = aec->resampler_cache;
+    }
+
+    /* Capture profiles differ in rate and mic count, the canceller follows the mic */
+    if ((aec->engine_sampling_rate != in->config.rate) ||
+        (aec->engine_mic_channels != in->config.channels)) {
+        int aec_ret = aec_spk_mic_init(in->config.rate, aec->num_reference_channels,
+                                       in->config.channels);
+        if (aec_ret) {
+            ALOGE("AEC: Engine re-init for %u Hz, %u mics failed! Error code %d",
+                  in->config.rate, in->config.channels, aec_ret);
+            aec->engine_sampling_rate = 0;
+            ret = aec_ret;
+            goto exit;
         }
+        aec->engine_sampling_rate = in->config.rate;
+        aec->engine_mic_channels = in->config.channels;
     }
 
     flush_aec_fifos(aec);
@@ -517,18 +694,6 @@ exit:
     pthread_mutex_unlock(&aec->lock);
     ALOGV("%s exit", __func__);
     return ret;
-
-exit_4:
-    free(aec->spk_buf_resampler_out);
-exit_3:
-    free(aec->spk_buf_playback_format);
-exit_2:
-    free(aec->spk_buf);
-exit_1:
-    free(aec->mic_buf);
-    pthread_mutex_unlock(&aec->lock);
-    ALOGV("%s exit", __func__);
-    return ret;
 }
 
 void aec_set_spk_running(struct aec_t *aec, bool state) {
@@ -562,6 +727,29 @@ void destroy_aec_mic_config(struct aec_t* aec) {
 }
 
 #ifdef AEC_HAL
+/* Drop the reference and restart the canceller after losing alignment. Unlike the
+ * flushes at stream start, these are counted: they are what the counter is for. */
+static void resync_aec(struct aec_t *aec) {
+    flush_aec_fifos(aec);
+    aec_spk_mic_reset();
+    aec->stats.fifo_flushes++;
+}
+
+static uint64_t thread_cpu_time_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double energy_int32(const int32_t* samples, size_t count) {
+    double acc = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        double s = samples[i];
+        acc += s * s;
+    }
+    return acc;
+}
+
 int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
     ALOGV("%s enter", __func__);
     int ret = 0;
@@ -571,13 +759,18 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
         return -EINVAL;
     }
 
+    /* Held throughout, so that the reference can't be reconfigured under us. Dropped only
+     * while waiting for reference, see get_reference_samples_no_lock(). */
+    pthread_mutex_lock(&aec->lock);
     if ((!aec->mic_initialized) || (!aec->spk_initialized)) {
         ALOGE("%s called with initialization: mic: %d, spk: %d", __func__, aec->mic_initialized,
               aec->spk_initialized);
+        pthread_mutex_unlock(&aec->lock);
         return -EINVAL;
     }
 
     size_t bytes = info->bytes;
+    aec->stats.periods++;
 
     size_t frame_size = aec->mic_frame_size_bytes;
     size_t in_frames = bytes / frame_size;
@@ -593,7 +786,7 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
      * The first time speaker state changes to running, flush FIFOs, so we're not stuck
      * processing stale reference input.
      */
-    bool spk_running = aec_get_spk_running(aec);
+    bool spk_running = aec_get_spk_running_no_lock(aec);
 
     if (!spk_running) {
         /* No new playback samples, so don't run AEC.
@@ -607,7 +800,7 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
     }
 
     /* If there's no data in FIFO, exit */
-    if (fifo_available_to_read(aec->spk_fifo) <= 0) {
+    if (audio_ring_available_to_read(aec->spk_fifo) <= 0) {
         ALOGV("Echo reference buffer empty, zeroing reference....");
         goto exit;
     }
@@ -617,7 +810,7 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
     /* Get reference, with format and sample rate required by AEC */
     struct aec_info spk_info;
     spk_info.bytes = bytes;
-    int ref_ret = get_reference_samples(aec, aec->spk_buf, &spk_info);
+    int ref_ret = get_reference_samples_no_lock(aec, aec->spk_buf, &spk_info);
     spk_time = spk_info.timestamp_usec;
 
     if (ref_ret) {
@@ -627,10 +820,14 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
     }
 
     int64_t time_diff = (mic_time > spk_time) ? (mic_time - spk_time) : (spk_time - mic_time);
+    aec->stats.last_time_diff_usec = (int64_t)(mic_time - spk_time);
+    if (time_diff > aec->stats.max_time_diff_usec) {
+        aec->stats.max_time_diff_usec = time_diff;
+    }
     if ((spk_time == 0) || (mic_time == 0) || (time_diff > MAX_TIMESTAMP_DIFF_USEC)) {
         ALOGV("Speaker-mic timestamps diverged, skipping AEC");
-        flush_aec_fifos(aec);
-        aec_spk_mic_reset();
+        aec->stats.timestamp_resets++;
+        resync_aec(aec);
         goto exit;
     }
 
@@ -639,15 +836,29 @@ int process_aec(struct aec_t *aec, void* buffer, struct aec_info *info) {
     /*
      * AEC processing call - output stored at 'buffer'
      */
+    uint64_t cpu_start_nsec = thread_cpu_time_nsec();
     int32_t aec_status = aec_spk_mic_process(
         aec->spk_buf, spk_time,
         aec->mic_buf, mic_time,
         in_frames,
         buffer);
+    uint64_t cpu_nsec = thread_cpu_time_nsec() - cpu_start_nsec;
 
     if (!aec_status) {
         ALOGE("AEC processing failed!");
         ret = -EINVAL;
+    } else {
+        size_t samples = in_frames * aec->mic_num_channels;
+        struct aec_stats* stats = &aec->stats;
+        stats->processed_periods++;
+        stats->cpu_time_nsec += cpu_nsec;
+        if (cpu_nsec > stats->max_cpu_time_nsec) {
+            stats->max_cpu_time_nsec = cpu_nsec;
+        }
+        stats->mic_energy = ERLE_ENERGY_SMOOTHING * stats->mic_energy +
+                            (1.0 - ERLE_ENERGY_SMOOTHING) * energy_int32(aec->mic_buf, samples);
+        stats->out_energy = ERLE_ENERGY_SMOOTHING * stats->out_energy +
+                            (1.0 - ERLE_ENERGY_SMOOTHING) * energy_int32(buffer, samples);
     }
 
 exit:
@@ -656,43 +867,18 @@ exit:
     if (ret) {
         /* Best we can do is copy over the raw mic signal */
         memcpy(buffer, aec->mic_buf, bytes);
-        flush_aec_fifos(aec);
-        aec_spk_mic_reset();
+        resync_aec(aec);
     }
 
-#if DEBUG_AEC
     /* ref data is 32-bit at this point */
-    size_t ref_bytes = in_frames*aec->num_reference_channels*sizeof(int32_t);
-
-    FILE *fp_in = fopen("/data/local/traces/aec_in.pcm", "a+");
-    if (fp_in) {
-        fwrite((char *)aec->mic_buf, 1, bytes, fp_in);
-        fclose(fp_in);
-    } else {
-        ALOGE("AEC debug: Could not open file aec_in.pcm!");
-    }
-    FILE *fp_out = fopen("/data/local/traces/aec_out.pcm", "a+");
-    if (fp_out) {
-        fwrite((char *)buffer, 1, bytes, fp_out);
-        fclose(fp_out);
-    } else {
-        ALOGE("AEC debug: Could not open file aec_out.pcm!");
-    }
-    FILE *fp_ref = fopen("/data/local/traces/aec_ref.pcm", "a+");
-    if (fp_ref) {
-        fwrite((char *)aec->spk_buf, 1, ref_bytes, fp_ref);
-        fclose(fp_ref);
-    } else {
-        ALOGE("AEC debug: Could not open file aec_ref.pcm!");
-    }
-    FILE *fp_ts = fopen("/data/local/traces/aec_timestamps.txt", "a+");
-    if (fp_ts) {
-        fprintf(fp_ts, "%"PRIu64",%"PRIu64"\n", mic_time, spk_time);
-        fclose(fp_ts);
-    } else {
-        ALOGE("AEC debug: Could not open file aec_timestamps.txt!");
-    }
-#endif /* #if DEBUG_AEC */
+    size_t ref_bytes = in_frames * aec->num_reference_channels * sizeof(int32_t);
+    aec_trace_record(aec->trace, AEC_TRACE_MIC_IN, aec->mic_buf, bytes, aec->mic_sampling_rate,
+                     aec->mic_num_channels, 32, mic_time * 1000, spk_time * 1000);
+    aec_trace_record(aec->trace, AEC_TRACE_REFERENCE, aec->spk_buf, ref_bytes,
+                     aec->mic_sampling_rate, aec->num_reference_channels, 32, spk_time * 1000, 0);
+    aec_trace_record(aec->trace, AEC_TRACE_AEC_OUT, buffer, bytes, aec->mic_sampling_rate,
+                     aec->mic_num_channels, 32, mic_time * 1000, spk_time * 1000);
+    pthread_mutex_unlock(&aec->lock);
     ALOGV("%s exit", __func__);
     return ret;
 }
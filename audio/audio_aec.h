@@ -30,8 +30,35 @@
 #include <sys/time.h>
 #include <hardware/audio.h>
 #include <audio_utils/resampler.h>
+#include "audio_aec_trace.h"
 #include "audio_hw.h"
-#include "fifo_wrapper.h"
+#include "audio_ring.h"
+
+/* Buffer arena sizing. The arena is allocated once in init_aec() for the largest
+ * default configuration and reused by every init_aec_mic_config(); it only grows
+ * (once) if a stream needs more. */
+#define AEC_MAX_PERIOD_FRAMES CAPTURE_HIFI_PERIOD_SIZE
+#define AEC_MAX_MIC_FRAME_BYTES (CAPTURE_MAX_MIC_CHANNELS * sizeof(int32_t))
+#define AEC_MAX_SPK_FRAME_BYTES (CHANNEL_STEREO * sizeof(int16_t))
+#define AEC_MAX_RATE_RATIO (PLAYBACK_CODEC_SAMPLING_RATE / CAPTURE_CODEC_SAMPLING_RATE)
+#define AEC_ARENA_ALIGNMENT 64
+
+/* Pipeline health counters, updated by the capture thread and read without locking
+ * by aec_dump(). */
+struct aec_stats {
+    uint64_t periods;             /* process_aec() calls */
+    uint64_t processed_periods;   /* periods the echo canceller ran on */
+    uint64_t fifo_flushes;        /* reference dropped to realign, not at stream start */
+    uint64_t timestamp_resets;    /* speaker/mic timestamps diverged */
+    uint64_t reference_timeouts;  /* get_reference_samples() ran out of reference */
+    uint64_t reference_overruns;  /* write_to_reference_fifo() dropped samples */
+    uint64_t cpu_time_nsec;       /* thread CPU time spent in the canceller */
+    uint64_t max_cpu_time_nsec;
+    int64_t last_time_diff_usec;  /* mic minus speaker timestamp */
+    int64_t max_time_diff_usec;
+    double mic_energy;            /* smoothed, processed periods only */
+    double out_energy;
+};
 
 struct aec_t {
     pthread_mutex_t lock;
@@ -52,12 +79,27 @@ struct aec_t {
     struct aec_info last_spk_info;
     int16_t *spk_buf_playback_format;
     int16_t *spk_buf_resampler_out;
-    void *spk_fifo;
-    void *ts_fifo;
+    struct audio_ring *spk_fifo;
+    struct audio_ring *ts_fifo;
     ssize_t read_write_diff_bytes;
     struct resampler_itfe *spk_resampler;
+    /* Retained across stream open/close cycles, see init_aec_mic_config() */
+    void *arena;
+    size_t arena_size_bytes;
+    struct resampler_itfe *resampler_cache;
+    uint32_t resampler_in_rate;
+    uint32_t resampler_out_rate;
+    uint32_t resampler_channels;
+    /* Configuration the echo canceller was last set up for */
+    uint32_t engine_sampling_rate;
+    size_t engine_mic_channels;
+    /* Retained across init_aec_reference_config() calls of the same size */
+    size_t spk_fifo_size_bytes;
+    size_t ts_fifo_size_bytes;
     bool spk_running;
     bool prev_spk_running;
+    struct aec_trace *trace;
+    struct aec_stats stats;
 };
 
 /* Initialize AEC object.
@@ -72,7 +114,8 @@ int init_aec (int sampling_rate, int num_reference_channels,
 void release_aec(struct aec_t* aec);
 
 /* Initialize reference configuration for AEC.
- * Must be called when a new output stream is opened.
+ * Must be called when a new output stream is opened, and when its PCM is reopened
+ * with a different buffer size, to size the reference FIFO for it.
  * Returns -EINVAL if any processing block fails to initialize,
  * else returns 0. */
 int init_aec_reference_config (struct aec_t *aec, struct alsa_stream_out *out);
@@ -114,6 +157,9 @@ int write_to_reference_fifo(struct aec_t* aec, void* buffer, struct aec_info* in
  *  0          otherwise */
 int get_reference_samples(struct aec_t* aec, void* buffer, struct aec_info* info);
 
+/* Print pipeline statistics and trace state, for adev_dump(). */
+void aec_dump(const struct aec_t* aec, int fd);
+
 #ifdef AEC_HAL
 
 /* Processing function call for AEC.
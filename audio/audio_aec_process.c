@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_aec_process"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "audio_aec_process.h"
+#include "audio_fft.h"
+
+#ifdef __ARM_NEON
+#include "arm_neon.h"
+#endif /* #ifdef __ARM_NEON */
+
+/* NLMS step size */
+#define AEC_STEP_SIZE 0.5f
+/* Smoothing factor of the far-end power estimate */
+#define AEC_POWER_SMOOTHING 0.9f
+/* Regularization, relative to the mean far-end power per bin, and absolute (full scale
+ * power per bin) so that silence does not divide by zero */
+#define AEC_REGULARIZATION_RATIO 0.01f
+#define AEC_REGULARIZATION 1e-6f
+/* A block whose output has this much more energy than its input is a sign of
+ * divergence: the mic is passed through and the filter shrunk instead of adapted */
+#define AEC_DIVERGENCE_RATIO 2.0f
+#define AEC_DIVERGENCE_SHRINK 0.5f
+
+#define INT32_TO_FLOAT (1.0f / 2147483648.0f)
+
+struct aec_engine {
+    uint32_t sampling_rate;
+    uint32_t num_reference_channels;
+    uint32_t num_mic_channels;
+    uint32_t num_partitions;
+    uint32_t num_bins;
+    audio_fft_t* fft;
+    /* Far-end: last two blocks in time domain, ring of spectra (newest at ref_head) */
+    float* ref_time;
+    float* ref_re;
+    float* ref_im;
+    float* ref_power;   /* per bin, smoothed, times the number of partitions */
+    float ref_delta;
+    uint32_t ref_head;
+    /* Filter partitions, num_partitions * num_bins per mic channel */
+    float* filter_re;
+    float* filter_im;
+    /* Scratch */
+    float* time_buf;
+    float* spec_re;
+    float* spec_im;
+    float* grad_re;
+    float* grad_im;
+    int64_t last_delay_usec;
+    bool delay_valid;
+};
+
+static struct aec_engine* engine = NULL;
+
+/* acc += a * b, complex, over 'bins' bins */
+static void complex_mac(float* acc_re, float* acc_im, const float* a_re, const float* a_im,
+                        const float* b_re, const float* b_im, uint32_t bins) {
+    uint32_t k = 0;
+#ifdef __ARM_NEON
+    for (; k + 4 <= bins; k += 4) {
+        float32x4_t ar = vld1q_f32(&a_re[k]);
+        float32x4_t ai = vld1q_f32(&a_im[k]);
+        float32x4_t br = vld1q_f32(&b_re[k]);
+        float32x4_t bi = vld1q_f32(&b_im[k]);
+        float32x4_t cr = vld1q_f32(&acc_re[k]);
+        float32x4_t ci = vld1q_f32(&acc_im[k]);
+        cr = vmlsq_f32(vmlaq_f32(cr, ar, br), ai, bi);
+        ci = vmlaq_f32(vmlaq_f32(ci, ar, bi), ai, br);
+        vst1q_f32(&acc_re[k], cr);
+        vst1q_f32(&acc_im[k], ci);
+    }
+#endif /* #ifdef __ARM_NEON */
+    for (; k < bins; k++) {
+        acc_re[k] += a_re[k] * b_re[k] - a_im[k] * b_im[k];
+        acc_im[k] += a_re[k] * b_im[k] + a_im[k] * b_re[k];
+    }
+}
+
+/* acc += conj(a) * b, complex, over 'bins' bins */
+static void complex_conj_mac(float* acc_re, float* acc_im, const float* a_re, const float* a_im,
+                             const float* b_re, const float* b_im, uint32_t bins) {
+    uint32_t k = 0;
+#ifdef __ARM_NEON
+    for (; k + 4 <= bins; k += 4) {
+        float32x4_t ar = vld1q_f32(&a_re[k]);
+        float32x4_t ai = vld1q_f32(&a_im[k]);
+        float32x4_t br = vld1q_f32(&b_re[k]);
+        float32x4_t bi = vld1q_f32(&b_im[k]);
+        float32x4_t cr = vld1q_f32(&acc_re[k]);
+        float32x4_t ci = vld1q_f32(&acc_im[k]);
+        cr = vmlaq_f32(vmlaq_f32(cr, ar, br), ai, bi);
+        ci = vmlsq_f32(vmlaq_f32(ci, ar, bi), ai, br);
+        vst1q_f32(&acc_re[k], cr);
+        vst1q_f32(&acc_im[k], ci);
+    }
+#endif /* #ifdef __ARM_NEON */
+    for (; k < bins; k++) {
+        acc_re[k] += a_re[k] * b_re[k] + a_im[k] * b_im[k];
+        acc_im[k] += a_re[k] * b_im[k] - a_im[k] * b_re[k];
+    }
+}
+
+static void reset_channel(struct aec_engine* aec, uint32_t ch) {
+    size_t filter_size = (size_t)aec->num_partitions * aec->num_bins;
+    memset(&aec->filter_re[ch * filter_size], 0, filter_size * sizeof(float));
+    memset(&aec->filter_im[ch * filter_size], 0, filter_size * sizeof(float));
+}
+
+static void scale_channel(struct aec_engine* aec, uint32_t ch, float gain) {
+    size_t filter_size = (size_t)aec->num_partitions * aec->num_bins;
+    float* w_re = &aec->filter_re[ch * filter_size];
+    float* w_im = &aec->filter_im[ch * filter_size];
+    for (size_t i = 0; i < filter_size; i++) {
+        w_re[i] *= gain;
+        w_im[i] *= gain;
+    }
+}
+
+/* Push one block of far-end audio and compute its spectrum. */
+static void push_reference_block(struct aec_engine* aec, const int32_t* spk) {
+    const uint32_t bins = aec->num_bins;
+    memmove(aec->ref_time, &aec->ref_time[AEC_BLOCK_SIZE], AEC_BLOCK_SIZE * sizeof(float));
+    float* dst = &aec->ref_time[AEC_BLOCK_SIZE];
+    for (uint32_t n = 0; n < AEC_BLOCK_SIZE; n++) {
+        float acc = 0.0f;
+        for (uint32_t ch = 0; ch < aec->num_reference_channels; ch++) {
+            acc += (float)*spk++;
+        }
+        dst[n] = acc * INT32_TO_FLOAT / aec->num_reference_channels;
+    }
+
+    aec->ref_head = (aec->ref_head + aec->num_partitions - 1) % aec->num_partitions;
+    float* x_re = &aec->ref_re[aec->ref_head * bins];
+    float* x_im = &aec->ref_im[aec->ref_head * bins];
+    fft_forward_real(aec->fft, aec->ref_time, x_re, x_im);
+
+    float mean = 0.0f;
+    for (uint32_t k = 0; k < bins; k++) {
+        float power = aec->num_partitions * (x_re[k] * x_re[k] + x_im[k] * x_im[k]);
+        aec->ref_power[k] = AEC_POWER_SMOOTHING * aec->ref_power[k] +
+                            (1.0f - AEC_POWER_SMOOTHING) * power;
+        mean += aec->ref_power[k];
+    }
+    aec->ref_delta = AEC_REGULARIZATION_RATIO * mean / bins + AEC_REGULARIZATION;
+}
+
+/* Filter, output and adapt one block of one mic channel. */
+static void process_channel_block(struct aec_engine* aec, uint32_t ch, const int32_t* mic,
+                                  int32_t* out) {
+    const uint32_t bins = aec->num_bins;
+    const uint32_t partitions = aec->num_partitions;
+    const uint32_t stride = aec->num_mic_channels;
+    const size_t filter_size = (size_t)partitions * bins;
+    float* w_re = &aec->filter_re[ch * filter_size];
+    float* w_im = &aec->filter_im[ch * filter_size];
+
+    /* Echo estimate: sum over partitions of W_p * X_(k-p) */
+    memset(aec->spec_re, 0, bins * sizeof(float));
+    memset(aec->spec_im, 0, bins * sizeof(float));
+    for (uint32_t p = 0; p < partitions; p++) {
+        uint32_t slot = (aec->ref_head + p) % partitions;
+        complex_mac(aec->spec_re, aec->spec_im, &w_re[p * bins], &w_im[p * bins],
+                    &aec->ref_re[slot * bins], &aec->ref_im[slot * bins], bins);
+    }
+    fft_inverse_real(aec->fft, aec->spec_re, aec->spec_im, aec->time_buf);
+
+    /* Error = mic - echo estimate (last block of the overlap-save output) */
+    float* err = &aec->time_buf[AEC_BLOCK_SIZE];
+    float mic_energy = 0.0f;
+    float err_energy = 0.0f;
+    for (uint32_t n = 0; n < AEC_BLOCK_SIZE; n++) {
+        float d = (float)mic[n * stride] * INT32_TO_FLOAT;
+        float e = d - err[n];
+        mic_energy += d * d;
+        err_energy += e * e;
+        err[n] = e;
+    }
+
+    if (err_energy > AEC_DIVERGENCE_RATIO * mic_energy + AEC_REGULARIZATION) {
+        ALOGV("%s: channel %u diverging, shrinking filter", __func__, ch);
+        scale_channel(aec, ch, AEC_DIVERGENCE_SHRINK);
+        for (uint32_t n = 0; n < AEC_BLOCK_SIZE; n++) {
+            out[n * stride] = mic[n * stride];
+        }
+        return;
+    }
+
+    for (uint32_t n = 0; n < AEC_BLOCK_SIZE; n++) {
+        float e = err[n] * 2147483648.0f;
+        if (e >= 2147483647.0f) {
+            out[n * stride] = INT32_MAX;
+        } else if (e <= -2147483648.0f) {
+            out[n * stride] = INT32_MIN;
+        } else {
+            out[n * stride] = (int32_t)e;
+        }
+    }
+
+    /* Normalized error: E = mu * FFT([0, e]) / (P * Pxx + delta) */
+    memset(aec->time_buf, 0, AEC_BLOCK_SIZE * sizeof(float));
+    fft_forward_real(aec->fft, aec->time_buf, aec->spec_re, aec->spec_im);
+    for (uint32_t k = 0; k < bins; k++) {
+        float norm = AEC_STEP_SIZE / (aec->ref_power[k] + aec->ref_delta);
+        aec->spec_re[k] *= norm;
+        aec->spec_im[k] *= norm;
+    }
+
+    /* Constrained update of every partition: the gradient conj(X_p) * E is taken back to
+     * the time domain and its circular-convolution half zeroed before it is applied, so
+     * no partition ever wraps around into its neighbour. */
+    for (uint32_t p = 0; p < partitions; p++) {
+        uint32_t slot = (aec->ref_head + p) % partitions;
+        memset(aec->grad_re, 0, bins * sizeof(float));
+        memset(aec->grad_im, 0, bins * sizeof(float));
+        complex_conj_mac(aec->grad_re, aec->grad_im, &aec->ref_re[slot * bins],
+                         &aec->ref_im[slot * bins], aec->spec_re, aec->spec_im, bins);
+        fft_inverse_real(aec->fft, aec->grad_re, aec->grad_im, aec->time_buf);
+        memset(&aec->time_buf[AEC_BLOCK_SIZE], 0, AEC_BLOCK_SIZE * sizeof(float));
+        fft_forward_real(aec->fft, aec->time_buf, aec->grad_re, aec->grad_im);
+        float* pw_re = &w_re[p * bins];
+        float* pw_im = &w_im[p * bins];
+        for (uint32_t k = 0; k < bins; k++) {
+            pw_re[k] += aec->grad_re[k];
+            pw_im[k] += aec->grad_im[k];
+        }
+    }
+}
+
+int aec_spk_mic_init(int sampling_rate, int num_reference_channels, int num_microphone_channels) {
+    if ((sampling_rate <= 0) || (num_reference_channels <= 0) || (num_microphone_channels <= 0)) {
+        ALOGE("%s: Invalid config: rate %d, ref channels %d, mic channels %d", __func__,
+              sampling_rate, num_reference_channels, num_microphone_channels);
+        return -EINVAL;
+    }
+    aec_spk_mic_release();
+
+    struct aec_engine* aec = (struct aec_engine*)calloc(1, sizeof(struct aec_engine));
+    if (aec == NULL) {
+        ALOGE("%s: Unable to allocate memory for AEC engine.", __func__);
+        return -ENOMEM;
+    }
+    aec->sampling_rate = sampling_rate;
+    aec->num_reference_channels = num_reference_channels;
+    aec->num_mic_channels = num_microphone_channels;
+    aec->num_bins = AEC_BLOCK_SIZE + 1;
+    uint32_t tail_frames = (uint32_t)((uint64_t)sampling_rate * AEC_TAIL_LENGTH_MS / 1000);
+    aec->num_partitions = (tail_frames + AEC_BLOCK_SIZE - 1) / AEC_BLOCK_SIZE;
+
+    aec->fft = fft_init(2 * AEC_BLOCK_SIZE);
+    if (aec->fft == NULL) {
+        free(aec);
+        return -ENOMEM;
+    }
+
+    const size_t spectra = (size_t)aec->num_partitions * aec->num_bins;
+    const size_t floats = 2 * AEC_BLOCK_SIZE            /* ref_time */
+                          + 2 * spectra                 /* ref_re, ref_im */
+                          + aec->num_bins               /* ref_power */
+                          + 2 * spectra * num_microphone_channels /* filter_re, filter_im */
+                          + 2 * AEC_BLOCK_SIZE          /* time_buf */
+                          + 2 * aec->num_bins           /* spec_re, spec_im */
+                          + 2 * aec->num_bins;          /* grad_re, grad_im */
+    float* mem = (float*)calloc(floats, sizeof(float));
+    if (mem == NULL) {
+        ALOGE("%s: Unable to allocate memory for AEC state.", __func__);
+        fft_release(aec->fft);
+        free(aec);
+        return -ENOMEM;
+    }
+    aec->ref_time = mem;
+    aec->ref_re = aec->ref_time + 2 * AEC_BLOCK_SIZE;
+    aec->ref_im = aec->ref_re + spectra;
+    aec->ref_power = aec->ref_im + spectra;
+    aec->filter_re = aec->ref_power + aec->num_bins;
+    aec->filter_im = aec->filter_re + spectra * num_microphone_channels;
+    aec->time_buf = aec->filter_im + spectra * num_microphone_channels;
+    aec->spec_re = aec->time_buf + 2 * AEC_BLOCK_SIZE;
+    aec->spec_im = aec->spec_re + aec->num_bins;
+    aec->grad_re = aec->spec_im + aec->num_bins;
+    aec->grad_im = aec->grad_re + aec->num_bins;
+
+    ALOGI("%s: rate %d, %u partitions of %d frames, %d mic channel(s)", __func__, sampling_rate,
+          aec->num_partitions, AEC_BLOCK_SIZE, num_microphone_channels);
+#ifdef __ARM_NEON
+    ALOGI("%s: Using ARM Neon", __func__);
+#endif /* #ifdef __ARM_NEON */
+
+    engine = aec;
+    return 0;
+}
+
+void aec_spk_mic_reset(void) {
+    struct aec_engine* aec = engine;
+    if (aec == NULL) {
+        return;
+    }
+    const size_t spectra = (size_t)aec->num_partitions * aec->num_bins;
+    memset(aec->ref_time, 0, 2 * AEC_BLOCK_SIZE * sizeof(float));
+    memset(aec->ref_re, 0, spectra * sizeof(float));
+    memset(aec->ref_im, 0, spectra * sizeof(float));
+    memset(aec->ref_power, 0, aec->num_bins * sizeof(float));
+    aec->ref_delta = AEC_REGULARIZATION;
+    for (uint32_t ch = 0; ch < aec->num_mic_channels; ch++) {
+        reset_channel(aec, ch);
+    }
+    aec->ref_head = 0;
+    aec->delay_valid = false;
+}
+
+int32_t aec_spk_mic_process(int32_t* spk_buf, uint64_t spk_time, int32_t* mic_buf,
+                            uint64_t mic_time, size_t num_frames, int32_t* output) {
+    struct aec_engine* aec = engine;
+    if ((aec == NULL) || (spk_buf == NULL) || (mic_buf == NULL) || (output == NULL)) {
+        return 0;
+    }
+    if (num_frames % AEC_BLOCK_SIZE) {
+        ALOGE("%s: %zu frames is not a multiple of the block size %d", __func__, num_frames,
+              AEC_BLOCK_SIZE);
+        return 0;
+    }
+
+    /* A jump in the speaker-mic offset means the echo path moved: start over. */
+    int64_t delay_usec = (int64_t)mic_time - (int64_t)spk_time;
+    int64_t block_usec = (int64_t)AEC_BLOCK_SIZE * 1000000 / aec->sampling_rate;
+    if (aec->delay_valid) {
+        int64_t drift = delay_usec - aec->last_delay_usec;
+        if ((drift > block_usec) || (drift < -block_usec)) {
+            ALOGV("%s: delay moved %" PRId64 " usec, resetting", __func__, drift);
+            aec_spk_mic_reset();
+        }
+    }
+    aec->last_delay_usec = delay_usec;
+    aec->delay_valid = true;
+
+    for (size_t frame = 0; frame < num_frames; frame += AEC_BLOCK_SIZE) {
+        push_reference_block(aec, &spk_buf[frame * aec->num_reference_channels]);
+        for (uint32_t ch = 0; ch < aec->num_mic_channels; ch++) {
+            process_channel_block(aec, ch, &mic_buf[frame * aec->num_mic_channels + ch],
+                                  &output[frame * aec->num_mic_channels + ch]);
+        }
+    }
+    return 1;
+}
+
+void aec_spk_mic_release(void) {
+    struct aec_engine* aec = engine;
+    if (aec == NULL) {
+        return;
+    }
+    engine = NULL;
+    free(aec->ref_time);
+    fft_release(aec->fft);
+    free(aec);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Reference echo canceller used by AEC_HAL builds.
+ *
+ * Partitioned-block frequency-domain NLMS filter (overlap-save, one filter per mic
+ * channel sharing the far-end spectra). Samples are 32-bit interleaved, in the layout
+ * of aec_t::mic_buf and aec_t::spk_buf.
+ */
+
+#ifndef _AUDIO_AEC_PROCESS_H_
+#define _AUDIO_AEC_PROCESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Block length in frames; period sizes must be a multiple of this. */
+#define AEC_BLOCK_SIZE 128
+/* Echo tail covered by the adaptive filter. */
+#define AEC_TAIL_LENGTH_MS 128
+
+/* Create the echo canceller. Returns 0 on success, -EINVAL or -ENOMEM otherwise. */
+int aec_spk_mic_init(int sampling_rate, int num_reference_channels, int num_microphone_channels);
+
+/* Clear the adaptive filters, e.g. after the echo path or the stream timing changed. */
+void aec_spk_mic_reset(void);
+
+/* Cancel the echo of 'spk_buf' from 'mic_buf', writing 'num_frames' cleaned frames to
+ * 'output' (which may alias 'mic_buf'). Returns non-zero on success, 0 on failure,
+ * in which case 'output' is not written. */
+int32_t aec_spk_mic_process(int32_t* spk_buf, uint64_t spk_time, int32_t* mic_buf,
+                            uint64_t mic_time, size_t num_frames, int32_t* output);
+
+void aec_spk_mic_release(void);
+
+#endif /* #ifndef _AUDIO_AEC_PROCESS_H_ */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_aec_trace"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <log/log.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <audio_utils/clock.h>
+
+#include "audio_aec_trace.h"
+
+/* Bounded MPMC queue slot (D. Vyukov): 'seq' == position when free for that lap,
+ * position + 1 once the record is committed. */
+struct aec_trace_slot {
+    atomic_uint seq;
+    struct aec_trace_record_header header;
+    uint8_t data[AEC_TRACE_MAX_PAYLOAD];
+};
+
+struct aec_trace {
+    atomic_bool enabled;
+    /* Producers between their 'enabled' check and the end of their record */
+    atomic_uint writers;
+    atomic_uint write_pos;
+    uint32_t read_pos;
+    struct aec_trace_slot* slots;
+
+    /* Drain thread state, only touched under 'lock' by the control path */
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool thread_running;
+    atomic_bool stop_requested;
+    int fd;
+
+    atomic_uint sequence;
+    atomic_uint_fast64_t recorded;
+    atomic_uint_fast64_t dropped;
+    atomic_uint_fast64_t bytes_written;
+};
+
+static uint64_t now_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return audio_utils_ns_from_timespec(&now);
+}
+
+struct aec_trace* aec_trace_init(void) {
+    struct aec_trace* trace = (struct aec_trace*)calloc(1, sizeof(struct aec_trace));
+    if (trace == NULL) {
+        ALOGE("%s: Unable to allocate memory for AEC trace.", __func__);
+        return NULL;
+    }
+    atomic_init(&trace->enabled, false);
+    atomic_init(&trace->writers, 0);
+    atomic_init(&trace->write_pos, 0);
+    atomic_init(&trace->stop_requested, false);
+    atomic_init(&trace->sequence, 0);
+    atomic_init(&trace->recorded, 0);
+    atomic_init(&trace->dropped, 0);
+    atomic_init(&trace->bytes_written, 0);
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->fd = -1;
+    return trace;
+}
+
+static int write_fully(int fd, const void* buf, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)buf;
+    while (bytes > 0) {
+        ssize_t ret = write(fd, p, bytes);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        p += ret;
+        bytes -= ret;
+    }
+    return 0;
+}
+
+/* Write every committed record to the trace file. Single consumer. */
+static void drain(struct aec_trace* trace) {
+    while (true) {
+        struct aec_trace_slot* slot = &trace->slots[trace->read_pos % AEC_TRACE_NUM_SLOTS];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != trace->read_pos + 1) {
+            return;
+        }
+        int ret = -EBADF;
+        if (trace->fd >= 0) {
+            ret = write_fully(trace->fd, &slot->header, sizeof(slot->header));
+            if (ret == 0) {
+                ret = write_fully(trace->fd, slot->data, slot->header.bytes);
+            }
+            if (ret < 0) {
+                /* A partial record would desync the reader: give up on the file */
+                ALOGE("%s: write failed: %s, closing trace file", __func__, strerror(-ret));
+                close(trace->fd);
+                trace->fd = -1;
+            }
+        }
+        if (ret == 0) {
+            atomic_fetch_add_explicit(&trace->bytes_written,
+                                      sizeof(slot->header) + slot->header.bytes,
+                                      memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&slot->seq, trace->read_pos + AEC_TRACE_NUM_SLOTS,
+                              memory_order_release);
+        trace->read_pos++;
+    }
+}
+
+static void* drain_thread_loop(void* context) {
+    struct aec_trace* trace = (struct aec_trace*)context;
+    const struct timespec period = {
+            .tv_sec = 0,
+            .tv_nsec = AEC_TRACE_DRAIN_PERIOD_MS * NANOS_PER_MILLISECOND,
+    };
+    while (!atomic_load_explicit(&trace->stop_requested, memory_order_acquire)) {
+        drain(trace);
+        nanosleep(&period, NULL);
+    }
+    drain(trace);
+    return NULL;
+}
+
+static int start_locked(struct aec_trace* trace) {
+    if (trace->slots == NULL) {
+        trace->slots = (struct aec_trace_slot*)calloc(AEC_TRACE_NUM_SLOTS,
+                                                      sizeof(struct aec_trace_slot));
+        if (trace->slots == NULL) {
+            ALOGE("%s: Unable to allocate AEC trace ring.", __func__);
+            return -ENOMEM;
+        }
+    }
+    /* The ring is empty when stopped, so positions can restart from zero */
+    for (uint32_t i = 0; i < AEC_TRACE_NUM_SLOTS; i++) {
+        atomic_store_explicit(&trace->slots[i].seq, i, memory_order_relaxed);
+    }
+    atomic_store_explicit(&trace->write_pos, 0, memory_order_relaxed);
+    trace->read_pos = 0;
+
+    trace->fd = open(AEC_TRACE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace->fd < 0) {
+        ALOGE("%s: Could not open %s: %s", __func__, AEC_TRACE_FILE, strerror(errno));
+        return -errno;
+    }
+    struct aec_trace_file_header file_header = {
+            .magic = AEC_TRACE_MAGIC,
+            .version = AEC_TRACE_VERSION,
+    };
+    if (write_fully(trace->fd, &file_header, sizeof(file_header))) {
+        ALOGE("%s: Could not write trace header", __func__);
+        close(trace->fd);
+        trace->fd = -1;
+        return -EIO;
+    }
+
+    atomic_store_explicit(&trace->stop_requested, false, memory_order_relaxed);
+    if (pthread_create(&trace->thread, NULL, drain_thread_loop, trace)) {
+        ALOGE("%s: Could not start drain thread", __func__);
+        close(trace->fd);
+        trace->fd = -1;
+        return -EINVAL;
+    }
+    trace->thread_running = true;
+    atomic_store_explicit(&trace->enabled, true, memory_order_release);
+    ALOGI("%s: AEC tracing to %s", __func__, AEC_TRACE_FILE);
+    return 0;
+}
+
+static void stop_locked(struct aec_trace* trace) {
+    /* Producers that saw 'enabled' may still be filling a slot: let them finish before
+     * the final drain, and before a restart resets the ring under them. Pairs with the
+     * increment-then-check in aec_trace_record(); both sides are sequentially consistent
+     * so one of them always sees the other. */
+    atomic_store(&trace->enabled, false);
+    while (atomic_load(&trace->writers) != 0) {
+        sched_yield();
+    }
+    if (trace->thread_running) {
+        atomic_store_explicit(&trace->stop_requested, true, memory_order_release);
+        pthread_join(trace->thread, NULL);
+        trace->thread_running = false;
+    }
+    if (trace->fd >= 0) {
+        close(trace->fd);
+        trace->fd = -1;
+    }
+}
+
+int aec_trace_set_enabled(struct aec_trace* trace, bool enable) {
+    if (trace == NULL) {
+        return -EINVAL;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&trace->lock);
+    if (enable && !trace->thread_running) {
+        ret = start_locked(trace);
+    } else if (!enable && trace->thread_running) {
+        stop_locked(trace);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return ret;
+}
+
+bool aec_trace_is_enabled(const struct aec_trace* trace) {
+    return (trace != NULL) && atomic_load_explicit(&trace->enabled, memory_order_relaxed);
+}
+
+void aec_trace_release(struct aec_trace* trace) {
+    if (trace == NULL) {
+        return;
+    }
+    aec_trace_set_enabled(trace, false);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->slots);
+    free(trace);
+}
+
+static void record(struct aec_trace* trace, enum aec_trace_type type, const void* data,
+                   size_t bytes, uint32_t sample_rate, uint16_t channels,
+                   uint16_t bits_per_sample, uint64_t stream_time_nsec,
+                   uint64_t aux_time_nsec) {
+    /* Numbered before claiming a slot, so dropped records show up as sequence gaps */
+    uint32_t sequence = atomic_fetch_add_explicit(&trace->sequence, 1, memory_order_relaxed);
+
+    /* Claim a slot */
+    struct aec_trace_slot* slot;
+    uint32_t pos = atomic_load_explicit(&trace->write_pos, memory_order_relaxed);
+    while (true) {
+        slot = &trace->slots[pos % AEC_TRACE_NUM_SLOTS];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            unsigned int expected = pos;
+            if (atomic_compare_exchange_weak_explicit(&trace->write_pos, &expected, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+            pos = expected;
+        } else if (diff < 0) {
+            /* Ring full, the drain thread is behind */
+            atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&trace->write_pos, memory_order_relaxed);
+        }
+    }
+
+    struct aec_trace_record_header* header = &slot->header;
+    header->type = type;
+    header->flags = 0;
+    if (bytes > AEC_TRACE_MAX_PAYLOAD) {
+        bytes = AEC_TRACE_MAX_PAYLOAD;
+        header->flags |= AEC_TRACE_FLAG_TRUNCATED;
+    }
+    header->bytes = bytes;
+    header->sample_rate = sample_rate;
+    header->channels = channels;
+    header->bits_per_sample = bits_per_sample;
+    header->sequence = sequence;
+    header->stream_time_nsec = stream_time_nsec;
+    header->aux_time_nsec = aux_time_nsec;
+    header->write_time_nsec = now_nsec();
+    memcpy(slot->data, data, bytes);
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&trace->recorded, 1, memory_order_relaxed);
+}
+
+void aec_trace_record(struct aec_trace* trace, enum aec_trace_type type, const void* data,
+                      size_t bytes, uint32_t sample_rate, uint16_t channels,
+                      uint16_t bits_per_sample, uint64_t stream_time_nsec,
+                      uint64_t aux_time_nsec) {
+    if ((trace == NULL) || !atomic_load_explicit(&trace->enabled, memory_order_relaxed)) {
+        return;
+    }
+    atomic_fetch_add(&trace->writers, 1);
+    if (atomic_load(&trace->enabled)) {
+        record(trace, type, data, bytes, sample_rate, channels, bits_per_sample,
+               stream_time_nsec, aux_time_nsec);
+    }
+    atomic_fetch_sub_explicit(&trace->writers, 1, memory_order_release);
+}
+
+void aec_trace_dump(const struct aec_trace* trace, int fd) {
+    if (trace == NULL) {
+        return;
+    }
+    dprintf(fd, "  AEC trace: %s (%s)\n", aec_trace_is_enabled(trace) ? "enabled" : "disabled",
+            AEC_TRACE_FILE);
+    dprintf(fd, "    Records: %" PRIuFAST64 ", dropped: %" PRIuFAST64 ", bytes written: %"
+            PRIuFAST64 "\n",
+            atomic_load_explicit(&trace->recorded, memory_order_relaxed),
+            atomic_load_explicit(&trace->dropped, memory_order_relaxed),
+            atomic_load_explicit(&trace->bytes_written, memory_order_relaxed));
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runtime AEC debug tracing.
+ *
+ * Audio threads copy mic/reference/output periods into a preallocated lock-free ring;
+ * a background thread drains it to AEC_TRACE_FILE. Enable with the property
+ * vendor.audio.aec_trace=1 or at runtime with the HAL parameter "aec_trace=on|off".
+ * Convert the result with tools/aec_trace_convert.py.
+ */
+
+#ifndef _AUDIO_AEC_TRACE_H_
+#define _AUDIO_AEC_TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AEC_TRACE_FILE "/data/local/traces/aec_trace.bin"
+#define AEC_TRACE_PROPERTY "vendor.audio.aec_trace"
+#define AEC_TRACE_PARAMETER "aec_trace"
+
+/* Ring geometry: 64 slots of up to 16 KiB, about 1 MiB allocated on first enable */
+#define AEC_TRACE_NUM_SLOTS 64
+#define AEC_TRACE_MAX_PAYLOAD 16384
+#define AEC_TRACE_DRAIN_PERIOD_MS 50
+
+/* File layout: one aec_trace_file_header, then records of
+ * (struct aec_trace_record_header, 'bytes' bytes of interleaved PCM). */
+#define AEC_TRACE_MAGIC 0x54434541 /* "AECT" */
+#define AEC_TRACE_VERSION 1
+
+enum aec_trace_type {
+    AEC_TRACE_MIC_IN = 0,     /* raw mic period entering process_aec() */
+    AEC_TRACE_REFERENCE,      /* reference period used by process_aec() */
+    AEC_TRACE_AEC_OUT,        /* process_aec() output */
+    AEC_TRACE_MIC_STREAM,     /* period returned by in_read() for a mic source */
+    AEC_TRACE_REF_STREAM,     /* period returned by in_read() for AUDIO_SOURCE_ECHO_REFERENCE */
+    AEC_TRACE_NUM_TYPES,
+};
+
+#define AEC_TRACE_FLAG_TRUNCATED 0x1
+
+struct aec_trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct aec_trace_record_header {
+    uint32_t type;
+    uint32_t flags;
+    uint32_t bytes;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint32_t sequence;
+    uint64_t stream_time_nsec;  /* timestamp of the first frame */
+    uint64_t aux_time_nsec;     /* reference timestamp for AEC records, else 0 */
+    uint64_t write_time_nsec;   /* CLOCK_MONOTONIC when recorded */
+};
+
+struct aec_trace;
+
+struct aec_trace* aec_trace_init(void);
+void aec_trace_release(struct aec_trace* trace);
+
+/* Start or stop tracing. Not to be called from audio threads: enabling allocates the
+ * ring and spawns the drain thread, disabling joins it. Returns 0 or a negative errno. */
+int aec_trace_set_enabled(struct aec_trace* trace, bool enable);
+bool aec_trace_is_enabled(const struct aec_trace* trace);
+
+/* Copy one period into the ring. Lock-free and safe from any thread; a no-op costing
+ * one atomic load when tracing is disabled. Records are dropped if the ring is full. */
+void aec_trace_record(struct aec_trace* trace, enum aec_trace_type type, const void* data,
+                      size_t bytes, uint32_t sample_rate, uint16_t channels,
+                      uint16_t bits_per_sample, uint64_t stream_time_nsec,
+                      uint64_t aux_time_nsec);
+
+void aec_trace_dump(const struct aec_trace* trace, int fd);
+
+#endif /* #ifndef _AUDIO_AEC_TRACE_H_ */
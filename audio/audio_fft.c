@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_fft"
+//#define LOG_NDEBUG 0
+
+#include <log/log.h>
+#include <malloc.h>
+#include <math.h>
+#include <string.h>
+
+#include "audio_fft.h"
+
+#ifdef __ARM_NEON
+#include "arm_neon.h"
+#endif /* #ifdef __ARM_NEON */
+
+audio_fft_t* fft_init(uint32_t size) {
+    if ((size < 4) || (size & (size - 1))) {
+        ALOGE("%s: FFT size %u is not a power of two >= 4.", __func__, size);
+        return NULL;
+    }
+
+    audio_fft_t* fft = (audio_fft_t*)calloc(1, sizeof(audio_fft_t));
+    if (fft == NULL) {
+        ALOGE("%s: Unable to allocate memory for FFT.", __func__);
+        return NULL;
+    }
+    fft->size = size;
+    fft->half_size = size / 2;
+    const uint32_t m = fft->half_size;
+
+    fft->bitrev = (uint32_t*)malloc(m * sizeof(uint32_t));
+    /* Per-stage twiddles (2 * m), post-processing twiddles (2 * (m + 1)), work buffers (2 * m) */
+    float* mem = (float*)malloc((6 * m + 2) * sizeof(float));
+    if ((fft->bitrev == NULL) || (mem == NULL)) {
+        ALOGE("%s: Unable to allocate memory for FFT tables.", __func__);
+        free(fft->bitrev);
+        free(mem);
+        free(fft);
+        return NULL;
+    }
+    fft->twiddle_re = mem;
+    fft->twiddle_im = fft->twiddle_re + m;
+    fft->post_re = fft->twiddle_im + m;
+    fft->post_im = fft->post_re + m + 1;
+    fft->work_re = fft->post_im + m + 1;
+    fft->work_im = fft->work_re + m;
+
+    uint32_t log2m = 0;
+    while ((1u << log2m) < m) {
+        log2m++;
+    }
+    for (uint32_t i = 0; i < m; i++) {
+        uint32_t r = 0;
+        for (uint32_t b = 0; b < log2m; b++) {
+            r |= ((i >> b) & 1) << (log2m - 1 - b);
+        }
+        fft->bitrev[i] = r;
+    }
+
+    for (uint32_t half = 1; half < m; half <<= 1) {
+        for (uint32_t k = 0; k < half; k++) {
+            double phase = -M_PI * k / half;
+            fft->twiddle_re[half - 1 + k] = (float)cos(phase);
+            fft->twiddle_im[half - 1 + k] = (float)sin(phase);
+        }
+    }
+    for (uint32_t k = 0; k <= m; k++) {
+        double phase = -2.0 * M_PI * k / size;
+        fft->post_re[k] = (float)cos(phase);
+        fft->post_im[k] = (float)sin(phase);
+    }
+    return fft;
+}
+
+void fft_release(audio_fft_t* fft) {
+    if (fft == NULL) {
+        return;
+    }
+    free(fft->twiddle_re);
+    free(fft->bitrev);
+    free(fft);
+}
+
+/* In-place radix-2 DIT butterflies on bit-reversed input in work_re/work_im. */
+static void fft_complex(audio_fft_t* fft) {
+    const uint32_t m = fft->half_size;
+    float* re = fft->work_re;
+    float* im = fft->work_im;
+
+    for (uint32_t half = 1; half < m; half <<= 1) {
+        const float* tw_re = &fft->twiddle_re[half - 1];
+        const float* tw_im = &fft->twiddle_im[half - 1];
+        for (uint32_t start = 0; start < m; start += 2 * half) {
+            float* a_re = &re[start];
+            float* a_im = &im[start];
+            float* b_re = &re[start + half];
+            float* b_im = &im[start + half];
+            uint32_t k = 0;
+#ifdef __ARM_NEON
+            for (; k + 4 <= half; k += 4) {
+                float32x4_t wr = vld1q_f32(&tw_re[k]);
+                float32x4_t wi = vld1q_f32(&tw_im[k]);
+                float32x4_t br = vld1q_f32(&b_re[k]);
+                float32x4_t bi = vld1q_f32(&b_im[k]);
+                float32x4_t tr = vmlsq_f32(vmulq_f32(wr, br), wi, bi);
+                float32x4_t ti = vmlaq_f32(vmulq_f32(wr, bi), wi, br);
+                float32x4_t ar = vld1q_f32(&a_re[k]);
+                float32x4_t ai = vld1q_f32(&a_im[k]);
+                vst1q_f32(&b_re[k], vsubq_f32(ar, tr));
+                vst1q_f32(&b_im[k], vsubq_f32(ai, ti));
+                vst1q_f32(&a_re[k], vaddq_f32(ar, tr));
+                vst1q_f32(&a_im[k], vaddq_f32(ai, ti));
+            }
+#endif /* #ifdef __ARM_NEON */
+            for (; k < half; k++) {
+                float tr = tw_re[k] * b_re[k] - tw_im[k] * b_im[k];
+                float ti = tw_re[k] * b_im[k] + tw_im[k] * b_re[k];
+                b_re[k] = a_re[k] - tr;
+                b_im[k] = a_im[k] - ti;
+                a_re[k] += tr;
+                a_im[k] += ti;
+            }
+        }
+    }
+}
+
+void fft_forward_real(audio_fft_t* fft, const float* in, float* re, float* im) {
+    const uint32_t m = fft->half_size;
+    float* z_re = fft->work_re;
+    float* z_im = fft->work_im;
+
+    /* Pack even/odd samples as real/imaginary parts of an m-point sequence */
+    for (uint32_t n = 0; n < m; n++) {
+        z_re[fft->bitrev[n]] = in[2 * n];
+        z_im[fft->bitrev[n]] = in[2 * n + 1];
+    }
+    fft_complex(fft);
+
+    /* Split into the spectra of the even and odd samples and recombine */
+    for (uint32_t k = 0; k <= m; k++) {
+        uint32_t i = (k == m) ? 0 : k;
+        uint32_t j = (k == 0) ? 0 : m - k;
+        float fe_re = 0.5f * (z_re[i] + z_re[j]);
+        float fe_im = 0.5f * (z_im[i] - z_im[j]);
+        float fo_re = 0.5f * (z_im[i] + z_im[j]);
+        float fo_im = -0.5f * (z_re[i] - z_re[j]);
+        re[k] = fe_re + fft->post_re[k] * fo_re - fft->post_im[k] * fo_im;
+        im[k] = fe_im + fft->post_re[k] * fo_im + fft->post_im[k] * fo_re;
+    }
+}
+
+void fft_inverse_real(audio_fft_t* fft, const float* re, const float* im, float* out) {
+    const uint32_t m = fft->half_size;
+    float* z_re = fft->work_re;
+    float* z_im = fft->work_im;
+
+    /* Rebuild the packed m-point spectrum, conjugated so the forward kernel computes the inverse */
+    for (uint32_t k = 0; k < m; k++) {
+        float fe_re = 0.5f * (re[k] + re[m - k]);
+        float fe_im = 0.5f * (im[k] - im[m - k]);
+        float d_re = re[k] - re[m - k];
+        float d_im = im[k] + im[m - k];
+        float fo_re = 0.5f * (d_re * fft->post_re[k] + d_im * fft->post_im[k]);
+        float fo_im = 0.5f * (d_im * fft->post_re[k] - d_re * fft->post_im[k]);
+        z_re[fft->bitrev[k]] = fe_re - fo_im;
+        z_im[fft->bitrev[k]] = -(fe_im + fo_re);
+    }
+    fft_complex(fft);
+
+    const float scale = 1.0f / m;
+    for (uint32_t n = 0; n < m; n++) {
+        out[2 * n] = z_re[n] * scale;
+        out[2 * n + 1] = -z_im[n] * scale;
+    }
+}
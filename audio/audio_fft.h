@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_FFT_H
+#define AUDIO_FFT_H
+
+#include <stdint.h>
+
+/* Real-input FFT of power-of-two size N, computed as an N/2-point complex FFT.
+ * Spectra are stored split-complex (separate real and imaginary arrays) with
+ * N/2 + 1 bins, which keeps the per-bin loops of callers SIMD friendly. */
+typedef struct audio_fft {
+    uint32_t size;      /* N, number of real samples */
+    uint32_t half_size; /* N/2, size of the complex FFT */
+    uint32_t* bitrev;
+    float* twiddle_re;  /* per-stage twiddles, stage with half-length m at offset m - 1 */
+    float* twiddle_im;
+    float* post_re;     /* e^(-2*pi*i*k/N), k = 0..N/2 */
+    float* post_im;
+    float* work_re;
+    float* work_im;
+} audio_fft_t;
+
+audio_fft_t* fft_init(uint32_t size);
+void fft_release(audio_fft_t* fft);
+/* 'in' holds N samples, 're'/'im' receive N/2 + 1 bins. */
+void fft_forward_real(audio_fft_t* fft, const float* in, float* re, float* im);
+/* Inverse of fft_forward_real(), including the 1/N scaling. */
+void fft_inverse_real(audio_fft_t* fft, const float* re, const float* im, float* out);
+
+#endif /* #ifndef AUDIO_FFT_H */
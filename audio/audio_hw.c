@@ -40,6 +40,7 @@
 #include <audio_route/audio_route.h>
 #include <audio_utils/clock.h>
 #include <audio_utils/echo_reference.h>
+#include <audio_utils/primitives.h>
 #include <audio_utils/resampler.h>
 #include <hardware/audio_alsaops.h>
 #include <hardware/audio_effect.h>
@@ -73,6 +74,66 @@ static int get_audio_output_port(audio_devices_t devices) {
     return port;
 }
 
+/* Mixer paths per device. Looked up once in MIXER_XML_PATH at adev_open(), paths the
+ * XML doesn't define are skipped from then on. */
+static const struct route_path {
+    bool input;
+    audio_devices_t devices;
+    const char* name;
+} route_paths[] = {
+    {false, AUDIO_DEVICE_OUT_SPEAKER, "speaker"},
+    {false, AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE, "headphones"},
+    {false, AUDIO_DEVICE_OUT_AUX_DIGITAL, "hdmi"},
+    {true, AUDIO_DEVICE_IN_BUILTIN_MIC, "builtin-mic"},
+    {true, AUDIO_DEVICE_IN_WIRED_HEADSET, "headset-mic"},
+};
+#define NUM_ROUTE_PATHS (sizeof(route_paths) / sizeof(route_paths[0]))
+
+static void init_route_paths(struct alsa_audio_device *adev)
+{
+    adev->route_paths_available = 0;
+    for (size_t i = 0; i < NUM_ROUTE_PATHS; i++) {
+        if (audio_route_apply_path(adev->audio_route, route_paths[i].name) == 0) {
+            adev->route_paths_available |= 1u << i;
+        }
+    }
+    /* Only probed, nothing has been written to the mixer yet */
+    audio_route_reset(adev->audio_route);
+    adev->route_paths_applied = 0;
+    ALOGI("%s: %d of %zu mixer paths available", __func__,
+          __builtin_popcount(adev->route_paths_available), NUM_ROUTE_PATHS);
+}
+
+/* Apply the mixer paths for adev->out_devices and adev->in_devices as one update.
+ * audio_route keeps the resolved controls and their current values, so only the
+ * controls that differ from the previous route are written. Called with adev->lock held. */
+static void select_devices(struct alsa_audio_device *adev)
+{
+    uint32_t wanted = 0;
+    for (size_t i = 0; i < NUM_ROUTE_PATHS; i++) {
+        if (!(adev->route_paths_available & (1u << i))) {
+            continue;
+        }
+        audio_devices_t devices = route_paths[i].input ?
+                (adev->in_devices & ~AUDIO_DEVICE_BIT_IN) : adev->out_devices;
+        if (devices & route_paths[i].devices & ~AUDIO_DEVICE_BIT_IN) {
+            wanted |= 1u << i;
+        }
+    }
+    if (wanted == adev->route_paths_applied) {
+        return;
+    }
+    audio_route_reset(adev->audio_route);
+    for (size_t i = 0; i < NUM_ROUTE_PATHS; i++) {
+        if (wanted & (1u << i)) {
+            audio_route_apply_path(adev->audio_route, route_paths[i].name);
+        }
+    }
+    audio_route_update_mixer(adev->audio_route);
+    ALOGV("%s: route paths 0x%x -> 0x%x", __func__, adev->route_paths_applied, wanted);
+    adev->route_paths_applied = wanted;
+}
+
 static void timestamp_adjust(struct timespec* ts, ssize_t frames, uint32_t sampling_rate) {
     /* This function assumes the adjustment (in nsec) is less than the max value of long,
      * which for 32-bit long this is 2^31 * 1e-9 seconds, slightly over 2 seconds.
@@ -104,7 +165,7 @@ static int get_pcm_timestamp(struct pcm* pcm, uint32_t sample_rate, struct aec_i
     if (isOutput) {
         frames = pcm_get_buffer_size(pcm) - info->available;
     } else {
-        frames = -info->available; /* rewind timestamp */
+        frames = -(ssize_t)info->available; /* rewind timestamp */
     }
     timestamp_adjust(&info->timestamp, frames, sample_rate);
     return ret;
@@ -160,23 +221,41 @@ static void out_set_eq(struct alsa_stream_out* out) {
     free(speaker_eq_coeffs);
 }
 
-/* must be called with hw device and output stream mutexes locked */
+/* must be called with hw device and output stream mutexes locked. A running stream
+ * only switches at a drain point, see out_buffer_switch_due(). */
+static bool out_wants_deep_buffer(const struct alsa_stream_out *out)
+{
+    return out->dev->screen_off;
+}
+
+static void out_set_pcm_config(struct alsa_stream_out *out, bool deep_buffer)
+{
+    if (deep_buffer) {
+        out->config.period_size = DEEP_BUFFER_PERIOD_SIZE;
+        out->config.period_count = DEEP_BUFFER_PERIOD_COUNT;
+        out->config.start_threshold = DEEP_BUFFER_PERIOD_START_THRESHOLD * DEEP_BUFFER_PERIOD_SIZE;
+    } else {
+        out->config.period_size = PLAYBACK_PERIOD_SIZE;
+        out->config.period_count = PLAYBACK_PERIOD_COUNT;
+        out->config.start_threshold = PLAYBACK_PERIOD_START_THRESHOLD * PLAYBACK_PERIOD_SIZE;
+    }
+    out->config.avail_min = out->config.period_size;
+    out->write_threshold = out->config.period_count * out->config.period_size;
+    out->deep_buffer = deep_buffer;
+}
+
 static int start_output_stream(struct alsa_stream_out *out)
 {
     struct alsa_audio_device *adev = out->dev;
 
-    /* default to low power: will be corrected in out_write if necessary before first write to
-     * tinyalsa.
-     */
-    out->write_threshold = PLAYBACK_PERIOD_COUNT * PLAYBACK_PERIOD_SIZE;
-    out->config.start_threshold = PLAYBACK_PERIOD_START_THRESHOLD * PLAYBACK_PERIOD_SIZE;
-    out->config.avail_min = PLAYBACK_PERIOD_SIZE;
+    out_set_pcm_config(out, out_wants_deep_buffer(out));
     out->unavailable = true;
     unsigned int pcm_retry_count = PCM_OPEN_RETRIES;
     int out_port = get_audio_output_port(out->devices);
 
     while (1) {
-        out->pcm = pcm_open(CARD_OUT, out_port, PCM_OUT | PCM_MONOTONIC, &out->config);
+        out->pcm = pcm_open(CARD_OUT, out_port, PCM_OUT | PCM_MONOTONIC | PCM_NORESTART,
+                            &out->config);
         if ((out->pcm != NULL) && pcm_is_ready(out->pcm)) {
             break;
         } else {
@@ -194,9 +273,60 @@ static int start_output_stream(struct alsa_stream_out *out)
     }
     out->unavailable = false;
     adev->active_output = out;
+    ALOGV("%s: %s buffer, %u x %u frames", __func__, out->deep_buffer ? "deep" : "normal",
+          out->config.period_count, out->config.period_size);
     return 0;
 }
 
+/* (Re)open the PCM with the buffer size the stream wants now, and size the AEC
+ * reference for it. Only called when nothing is queued: leaving standby, after an
+ * underrun, or once out_buffer_switch_due() has let the queue play out. Called with the
+ * stream lock held. */
+static int out_reopen_output_stream(struct alsa_stream_out *out)
+{
+    const bool was_deep_buffer = out->deep_buffer;
+    if (out->pcm != NULL) {
+        pcm_close(out->pcm);
+        out->pcm = NULL;
+    }
+    out->buffer_switch_nsec = 0;
+    int ret = start_output_stream(out);
+    if ((ret == 0) && (out->deep_buffer != was_deep_buffer)) {
+        ALOGV("%s: switched to the %s buffer", __func__, out->deep_buffer ? "deep" : "normal");
+        out->stats.buffer_switches++;
+        ret = init_aec_reference_config(out->dev->aec, out);
+    }
+    return ret;
+}
+
+/* Whether a running stream should switch buffer size before this write. The switch is
+ * made at a drain point: once no more than a period is queued, which happens whenever
+ * the writer pauses or falls behind, or after OUT_BUFFER_SWITCH_TIMEOUT_MS of steady
+ * writing that keeps the queue full. Returns the frames still queued in '*queued', to
+ * be played out before the PCM is closed. Called with the stream lock held. */
+static bool out_buffer_switch_due(struct alsa_stream_out *out, bool wants_deep_buffer,
+                                  unsigned int *queued)
+{
+    if ((out->deep_buffer == wants_deep_buffer) || (out->pcm == NULL)) {
+        out->buffer_switch_nsec = 0;
+        return false;
+    }
+    const uint64_t now_nsec = stream_stats_now_nsec();
+    if (out->buffer_switch_nsec == 0) {
+        out->buffer_switch_nsec = now_nsec;
+    }
+    unsigned int avail;
+    struct timespec timestamp;
+    if (pcm_get_htimestamp(out->pcm, &avail, &timestamp) < 0) {
+        /* Not started yet, e.g. still below the start threshold */
+        return false;
+    }
+    const unsigned int buffer_size = pcm_get_buffer_size(out->pcm);
+    *queued = (avail < buffer_size) ? buffer_size - avail : 0;
+    return (*queued <= out->config.period_size) ||
+           (now_nsec - out->buffer_switch_nsec >= OUT_BUFFER_SWITCH_TIMEOUT_MS * 1000000ULL);
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
@@ -240,22 +370,122 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
     return -ENOSYS;
 }
 
+/* Close the PCM now. Called with the device and stream locks held. */
 static int do_output_standby(struct alsa_stream_out *out)
 {
     struct alsa_audio_device *adev = out->dev;
 
     fir_reset(out->speaker_eq);
 
-    if (!out->standby) {
+    if (out->pcm != NULL) {
         pcm_close(out->pcm);
         out->pcm = NULL;
         adev->active_output = NULL;
+    }
+    if (!out->standby) {
         out->standby = 1;
+        out->stats.standbys++;
+    }
+    out->standby_close_nsec = 0;
+    aec_set_spk_running(adev->aec, false);
+    return 0;
+}
+
+/* Stop the PCM but leave it open for standby_delay_ms, so that playback resuming
+ * shortly after doesn't pay for pcm_open() and routing again. If it isn't reused,
+ * standby_thread_loop() closes it. Called with the device and stream locks held. */
+static int do_output_standby_deferred(struct alsa_stream_out *out)
+{
+    struct alsa_audio_device *adev = out->dev;
+
+    if ((adev->standby_delay_ms == 0) || !adev->standby_thread_running) {
+        return do_output_standby(out);
+    }
+    if (out->standby) {
+        return 0;
     }
+
+    fir_reset(out->speaker_eq);
+    pcm_stop(out->pcm);
+    out->standby = 1;
+    out->stats.standbys++;
+    out->standby_close_nsec = stream_stats_now_nsec() +
+                              (uint64_t)adev->standby_delay_ms * NANOS_PER_MILLISECOND;
+    pthread_cond_signal(&adev->standby_cond);
     aec_set_spk_running(adev->aec, false);
     return 0;
 }
 
+static void* standby_thread_loop(void* context)
+{
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)context;
+
+    pthread_mutex_lock(&adev->lock);
+    while (!adev->standby_thread_exit) {
+        uint64_t deadline_nsec = 0;
+        struct alsa_stream_out *out = adev->active_output;
+        if (out != NULL) {
+            pthread_mutex_lock(&out->lock);
+            if (out->standby && (out->standby_close_nsec != 0)) {
+                if (stream_stats_now_nsec() >= out->standby_close_nsec) {
+                    ALOGV("%s: closing output after deferred standby", __func__);
+                    do_output_standby(out);
+                    out->stats.deferred_closes++;
+                } else {
+                    deadline_nsec = out->standby_close_nsec;
+                }
+            }
+            pthread_mutex_unlock(&out->lock);
+        }
+        if (deadline_nsec != 0) {
+            struct timespec deadline = {
+                    .tv_sec = deadline_nsec / NANOS_PER_SECOND,
+                    .tv_nsec = deadline_nsec % NANOS_PER_SECOND,
+            };
+            pthread_cond_timedwait(&adev->standby_cond, &adev->lock, &deadline);
+        } else {
+            pthread_cond_wait(&adev->standby_cond, &adev->lock);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+    return NULL;
+}
+
+static void start_standby_thread(struct alsa_audio_device *adev)
+{
+    adev->standby_delay_ms = property_get_int32(OUT_STANDBY_DELAY_PROPERTY,
+                                                OUT_STANDBY_DELAY_MS);
+    if (adev->standby_delay_ms == 0) {
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    adev->standby_thread_exit = false;
+    if (pthread_create(&adev->standby_thread, NULL, standby_thread_loop, adev)) {
+        ALOGE("%s: Could not start standby thread, standby won't be deferred", __func__);
+        pthread_cond_destroy(&adev->standby_cond);
+        return;
+    }
+    adev->standby_thread_running = true;
+}
+
+static void stop_standby_thread(struct alsa_audio_device *adev)
+{
+    if (!adev->standby_thread_running) {
+        return;
+    }
+    pthread_mutex_lock(&adev->lock);
+    adev->standby_thread_exit = true;
+    pthread_cond_signal(&adev->standby_cond);
+    pthread_mutex_unlock(&adev->lock);
+    pthread_join(adev->standby_thread, NULL);
+    pthread_cond_destroy(&adev->standby_cond);
+    adev->standby_thread_running = false;
+}
+
 static int out_standby(struct audio_stream *stream)
 {
     ALOGV("out_standby");
@@ -264,7 +494,7 @@ static int out_standby(struct audio_stream *stream)
 
     pthread_mutex_lock(&out->dev->lock);
     pthread_mutex_lock(&out->lock);
-    status = do_output_standby(out);
+    status = do_output_standby_deferred(out);
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
     return status;
@@ -273,6 +503,8 @@ static int out_standby(struct audio_stream *stream)
 static int out_dump(const struct audio_stream *stream, int fd)
 {
     ALOGV("out_dump");
+    const struct alsa_stream_out *out = (const struct alsa_stream_out *)stream;
+    stream_stats_dump(&out->stats, "Output stream", fd);
     return 0;
 }
 
@@ -295,6 +527,8 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         if (((out->devices & AUDIO_DEVICE_OUT_ALL) != val) && (val != 0)) {
             out->devices &= ~AUDIO_DEVICE_OUT_ALL;
             out->devices |= val;
+            adev->out_devices = out->devices;
+            select_devices(adev);
         }
         pthread_mutex_unlock(&out->lock);
         pthread_mutex_unlock(&adev->lock);
@@ -314,14 +548,22 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     ALOGV("out_get_latency");
     struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
-    return (PLAYBACK_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT * 1000) / out->config.rate;
+    return (out->config.period_size * out->config.period_count * 1000) / out->config.rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
         float right)
 {
     ALOGV("out_set_volume: Left:%f Right:%f", left, right);
-    return -ENOSYS;
+    struct alsa_stream_out *out = (struct alsa_stream_out *)stream;
+    if ((left < 0.0f) || (left > 1.0f) || (right < 0.0f) || (right > 1.0f)) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&out->lock);
+    out->volume[0] = left;
+    out->volume[1] = right;
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -332,6 +574,7 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     struct alsa_audio_device *adev = out->dev;
     size_t frame_size = audio_stream_out_frame_size(stream);
     size_t out_frames = bytes / frame_size;
+    const uint64_t call_start_nsec = stream_stats_now_nsec();
 
     ALOGV("%s: devices: %d, bytes %zu", __func__, out->devices, bytes);
 
@@ -341,25 +584,86 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
      */
     pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
+    latency_histogram_add(&out->stats.lock_wait, stream_stats_now_nsec() - call_start_nsec);
+    const bool wants_deep_buffer = out_wants_deep_buffer(out);
     if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+        if ((out->pcm != NULL) && (out->deep_buffer == wants_deep_buffer)) {
+            /* Still open from a deferred standby, pcm_write() restarts it */
+            out->standby_close_nsec = 0;
+            out->stats.reopens_avoided++;
+        } else {
+            out->standby_close_nsec = 0;
+            ret = out_reopen_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
         }
         out->standby = 0;
         aec_set_spk_running(adev->aec, true);
     }
+    float master_volume = adev->master_mute ? 0.0f : adev->master_volume;
+    volume_ramp_set_target(&out->volume_ramp, out->volume[0] * master_volume,
+                           out->volume[1] * master_volume);
 
     pthread_mutex_unlock(&adev->lock);
 
+    unsigned int queued;
+    if (out_buffer_switch_due(out, wants_deep_buffer, &queued)) {
+        /* Play out what is queued rather than drop it, then reopen */
+        usleep((uint64_t)queued * 1000000 / out->config.rate);
+        ret = out_reopen_output_stream(out);
+        if (ret != 0) {
+            /* The next write tries again */
+            out->standby = 1;
+            goto exit;
+        }
+        aec_set_spk_running(adev->aec, true);
+    }
+
+    const uint64_t dsp_start_nsec = stream_stats_now_nsec();
     if (out->speaker_eq != NULL) {
-        fir_process_interleaved(out->speaker_eq, (int16_t*)buffer, (int16_t*)buffer, out_frames);
+        /* Volume rides along with the EQ, one pass over the buffer */
+        if (volume_ramp_is_unity(&out->volume_ramp)) {
+            fir_process_interleaved(out->speaker_eq, (int16_t*)buffer, (int16_t*)buffer,
+                                    out_frames);
+        } else {
+            fir_process_interleaved_gain(out->speaker_eq, (int16_t*)buffer, (int16_t*)buffer,
+                                         out_frames, out->volume_ramp.gain,
+                                         out->volume_ramp.target);
+            volume_ramp_complete(&out->volume_ramp);
+        }
+    } else {
+        volume_ramp_process(&out->volume_ramp, (int16_t*)buffer, out_frames,
+                            out->config.channels);
     }
+    latency_histogram_add(&out->stats.dsp, stream_stats_now_nsec() - dsp_start_nsec);
 
+    const uint64_t write_start_nsec = stream_stats_now_nsec();
     ret = pcm_write(out->pcm, buffer, out_frames * frame_size);
+    if (ret == -EPIPE) {
+        /* Underrun. The PCM is opened with PCM_NORESTART so that it is reported: recover
+         * and write again. Nothing is queued, so a pending buffer size change is made now. */
+        out->stats.xruns++;
+        if (out->deep_buffer != wants_deep_buffer) {
+            ret = out_reopen_output_stream(out);
+            if (ret == 0) {
+                aec_set_spk_running(adev->aec, true);
+            } else {
+                /* The next write tries again */
+                out->standby = 1;
+            }
+        } else {
+            ret = pcm_prepare(out->pcm);
+        }
+        if (ret == 0) {
+            ret = pcm_write(out->pcm, buffer, out_frames * frame_size);
+        }
+    }
+    latency_histogram_add(&out->stats.blocked, stream_stats_now_nsec() - write_start_nsec);
     if (ret == 0) {
         out->frames_written += out_frames;
+        out->stats.frames += out_frames;
 
         struct aec_info info;
         get_pcm_timestamp(out->pcm, out->config.rate, &info, true /*isOutput*/);
@@ -375,10 +679,12 @@ exit:
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
+        out->stats.errors++;
         usleep((int64_t)bytes * 1000000 / audio_stream_out_frame_size(stream) /
                 out_get_sample_rate(&stream->common));
     }
 
+    latency_histogram_add(&out->stats.call, stream_stats_now_nsec() - call_start_nsec);
     return bytes;
 }
 
@@ -436,7 +742,8 @@ static int start_input_stream(struct alsa_stream_in *in)
     unsigned int pcm_retry_count = PCM_OPEN_RETRIES;
 
     while (1) {
-        in->pcm = pcm_open(CARD_IN, PORT_BUILTIN_MIC, PCM_IN | PCM_MONOTONIC, &in->config);
+        in->pcm = pcm_open(CARD_IN, PORT_BUILTIN_MIC, PCM_IN | PCM_MONOTONIC | PCM_NORESTART,
+                           &in->config);
         if ((in->pcm != NULL) && pcm_is_ready(in->pcm)) {
             break;
         } else {
@@ -454,33 +761,51 @@ static int start_input_stream(struct alsa_stream_in *in)
     }
     in->unavailable = false;
     adev->active_input = in;
+    capture_dsp_reset(in->capture_dsp);
+    beamformer_reset(in->beamformer);
     return 0;
 }
 
-static void get_mic_characteristics(struct audio_microphone_characteristic_t* mic_data,
+/* One mic, unless a mic geometry is configured for the beamformer */
+static void get_mic_characteristics(const beamformer_geometry_t* geometry,
+                                    struct audio_microphone_characteristic_t* mic_array,
                                     size_t* mic_count) {
-    *mic_count = 1;
-    memset(mic_data, 0, sizeof(struct audio_microphone_characteristic_t));
-    strlcpy(mic_data->device_id, "builtin_mic", AUDIO_MICROPHONE_ID_MAX_LEN - 1);
-    strlcpy(mic_data->address, "top", AUDIO_DEVICE_MAX_ADDRESS_LEN - 1);
-    memset(mic_data->channel_mapping, AUDIO_MICROPHONE_CHANNEL_MAPPING_UNUSED,
-           sizeof(mic_data->channel_mapping));
-    mic_data->device = AUDIO_DEVICE_IN_BUILTIN_MIC;
-    mic_data->sensitivity = -37.0;
-    mic_data->max_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
-    mic_data->min_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
-    mic_data->orientation.x = 0.0f;
-    mic_data->orientation.y = 0.0f;
-    mic_data->orientation.z = 0.0f;
-    mic_data->geometric_location.x = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
-    mic_data->geometric_location.y = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
-    mic_data->geometric_location.z = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
+    *mic_count = (geometry->num_mics > 1) ? geometry->num_mics : 1;
+    for (size_t idx = 0; idx < *mic_count; idx++) {
+        struct audio_microphone_characteristic_t* mic_data = &mic_array[idx];
+        memset(mic_data, 0, sizeof(struct audio_microphone_characteristic_t));
+        if (idx == 0) {
+            strlcpy(mic_data->device_id, "builtin_mic", AUDIO_MICROPHONE_ID_MAX_LEN - 1);
+            strlcpy(mic_data->address, "top", AUDIO_DEVICE_MAX_ADDRESS_LEN - 1);
+        } else {
+            snprintf(mic_data->device_id, AUDIO_MICROPHONE_ID_MAX_LEN, "builtin_mic_%zu", idx);
+            snprintf(mic_data->address, AUDIO_DEVICE_MAX_ADDRESS_LEN, "mic_%zu", idx);
+        }
+        memset(mic_data->channel_mapping, AUDIO_MICROPHONE_CHANNEL_MAPPING_UNUSED,
+               sizeof(mic_data->channel_mapping));
+        mic_data->device = AUDIO_DEVICE_IN_BUILTIN_MIC;
+        mic_data->sensitivity = -37.0;
+        mic_data->max_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
+        mic_data->min_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
+        mic_data->orientation.x = 0.0f;
+        mic_data->orientation.y = 0.0f;
+        mic_data->orientation.z = 0.0f;
+        if (geometry->num_mics > 1) {
+            mic_data->geometric_location.x = geometry->positions[idx][0];
+            mic_data->geometric_location.y = geometry->positions[idx][1];
+            mic_data->geometric_location.z = geometry->positions[idx][2];
+        } else {
+            mic_data->geometric_location.x = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
+            mic_data->geometric_location.y = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
+            mic_data->geometric_location.z = AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
+        }
+    }
 }
 
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    return in->config.rate;
+    return in->stream_rate;
 }
 
 static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -503,15 +828,19 @@ static size_t get_input_buffer_size(size_t frames, audio_format_t format,
 static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    ALOGV("in_get_channels: %d", in->config.channels);
-    return audio_channel_in_mask_from_count(in->config.channels);
+    ALOGV("in_get_channels: %d", in->stream_channels);
+    if (in->stream_channels > CHANNEL_STEREO) {
+        /* Raw mic channels have no position */
+        return audio_channel_mask_for_index_assignment_from_count(in->stream_channels);
+    }
+    return audio_channel_in_mask_from_count(in->stream_channels);
 }
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
     struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
-    ALOGV("in_get_format: %d", in->config.format);
-    return audio_format_from_pcm_format(in->config.format);
+    ALOGV("in_get_format: %d", in->stream_format);
+    return in->stream_format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -522,10 +851,8 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
     struct alsa_stream_in* in = (struct alsa_stream_in*)stream;
-    size_t frames = CAPTURE_PERIOD_SIZE;
-    if (in->source == AUDIO_SOURCE_ECHO_REFERENCE) {
-        frames = CAPTURE_PERIOD_SIZE * PLAYBACK_CODEC_SAMPLING_RATE / CAPTURE_CODEC_SAMPLING_RATE;
-    }
+    /* One capture period, in stream frames */
+    size_t frames = (size_t)in->config.period_size * in->stream_rate / in->config.rate;
 
     size_t buffer_size =
             get_input_buffer_size(frames, stream->get_format(stream), stream->get_channels(stream));
@@ -549,6 +876,18 @@ static int in_get_active_microphones(const struct audio_stream_in* stream,
         return 0;
     }
     adev_get_microphones(dev, mic_array, mic_count);
+    /* Combined channels come from every mic, otherwise channel i is mic i */
+    bool combined = (in->beamformer != NULL) ||
+                    ((in->stream_channels == 1) && (in->config.channels > 1));
+    for (size_t idx = 0; idx < *mic_count; idx++) {
+        for (size_t ch = 0; ch < in->stream_channels; ch++) {
+            if (combined) {
+                mic_array[idx].channel_mapping[ch] = AUDIO_MICROPHONE_CHANNEL_MAPPING_PROCESSED;
+            } else if (ch == idx) {
+                mic_array[idx].channel_mapping[ch] = AUDIO_MICROPHONE_CHANNEL_MAPPING_DIRECT;
+            }
+        }
+    }
     return 0;
 }
 
@@ -561,6 +900,13 @@ static int do_input_standby(struct alsa_stream_in *in)
         in->pcm = NULL;
         adev->active_input = NULL;
         in->standby = true;
+        in->stats.standbys++;
+        /* Drop converted frames left over from before standby */
+        in->stage_frames = 0;
+        in->stage_offset = 0;
+        if (in->resampler != NULL) {
+            in->resampler->reset(in->resampler);
+        }
     }
     return 0;
 }
@@ -585,10 +931,12 @@ static int in_dump(const struct audio_stream *stream, int fd)
         return 0;
     }
 
+    stream_stats_dump(&in->stats, "Input stream", fd);
+
     struct audio_microphone_characteristic_t mic_array[AUDIO_MICROPHONE_MAX_COUNT];
     size_t mic_count;
 
-    get_mic_characteristics(mic_array, &mic_count);
+    get_mic_characteristics(&in->dev->mic_geometry, mic_array, &mic_count);
 
     dprintf(fd, "  Microphone count: %zd\n", mic_count);
     size_t idx;
@@ -604,6 +952,34 @@ static int in_dump(const struct audio_stream *stream, int fd)
 
 static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
+    ALOGV("in_set_parameters");
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    struct alsa_audio_device *adev = in->dev;
+    struct str_parms *parms;
+    char value[32];
+    int ret, val = 0;
+
+    if (in->source == AUDIO_SOURCE_ECHO_REFERENCE) {
+        return 0;
+    }
+
+    parms = str_parms_create_str(kvpairs);
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
+    if (ret >= 0) {
+        val = atoi(value);
+        pthread_mutex_lock(&in->lock);
+        pthread_mutex_lock(&adev->lock);
+        if ((in->devices != (audio_devices_t)val) && (val != 0)) {
+            in->devices = val;
+            adev->in_devices = in->devices;
+            select_devices(adev);
+        }
+        pthread_mutex_unlock(&adev->lock);
+        pthread_mutex_unlock(&in->lock);
+    }
+
+    str_parms_destroy(parms);
     return 0;
 }
 
@@ -615,72 +991,27 @@ static char * in_get_parameters(const struct audio_stream *stream,
 
 static int in_set_gain(struct audio_stream_in *stream, float gain)
 {
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    if (in->capture_dsp == NULL) {
+        return -ENOSYS;
+    }
+    capture_dsp_set_gain(in->capture_dsp, gain);
     return 0;
 }
 
-static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
-        size_t bytes)
+static size_t in_pcm_frame_size(const struct alsa_stream_in *in)
+{
+    return in->config.channels * pcm_format_to_bits(in->config.format) / 8;
+}
+
+/* Read 'bytes' in the PCM's own format and run the capture processing on them. */
+static int in_read_pcm(struct alsa_stream_in *in, void* buffer, size_t bytes)
 {
     int ret;
-    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
     struct alsa_audio_device *adev = in->dev;
-    size_t frame_size = audio_stream_in_frame_size(stream);
-    size_t in_frames = bytes / frame_size;
-
-    ALOGV("in_read: stream: %d, bytes %zu", in->source, bytes);
-
-    /* Special handling for Echo Reference: simply get the reference from FIFO.
-     * The format and sample rate should be specified by arguments to adev_open_input_stream. */
-    if (in->source == AUDIO_SOURCE_ECHO_REFERENCE) {
-        struct aec_info info;
-        info.bytes = bytes;
-
-        const uint64_t time_increment_nsec = (uint64_t)bytes * NANOS_PER_SECOND /
-                                             audio_stream_in_frame_size(stream) /
-                                             in_get_sample_rate(&stream->common);
-        if (!aec_get_spk_running(adev->aec)) {
-            if (in->timestamp_nsec == 0) {
-                struct timespec now;
-                clock_gettime(CLOCK_MONOTONIC, &now);
-                const uint64_t timestamp_nsec = audio_utils_ns_from_timespec(&now);
-                in->timestamp_nsec = timestamp_nsec;
-            } else {
-                in->timestamp_nsec += time_increment_nsec;
-            }
-            memset(buffer, 0, bytes);
-            const uint64_t time_increment_usec = time_increment_nsec / 1000;
-            usleep(time_increment_usec);
-        } else {
-            int ref_ret = get_reference_samples(adev->aec, buffer, &info);
-            if ((ref_ret) || (info.timestamp_usec == 0)) {
-                memset(buffer, 0, bytes);
-                in->timestamp_nsec += time_increment_nsec;
-            } else {
-                in->timestamp_nsec = 1000 * info.timestamp_usec;
-            }
-        }
-        in->frames_read += in_frames;
-
-#if DEBUG_AEC
-        FILE* fp_ref = fopen("/data/local/traces/aec_ref.pcm", "a+");
-        if (fp_ref) {
-            fwrite((char*)buffer, 1, bytes, fp_ref);
-            fclose(fp_ref);
-        } else {
-            ALOGE("AEC debug: Could not open file aec_ref.pcm!");
-        }
-        FILE* fp_ref_ts = fopen("/data/local/traces/aec_ref_timestamps.txt", "a+");
-        if (fp_ref_ts) {
-            fprintf(fp_ref_ts, "%" PRIu64 "\n", in->timestamp_nsec);
-            fclose(fp_ref_ts);
-        } else {
-            ALOGE("AEC debug: Could not open file aec_ref_timestamps.txt!");
-        }
-#endif
-        return info.bytes;
-    }
-
-    /* Microphone input stream read */
+    const size_t pcm_frame_size = in_pcm_frame_size(in);
+    const size_t in_frames = bytes / pcm_frame_size;
+    const uint64_t lock_start_nsec = stream_stats_now_nsec();
 
     /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
      * on the input stream mutex - e.g. executing select_mode() while holding the hw device
@@ -688,6 +1019,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
      */
     pthread_mutex_lock(&in->lock);
     pthread_mutex_lock(&adev->lock);
+    latency_histogram_add(&in->stats.lock_wait, stream_stats_now_nsec() - lock_start_nsec);
     if (in->standby) {
         ret = start_input_stream(in);
         if (ret != 0) {
@@ -700,15 +1032,23 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 
     pthread_mutex_unlock(&adev->lock);
 
-    ret = pcm_read(in->pcm, buffer, in_frames * frame_size);
+    const uint64_t read_start_nsec = stream_stats_now_nsec();
+    ret = pcm_read(in->pcm, buffer, in_frames * pcm_frame_size);
+    if (ret == -EPIPE) {
+        /* Overrun, reported because of PCM_NORESTART: recover and read again */
+        in->stats.xruns++;
+        pcm_prepare(in->pcm);
+        ret = pcm_read(in->pcm, buffer, in_frames * pcm_frame_size);
+    }
+    latency_histogram_add(&in->stats.blocked, stream_stats_now_nsec() - read_start_nsec);
     struct aec_info info;
     get_pcm_timestamp(in->pcm, in->config.rate, &info, false /*isOutput*/);
     if (ret == 0) {
-        in->frames_read += in_frames;
         in->timestamp_nsec = audio_utils_ns_from_timespec(&info.timestamp);
     }
     else {
         ALOGE("pcm_read failed with code %d", ret);
+        in->stats.errors++;
     }
 
 exit:
@@ -721,37 +1061,217 @@ exit:
     }
 
     if (ret != 0) {
-        usleep((int64_t)bytes * 1000000 / audio_stream_in_frame_size(stream) /
-                in_get_sample_rate(&stream->common));
+        usleep((int64_t)bytes * 1000000 / pcm_frame_size / in->config.rate);
     } else {
         /* Process AEC if available */
         /* TODO move to a separate thread */
         if (!mic_muted) {
+            const uint64_t dsp_start_nsec = stream_stats_now_nsec();
+            if (in->capture_dsp != NULL) {
+                capture_dsp_process(in->capture_dsp, (int32_t*)buffer, in_frames);
+            }
             info.bytes = bytes;
             int aec_ret = process_aec(adev->aec, buffer, &info);
             if (aec_ret) {
                 ALOGE("process_aec returned error code %d", aec_ret);
             }
+            if (in->capture_dsp != NULL) {
+                capture_dsp_process_agc(in->capture_dsp, (int32_t*)buffer, in_frames);
+            }
+            latency_histogram_add(&in->stats.dsp, stream_stats_now_nsec() - dsp_start_nsec);
         }
     }
 
-#if DEBUG_AEC && !defined(AEC_HAL)
-    FILE* fp_in = fopen("/data/local/traces/aec_in.pcm", "a+");
-    if (fp_in) {
-        fwrite((char*)buffer, 1, bytes, fp_in);
-        fclose(fp_in);
+#if !defined(AEC_HAL)
+    aec_trace_record(adev->aec->trace, AEC_TRACE_MIC_STREAM, buffer, bytes, in->config.rate,
+                     in->config.channels, pcm_format_to_bits(in->config.format),
+                     in->timestamp_nsec, 0);
+#endif
+
+    return ret;
+}
+
+/* Split one PCM period into stream channels, in S16 if it is going to be resampled,
+ * and append it to the frames still staged. */
+static void in_fill_stage(struct alsa_stream_in *in)
+{
+    const size_t frames = in->config.period_size;
+    const size_t sample_size = (in->resampler != NULL) ? sizeof(int16_t) : sizeof(int32_t);
+    const size_t kept_bytes = (in->stage_frames - in->stage_offset) * in->stream_channels *
+                              sample_size;
+    uint8_t *stage = (uint8_t *)in->stage_buf;
+    memmove(stage, stage + in->stage_offset * in->stream_channels * sample_size, kept_bytes);
+    const int32_t *src = in->pcm_buf;
+    /* S32, aligned, after the kept frames */
+    int32_t *dst = (int32_t *)(stage + ((kept_bytes + sizeof(int32_t) - 1) &
+                                        ~(sizeof(int32_t) - 1)));
+    int32_t *const new_frames = dst;
+    if (in->beamformer != NULL) {
+        beamformer_process(in->beamformer, src, dst, frames);
+        if (in->stream_channels == CHANNEL_STEREO) {
+            /* Same beam on both sides, backwards to stay in place */
+            for (size_t frame = frames; frame-- > 0;) {
+                dst[2 * frame + 1] = dst[2 * frame] = dst[frame];
+            }
+        }
+    } else if (in->stream_channels == in->config.channels) {
+        memcpy(dst, src, frames * in->config.channels * sizeof(int32_t));
+    } else if (in->stream_channels == 1) {
+        /* Mono: average of all PCM channels */
+        for (size_t frame = 0; frame < frames; frame++) {
+            int64_t acc = 0;
+            for (size_t ch = 0; ch < in->config.channels; ch++) {
+                acc += *src++;
+            }
+            *dst++ = (int32_t)(acc / (int64_t)in->config.channels);
+        }
     } else {
-        ALOGE("AEC debug: Could not open file aec_in.pcm!");
+        /* Fewer mics than the PCM has: the first ones */
+        for (size_t frame = 0; frame < frames; frame++) {
+            memcpy(dst, src, in->stream_channels * sizeof(int32_t));
+            dst += in->stream_channels;
+            src += in->config.channels;
+        }
     }
-    FILE* fp_mic_ts = fopen("/data/local/traces/aec_in_timestamps.txt", "a+");
-    if (fp_mic_ts) {
-        fprintf(fp_mic_ts, "%" PRIu64 "\n", in->timestamp_nsec);
-        fclose(fp_mic_ts);
-    } else {
-        ALOGE("AEC debug: Could not open file aec_in_timestamps.txt!");
+    if (in->resampler != NULL) {
+        /* In place, the 16-bit output never overtakes the 32-bit input */
+        memcpy_to_i16_from_i32((int16_t *)(stage + kept_bytes), new_frames,
+                               frames * in->stream_channels);
     }
-#endif
+    in->stage_frames = kept_bytes / (in->stream_channels * sample_size) + frames;
+    in->stage_offset = 0;
+    in->stage_timestamp_nsec = in->timestamp_nsec;
+}
+
+/* Serve a client whose rate, channels or format differ from the PCM's: read whole
+ * PCM periods, convert them and hand out as many frames as were asked for. Leftover
+ * frames are kept for the next call. */
+static int in_read_converted(struct alsa_stream_in *in, void* buffer, size_t bytes)
+{
+    const size_t stream_frame_size = audio_stream_in_frame_size(&in->stream);
+    const size_t channels = in->stream_channels;
+    const size_t frames = bytes / stream_frame_size;
+    uint8_t *dst = (uint8_t *)buffer;
+    size_t done = 0;
+    bool refill = false;
+
+    while (done < frames) {
+        if ((in->stage_offset >= in->stage_frames) || refill) {
+            int ret = in_read_pcm(in, in->pcm_buf, in->config.period_size * in_pcm_frame_size(in));
+            if (ret != 0) {
+                memset(dst + done * stream_frame_size, 0, (frames - done) * stream_frame_size);
+                return ret;
+            }
+            in_fill_stage(in);
+            refill = false;
+        }
+        size_t available = in->stage_frames - in->stage_offset;
+        if (in->resampler == NULL) {
+            size_t count = (frames - done < available) ? frames - done : available;
+            memcpy_by_audio_format(dst + done * stream_frame_size, in->stream_format,
+                                   (int32_t *)in->stage_buf + in->stage_offset * channels,
+                                   AUDIO_FORMAT_PCM_32_BIT, count * channels);
+            in->stage_offset += count;
+            done += count;
+        } else {
+            size_t in_count = available;
+            size_t out_count = frames - done;
+            int16_t *out = (int16_t *)(dst + done * stream_frame_size);
+            if (in->stream_format != AUDIO_FORMAT_PCM_16_BIT) {
+                out = in->resampler_out;
+                if (out_count > in->resampler_out_frames) {
+                    out_count = in->resampler_out_frames;
+                }
+            }
+            in->resampler->resample_from_input(
+                    in->resampler, (int16_t *)in->stage_buf + in->stage_offset * channels,
+                    &in_count, out, &out_count);
+            if (out == in->resampler_out) {
+                memcpy_by_audio_format(dst + done * stream_frame_size, in->stream_format, out,
+                                       AUDIO_FORMAT_PCM_16_BIT, out_count * channels);
+            }
+            in->stage_offset += in_count;
+            done += out_count;
+            if ((in_count == 0) && (out_count == 0)) {
+                /* Resampler wants more input than is left: read more behind it. The stage
+                 * only has room for one period besides. */
+                if (available < in->config.period_size) {
+                    refill = true;
+                } else {
+                    in->stage_offset = in->stage_frames;
+                }
+            }
+        }
+    }
+    /* The PCM timestamp is for the end of the last period read, part of which is still
+     * staged */
+    in->timestamp_nsec = in->stage_timestamp_nsec -
+                         (uint64_t)(in->stage_frames - in->stage_offset) * NANOS_PER_SECOND /
+                         in->config.rate;
+    return 0;
+}
+
+static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
+        size_t bytes)
+{
+    int ret;
+    struct alsa_stream_in *in = (struct alsa_stream_in *)stream;
+    struct alsa_audio_device *adev = in->dev;
+    size_t frame_size = audio_stream_in_frame_size(stream);
+    size_t in_frames = bytes / frame_size;
+
+    ALOGV("in_read: stream: %d, bytes %zu", in->source, bytes);
+
+    /* Special handling for Echo Reference: simply get the reference from FIFO.
+     * The format and sample rate should be specified by arguments to adev_open_input_stream. */
+    if (in->source == AUDIO_SOURCE_ECHO_REFERENCE) {
+        struct aec_info info;
+        info.bytes = bytes;
+
+        const uint64_t time_increment_nsec = (uint64_t)bytes * NANOS_PER_SECOND /
+                                             audio_stream_in_frame_size(stream) /
+                                             in_get_sample_rate(&stream->common);
+        if (!aec_get_spk_running(adev->aec)) {
+            if (in->timestamp_nsec == 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                const uint64_t timestamp_nsec = audio_utils_ns_from_timespec(&now);
+                in->timestamp_nsec = timestamp_nsec;
+            } else {
+                in->timestamp_nsec += time_increment_nsec;
+            }
+            memset(buffer, 0, bytes);
+            const uint64_t time_increment_usec = time_increment_nsec / 1000;
+            usleep(time_increment_usec);
+        } else {
+            int ref_ret = get_reference_samples(adev->aec, buffer, &info);
+            if ((ref_ret) || (info.timestamp_usec == 0)) {
+                memset(buffer, 0, bytes);
+                in->timestamp_nsec += time_increment_nsec;
+            } else {
+                in->timestamp_nsec = 1000 * info.timestamp_usec;
+            }
+        }
+        in->frames_read += in_frames;
 
+        aec_trace_record(adev->aec->trace, AEC_TRACE_REF_STREAM, buffer, bytes,
+                         in->config.rate, in->config.channels,
+                         pcm_format_to_bits(in->config.format), in->timestamp_nsec, 0);
+        return info.bytes;
+    }
+
+    /* Microphone input stream read */
+    const uint64_t call_start_nsec = stream_stats_now_nsec();
+    if (in->convert) {
+        ret = in_read_converted(in, buffer, bytes);
+    } else {
+        ret = in_read_pcm(in, buffer, bytes);
+    }
+    if (ret == 0) {
+        in->frames_read += in_frames;
+        in->stats.frames += in_frames;
+    }
+    latency_histogram_add(&in->stats.call, stream_stats_now_nsec() - call_start_nsec);
     return bytes;
 }
 
@@ -829,8 +1349,11 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->config.channels = CHANNEL_STEREO;
     out->config.rate = PLAYBACK_CODEC_SAMPLING_RATE;
     out->config.format = PCM_FORMAT_S16_LE;
-    out->config.period_size = PLAYBACK_PERIOD_SIZE;
-    out->config.period_count = PLAYBACK_PERIOD_COUNT;
+    out->dev = ladev;
+    out->volume[0] = out->volume[1] = 1.0f;
+    /* Start at the current master volume, not ramp to it */
+    volume_ramp_init(&out->volume_ramp, ladev->master_mute ? 0.0f : ladev->master_volume);
+    out_set_pcm_config(out, false);
 
     if (out->config.rate != config->sample_rate ||
            audio_channel_count_from_out_mask(config->channel_mask) != CHANNEL_STEREO ||
@@ -844,7 +1367,6 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     ALOGI("adev_open_output_stream selects channels=%d rate=%d format=%d, devices=%d",
           out->config.channels, out->config.rate, out->config.format, devices);
 
-    out->dev = ladev;
     out->standby = 1;
     out->unavailable = false;
     out->devices = devices;
@@ -867,6 +1389,11 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         goto error_2;
     }
 
+    pthread_mutex_lock(&ladev->lock);
+    ladev->out_devices = out->devices;
+    select_devices(ladev);
+    pthread_mutex_unlock(&ladev->lock);
+
     *stream_out = &out->stream;
     return 0;
 
@@ -882,8 +1409,14 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 {
     ALOGV("adev_close_output_stream...");
     struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
-    destroy_aec_reference_config(adev->aec);
     struct alsa_stream_out* out = (struct alsa_stream_out*)stream;
+    /* Don't leave a PCM from a deferred standby behind */
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    destroy_aec_reference_config(adev->aec);
     fir_release(out->speaker_eq);
     free(stream);
 }
@@ -891,7 +1424,30 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
     ALOGV("adev_set_parameters");
-    return -ENOSYS;
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
+    struct str_parms *parms;
+    char value[32];
+    int ret, status = 0;
+
+    parms = str_parms_create_str(kvpairs);
+
+    ret = str_parms_get_str(parms, SCREEN_STATE_PARAMETER, value, sizeof(value));
+    if (ret >= 0) {
+        /* Running outputs switch buffer size at their next drain point, see
+         * out_buffer_switch_due() */
+        pthread_mutex_lock(&adev->lock);
+        adev->screen_off = (strcmp(value, "off") == 0);
+        pthread_mutex_unlock(&adev->lock);
+    }
+
+    ret = str_parms_get_str(parms, AEC_TRACE_PARAMETER, value, sizeof(value));
+    if (ret >= 0) {
+        bool enable = (strcmp(value, "on") == 0) || (strcmp(value, "1") == 0);
+        status = aec_trace_set_enabled(adev->aec->trace, enable);
+    }
+
+    str_parms_destroy(parms);
+    return status;
 }
 
 static char * adev_get_parameters(const struct audio_hw_device *dev,
@@ -908,7 +1464,8 @@ static int adev_get_microphones(const struct audio_hw_device* dev,
     if ((mic_array == NULL) || (mic_count == NULL)) {
         return -EINVAL;
     }
-    get_mic_characteristics(mic_array, mic_count);
+    struct alsa_audio_device* adev = (struct alsa_audio_device*)dev;
+    get_mic_characteristics(&adev->mic_geometry, mic_array, mic_count);
     return 0;
 }
 
@@ -924,28 +1481,48 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
     return -ENOSYS;
 }
 
+/* Master volume and mute are applied in out_write(), ramped */
 static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
 {
     ALOGV("adev_set_master_volume: %f", volume);
-    return -ENOSYS;
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
+    if ((volume < 0.0f) || (volume > 1.0f)) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&adev->lock);
+    adev->master_volume = volume;
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
 }
 
 static int adev_get_master_volume(struct audio_hw_device *dev, float *volume)
 {
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    *volume = adev->master_volume;
+    pthread_mutex_unlock(&adev->lock);
     ALOGV("adev_get_master_volume: %f", *volume);
-    return -ENOSYS;
+    return 0;
 }
 
 static int adev_set_master_mute(struct audio_hw_device *dev, bool muted)
 {
     ALOGV("adev_set_master_mute: %d", muted);
-    return -ENOSYS;
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    adev->master_mute = muted;
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
 }
 
 static int adev_get_master_mute(struct audio_hw_device *dev, bool *muted)
 {
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    *muted = adev->master_mute;
+    pthread_mutex_unlock(&adev->lock);
     ALOGV("adev_get_master_mute: %d", *muted);
-    return -ENOSYS;
+    return 0;
 }
 
 static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
@@ -974,15 +1551,156 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
     return 0;
 }
 
+static const struct capture_profile_config capture_profiles[CAPTURE_PROFILE_COUNT] = {
+    [CAPTURE_PROFILE_VOICE] = {"voice", CAPTURE_CODEC_SAMPLING_RATE, CHANNEL_STEREO,
+                               CAPTURE_PERIOD_SIZE, CAPTURE_PERIOD_COUNT},
+    [CAPTURE_PROFILE_HIFI] = {"hifi", CAPTURE_HIFI_SAMPLING_RATE, CHANNEL_STEREO,
+                              CAPTURE_HIFI_PERIOD_SIZE, CAPTURE_PERIOD_COUNT},
+    [CAPTURE_PROFILE_MULTI_MIC] = {"multi_mic", CAPTURE_CODEC_SAMPLING_RATE,
+                                   CAPTURE_MAX_MIC_CHANNELS, CAPTURE_PERIOD_SIZE,
+                                   CAPTURE_PERIOD_COUNT},
+};
+
+/* Pick the PCM configuration closest to what the client asked for, so that in_read()
+ * does not have to upsample or drop channels. Voice sources stay at the AEC's
+ * native rate. */
+static enum capture_profile select_capture_profile(const struct audio_config *config,
+                                                   audio_source_t source,
+                                                   unsigned int max_pcm_channels)
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(CAPTURE_PROFILE_PROPERTY, value, NULL) > 0) {
+        for (int i = 0; i < CAPTURE_PROFILE_COUNT; i++) {
+            if (strcmp(value, capture_profiles[i].name) == 0) {
+                return (enum capture_profile)i;
+            }
+        }
+        ALOGW("%s: Unknown capture profile %s", __func__, value);
+    }
+
+    uint32_t channels = audio_channel_count_from_in_mask(config->channel_mask);
+    if ((channels > CHANNEL_STEREO) && (max_pcm_channels > CHANNEL_STEREO)) {
+        return CAPTURE_PROFILE_MULTI_MIC;
+    }
+    /* Capture every mic and beamform them down to what was asked for */
+    if (property_get_bool(BEAMFORMER_PROPERTY, false) && (source != AUDIO_SOURCE_UNPROCESSED) &&
+        (max_pcm_channels > CHANNEL_STEREO)) {
+        return CAPTURE_PROFILE_MULTI_MIC;
+    }
+    if ((source == AUDIO_SOURCE_VOICE_COMMUNICATION) ||
+        (source == AUDIO_SOURCE_VOICE_RECOGNITION)) {
+        return CAPTURE_PROFILE_VOICE;
+    }
+    bool high_res_format = (config->format != AUDIO_FORMAT_DEFAULT) &&
+                           (config->format != AUDIO_FORMAT_PCM_16_BIT);
+    if ((config->sample_rate > CAPTURE_CODEC_SAMPLING_RATE) || high_res_format) {
+        return CAPTURE_PROFILE_HIFI;
+    }
+    return CAPTURE_PROFILE_VOICE;
+}
+
+/* Mics the capture PCM can deliver, 0 if they can't be queried */
+static unsigned int get_max_capture_channels(void)
+{
+    struct pcm_params* params = pcm_params_get(CARD_IN, PORT_BUILTIN_MIC, PCM_IN);
+    if (!params) {
+        return 0;
+    }
+    unsigned int max_pcm_channels = pcm_params_get_max(params, PCM_PARAM_CHANNELS);
+    pcm_params_free(params);
+    return max_pcm_channels;
+}
+
+/* One period of the profile adev_open_input_stream() would pick for 'config', in stream
+ * frames. No source is known here, so this is the answer for AUDIO_SOURCE_DEFAULT. */
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
         const struct audio_config *config)
 {
-    size_t buffer_size =
-            get_input_buffer_size(CAPTURE_PERIOD_SIZE, config->format, config->channel_mask);
+    enum capture_profile profile_id =
+            select_capture_profile(config, AUDIO_SOURCE_DEFAULT, get_max_capture_channels());
+    const struct capture_profile_config *profile = &capture_profiles[profile_id];
+    uint32_t stream_rate = (config->sample_rate != 0) ? config->sample_rate : profile->rate;
+    size_t frames = (size_t)profile->period_size * stream_rate / profile->rate;
+    size_t buffer_size = get_input_buffer_size(frames, config->format, config->channel_mask);
     ALOGV("adev_get_input_buffer_size: %zu", buffer_size);
     return buffer_size;
 }
 
+static bool in_stream_config_supported(const struct alsa_stream_in *in)
+{
+    if ((in->stream_rate < CAPTURE_MIN_STREAM_SAMPLING_RATE) ||
+        (in->stream_rate > CAPTURE_MAX_STREAM_SAMPLING_RATE)) {
+        return false;
+    }
+    /* Mono is downmixed, more channels than the PCM's can't be made up */
+    if ((in->stream_channels == 0) || (in->stream_channels > in->config.channels)) {
+        return false;
+    }
+    /* The resampler is mono/stereo only */
+    if ((in->stream_rate != in->config.rate) && (in->stream_channels > CHANNEL_STEREO)) {
+        return false;
+    }
+    switch (in->stream_format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+    case AUDIO_FORMAT_PCM_FLOAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void in_release_conversion(struct alsa_stream_in *in)
+{
+    if (in->resampler != NULL) {
+        release_resampler(in->resampler);
+        in->resampler = NULL;
+    }
+    free(in->pcm_buf);
+    free(in->stage_buf);
+    free(in->resampler_out);
+    in->pcm_buf = NULL;
+    in->stage_buf = NULL;
+    in->resampler_out = NULL;
+}
+
+static int in_init_conversion(struct alsa_stream_in *in)
+{
+    const size_t period = in->config.period_size;
+    in->pcm_buf = (int32_t *)malloc(period * in_pcm_frame_size(in));
+    /* Room for a period behind the frames the resampler left over, see in_fill_stage() */
+    in->stage_buf = malloc(2 * period * in->stream_channels * sizeof(int32_t));
+    if ((in->pcm_buf == NULL) || (in->stage_buf == NULL)) {
+        goto error;
+    }
+    if (in->stream_rate != in->config.rate) {
+        int ret = create_resampler(in->config.rate, in->stream_rate, in->stream_channels,
+                                   RESAMPLER_QUALITY_DEFAULT, NULL, &in->resampler);
+        if (ret) {
+            ALOGE("%s: create_resampler failed with code %d", __func__, ret);
+            in->resampler = NULL;
+            goto error;
+        }
+        /* Non-16-bit streams are resampled in chunks of one period's worth */
+        in->resampler_out_frames = period * in->stream_rate / in->config.rate + 1;
+        in->resampler_out = (int16_t *)malloc(in->resampler_out_frames * in->stream_channels *
+                                              sizeof(int16_t));
+        if (in->resampler_out == NULL) {
+            goto error;
+        }
+    }
+    in->stage_frames = 0;
+    in->stage_offset = 0;
+    return 0;
+
+error:
+    ALOGE("%s: Unable to set up conversion", __func__);
+    in_release_conversion(in);
+    return -ENOMEM;
+}
+
 static int adev_open_input_stream(struct audio_hw_device* dev, audio_io_handle_t handle,
                                   audio_devices_t devices, struct audio_config* config,
                                   struct audio_stream_in** stream_in,
@@ -992,8 +1710,8 @@ static int adev_open_input_stream(struct audio_hw_device* dev, audio_io_handle_t
 
     struct alsa_audio_device *ladev = (struct alsa_audio_device *)dev;
 
-    struct pcm_params* params = pcm_params_get(CARD_IN, PORT_BUILTIN_MIC, PCM_IN);
-    if (!params) {
+    unsigned int max_pcm_channels = get_max_capture_channels();
+    if (max_pcm_channels == 0) {
         return -ENOSYS;
     }
 
@@ -1020,27 +1738,72 @@ static int adev_open_input_stream(struct audio_hw_device* dev, audio_io_handle_t
     in->stream.get_capture_position = in_get_capture_position;
     in->stream.get_active_microphones = in_get_active_microphones;
 
-    in->config.channels = CHANNEL_STEREO;
+    in->profile = CAPTURE_PROFILE_VOICE;
+    if (source != AUDIO_SOURCE_ECHO_REFERENCE) {
+        in->profile = select_capture_profile(config, source, max_pcm_channels);
+    }
+    const struct capture_profile_config *profile = &capture_profiles[in->profile];
+    in->config.channels = profile->channels;
+    if ((in->profile == CAPTURE_PROFILE_MULTI_MIC) && (max_pcm_channels < profile->channels)) {
+        in->config.channels = (max_pcm_channels > CHANNEL_STEREO) ? max_pcm_channels
+                                                                 : CHANNEL_STEREO;
+    }
     if (source == AUDIO_SOURCE_ECHO_REFERENCE) {
         in->config.rate = PLAYBACK_CODEC_SAMPLING_RATE;
     } else {
-        in->config.rate = CAPTURE_CODEC_SAMPLING_RATE;
+        in->config.rate = profile->rate;
     }
+    /* 24-bit capture comes MSB aligned in S32 */
     in->config.format = PCM_FORMAT_S32_LE;
-    in->config.period_size = CAPTURE_PERIOD_SIZE;
-    in->config.period_count = CAPTURE_PERIOD_COUNT;
-
-    if (in->config.rate != config->sample_rate ||
-           audio_channel_count_from_in_mask(config->channel_mask) != CHANNEL_STEREO ||
-               in->config.format !=  pcm_format_from_audio_format(config->format) ) {
-        config->format = in_get_format(&in->stream.common);
-        config->channel_mask = in_get_channels(&in->stream.common);
-        config->sample_rate = in_get_sample_rate(&in->stream.common);
-        goto error_1;
+    in->config.period_size = profile->period_size;
+    in->config.period_count = profile->period_count;
+
+    in->stream_rate = in->config.rate;
+    in->stream_channels = in->config.channels;
+    in->stream_format = audio_format_from_pcm_format(in->config.format);
+
+    if (source == AUDIO_SOURCE_ECHO_REFERENCE) {
+        /* The reference is produced in the requested format directly, no conversion */
+        if (in->config.rate != config->sample_rate ||
+               audio_channel_count_from_in_mask(config->channel_mask) != CHANNEL_STEREO ||
+                   in->config.format !=  pcm_format_from_audio_format(config->format) ) {
+            config->format = in_get_format(&in->stream.common);
+            config->channel_mask = in_get_channels(&in->stream.common);
+            config->sample_rate = in_get_sample_rate(&in->stream.common);
+            goto error_1;
+        }
+    } else {
+        /* Anything else is converted from the PCM in in_read(); zero means "PCM's" */
+        if (config->sample_rate != 0) {
+            in->stream_rate = config->sample_rate;
+        }
+        if (config->channel_mask != AUDIO_CHANNEL_NONE) {
+            in->stream_channels = audio_channel_count_from_in_mask(config->channel_mask);
+        }
+        if (config->format != AUDIO_FORMAT_DEFAULT) {
+            in->stream_format = config->format;
+        }
+        if (!in_stream_config_supported(in)) {
+            in->stream_rate = in->config.rate;
+            in->stream_channels = in->config.channels;
+            in->stream_format = audio_format_from_pcm_format(in->config.format);
+            config->format = in_get_format(&in->stream.common);
+            config->channel_mask = in_get_channels(&in->stream.common);
+            config->sample_rate = in_get_sample_rate(&in->stream.common);
+            goto error_1;
+        }
+        in->convert = (in->stream_rate != in->config.rate) ||
+                      (in->stream_channels != in->config.channels) ||
+                      (in->stream_format != audio_format_from_pcm_format(in->config.format));
     }
 
-    ALOGI("adev_open_input_stream selects channels=%d rate=%d format=%d source=%d",
-          in->config.channels, in->config.rate, in->config.format, source);
+    ALOGI("adev_open_input_stream selects %s profile: channels=%d rate=%d format=%d period=%d "
+          "source=%d", profile->name, in->config.channels, in->config.rate, in->config.format,
+          in->config.period_size, source);
+    if (in->convert) {
+        ALOGI("adev_open_input_stream converts to channels=%d rate=%d format=%#x",
+              in->stream_channels, in->stream_rate, in->stream_format);
+    }
 
     in->dev = ladev;
     in->standby = true;
@@ -1048,24 +1811,52 @@ static int adev_open_input_stream(struct audio_hw_device* dev, audio_io_handle_t
     in->source = source;
     in->devices = devices;
 
+    /* UNPROCESSED promises no processing, so it gets neither the DSP nor the beamformer */
+    if ((source != AUDIO_SOURCE_ECHO_REFERENCE) && (source != AUDIO_SOURCE_UNPROCESSED)) {
+        capture_dsp_config_t dsp_config;
+        capture_dsp_get_config(&dsp_config);
+        in->capture_dsp = capture_dsp_init(in->config.channels, in->config.rate, &dsp_config);
+        if (in->capture_dsp == NULL) {
+            ALOGW("Capture DSP init failed, capturing unprocessed audio");
+        }
+    }
+
+    if ((source != AUDIO_SOURCE_ECHO_REFERENCE) && (source != AUDIO_SOURCE_UNPROCESSED) &&
+        (in->stream_channels < in->config.channels) &&
+        property_get_bool(BEAMFORMER_PROPERTY, false)) {
+        in->beamformer = beamformer_init(in->config.channels, in->config.rate,
+                                         &ladev->mic_geometry);
+        if (in->beamformer == NULL) {
+            ALOGW("Beamformer init failed, using the raw mics");
+        }
+    }
+
+    if (in->convert && in_init_conversion(in)) {
+        goto error_2;
+    }
+
     if (is_aec_input(in)) {
         int aec_ret = init_aec_mic_config(ladev->aec, in);
         if (aec_ret) {
             ALOGE("AEC: Mic config init failed!");
-            goto error_1;
+            goto error_2;
         }
     }
 
-#if DEBUG_AEC
-    remove("/data/local/traces/aec_ref.pcm");
-    remove("/data/local/traces/aec_in.pcm");
-    remove("/data/local/traces/aec_ref_timestamps.txt");
-    remove("/data/local/traces/aec_in_timestamps.txt");
-#endif
+    if (source != AUDIO_SOURCE_ECHO_REFERENCE) {
+        pthread_mutex_lock(&ladev->lock);
+        ladev->in_devices = in->devices;
+        select_devices(ladev);
+        pthread_mutex_unlock(&ladev->lock);
+    }
 
     *stream_in = &in->stream;
     return 0;
 
+error_2:
+    in_release_conversion(in);
+    capture_dsp_release(in->capture_dsp);
+    beamformer_release(in->beamformer);
 error_1:
     free(in);
     return -EINVAL;
@@ -1079,6 +1870,9 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     if (is_aec_input(in)) {
         destroy_aec_mic_config(in->dev->aec);
     }
+    in_release_conversion(in);
+    capture_dsp_release(in->capture_dsp);
+    beamformer_release(in->beamformer);
     free(stream);
     return;
 }
@@ -1086,6 +1880,16 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
     ALOGV("adev_dump");
+    struct alsa_audio_device *adev = (struct alsa_audio_device *)device;
+    pthread_mutex_lock(&adev->lock);
+    if (adev->active_output != NULL) {
+        stream_stats_dump(&adev->active_output->stats, "Active output", fd);
+    }
+    if (adev->active_input != NULL) {
+        stream_stats_dump(&adev->active_input->stats, "Active input", fd);
+    }
+    pthread_mutex_unlock(&adev->lock);
+    aec_dump(adev->aec, fd);
     return 0;
 }
 
@@ -1094,6 +1898,7 @@ static int adev_close(hw_device_t *device)
     ALOGV("adev_close");
 
     struct alsa_audio_device *adev = (struct alsa_audio_device *)device;
+    stop_standby_thread(adev);
     release_aec(adev->aec);
     audio_route_free(adev->audio_route);
     mixer_close(adev->mixer);
@@ -1114,6 +1919,7 @@ static int adev_open(const hw_module_t* module, const char* name,
     if (!adev) {
         return -ENOMEM;
     }
+    adev->master_volume = 1.0f;
 
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
@@ -1151,6 +1957,8 @@ static int adev_open(const hw_module_t* module, const char* name,
         ALOGE("%s: Failed to init audio route controls, aborting.", __func__);
         goto error_2;
     }
+    init_route_paths(adev);
+    beamformer_get_geometry(&adev->mic_geometry);
 
     pthread_mutex_lock(&adev->lock);
     if (init_aec(CAPTURE_CODEC_SAMPLING_RATE, NUM_AEC_REFERENCE_CHANNELS,
@@ -1160,6 +1968,8 @@ static int adev_open(const hw_module_t* module, const char* name,
     }
     pthread_mutex_unlock(&adev->lock);
 
+    start_standby_thread(adev);
+
     return 0;
 
 error_3:
@@ -20,7 +20,11 @@
 #include <hardware/audio.h>
 #include <tinyalsa/asoundlib.h>
 
+#include "beamformer.h"
+#include "capture_dsp.h"
 #include "fir_filter.h"
+#include "stream_stats.h"
+#include "volume_ramp.h"
 
 #define CARD_OUT 0
 #define PORT_INTERNAL_SPEAKER 0
@@ -40,8 +44,6 @@
 #define NUM_AEC_REFERENCE_CHANNELS 2
 #endif /* #ifdef AEC_HAL */
 
-#define DEBUG_AEC 0
-
 #define PCM_OPEN_RETRIES 100
 #define PCM_OPEN_WAIT_TIME_MS 20
 
@@ -54,6 +56,33 @@
 #define CAPTURE_PERIOD_COUNT 4
 #define CAPTURE_PERIOD_START_THRESHOLD 0
 #define CAPTURE_CODEC_SAMPLING_RATE 16000
+/* Stream rates in_read() converts to from the PCM's rate */
+#define CAPTURE_MIN_STREAM_SAMPLING_RATE 8000
+#define CAPTURE_MAX_STREAM_SAMPLING_RATE 48000
+/* High resolution recording: 48 kHz, 24 bits in S32 containers, 21 ms periods.
+ * Periods stay a multiple of the AEC block size (128 frames). */
+#define CAPTURE_HIFI_SAMPLING_RATE 48000
+#define CAPTURE_HIFI_PERIOD_MULTIPLIER 32
+#define CAPTURE_HIFI_PERIOD_SIZE (CODEC_BASE_FRAME_COUNT * CAPTURE_HIFI_PERIOD_MULTIPLIER)
+/* Raw channels for beamforming, limited by what the PCM offers */
+#define CAPTURE_MAX_MIC_CHANNELS 4
+/* Forces a capture profile by name ("voice", "hifi", "multi_mic") */
+#define CAPTURE_PROFILE_PROPERTY "vendor.audio.capture.profile"
+
+enum capture_profile {
+    CAPTURE_PROFILE_VOICE,
+    CAPTURE_PROFILE_HIFI,
+    CAPTURE_PROFILE_MULTI_MIC,
+    CAPTURE_PROFILE_COUNT,
+};
+
+struct capture_profile_config {
+    const char* name;
+    unsigned int rate;
+    unsigned int channels;  /* multi-mic: upper bound */
+    unsigned int period_size;
+    unsigned int period_count;
+};
 
 /* Playback codec parameters */
 /* number of base blocks in a short period (low latency) */
@@ -66,6 +95,19 @@
 #define PLAYBACK_CODEC_SAMPLING_RATE 48000
 #define MIN_WRITE_SLEEP_US      5000
 
+/* Deep buffer playback while the screen is off: one wakeup per 320 ms instead of per 21 ms */
+#define DEEP_BUFFER_PERIOD_MULTIPLIER 480  /* 320 ms */
+#define DEEP_BUFFER_PERIOD_SIZE (CODEC_BASE_FRAME_COUNT * DEEP_BUFFER_PERIOD_MULTIPLIER)
+#define DEEP_BUFFER_PERIOD_COUNT 8         /* 2.56 s */
+#define DEEP_BUFFER_PERIOD_START_THRESHOLD 1
+#define SCREEN_STATE_PARAMETER "screen_state"
+/* A running output switches buffer size once no more than a period is queued, or after
+ * this long if it never gets that low */
+#define OUT_BUFFER_SWITCH_TIMEOUT_MS 1000
+/* out_standby() keeps the PCM open this long in case playback resumes */
+#define OUT_STANDBY_DELAY_MS 1000
+#define OUT_STANDBY_DELAY_PROPERTY "vendor.audio.out_standby_delay_ms"
+
 #define SPEAKER_EQ_FILE "/vendor/etc/speaker_eq_sei610.fir"
 #define SPEAKER_MAX_EQ_LENGTH 512
 
@@ -77,8 +119,24 @@ struct alsa_audio_device {
     struct alsa_stream_out *active_output;
     struct audio_route *audio_route;
     struct mixer *mixer;
+    /* Routing, see select_devices(). Bit i refers to route_paths[i]. */
+    audio_devices_t out_devices;
+    audio_devices_t in_devices;
+    uint32_t route_paths_available;
+    uint32_t route_paths_applied;
     bool mic_mute;
+    /* Applied by out_write() rather than AudioFlinger's mixer */
+    float master_volume;
+    bool master_mute;
+    beamformer_geometry_t mic_geometry;
     struct aec_t *aec;
+    bool screen_off;
+    /* Closes PCMs left open by a deferred output standby, waits on 'lock' */
+    pthread_t standby_thread;
+    pthread_cond_t standby_cond;
+    bool standby_thread_running;
+    bool standby_thread_exit;
+    uint32_t standby_delay_ms;
 };
 
 struct alsa_stream_in {
@@ -95,6 +153,26 @@ struct alsa_stream_in {
     unsigned int frames_read;
     uint64_t timestamp_nsec;
     audio_source_t source;
+    enum capture_profile profile;
+    capture_dsp_t* capture_dsp;
+    /* Fuses the PCM's mics into fewer stream channels, see in_fill_stage() */
+    beamformer_t* beamformer;
+    struct stream_stats stats;
+    /* Format seen by the client. The PCM always runs at 'config'; if they differ
+     * in_read() converts, see in_read_converted(). */
+    uint32_t stream_rate;
+    uint32_t stream_channels;
+    audio_format_t stream_format;
+    bool convert;
+    struct resampler_itfe* resampler;
+    int32_t* pcm_buf;       /* one PCM period */
+    void* stage_buf;        /* pcm_buf at stream_channels, S16 if resampling else S32,
+                             * after any frames the resampler has not taken yet */
+    size_t stage_frames;
+    size_t stage_offset;
+    uint64_t stage_timestamp_nsec; /* capture time of the frame after the staged ones */
+    int16_t* resampler_out;
+    size_t resampler_out_frames;
 };
 
 struct alsa_stream_out {
@@ -111,6 +189,14 @@ struct alsa_stream_out {
     unsigned int frames_written;
     struct timespec timestamp;
     fir_filter_t* speaker_eq;
+    float volume[2];        /* from out_set_volume(), left and right */
+    volume_ramp_t volume_ramp;  /* volume times master volume, applied with the EQ */
+    bool deep_buffer;       /* 'config' currently uses the deep buffer periods */
+    /* CLOCK_MONOTONIC time a pending buffer size change was first seen, 0 if none */
+    uint64_t buffer_switch_nsec;
+    /* CLOCK_MONOTONIC time at which a deferred standby closes 'pcm', 0 if none pending */
+    uint64_t standby_close_nsec;
+    struct stream_stats stats;
 };
 
 /* 'bytes' are the number of bytes written to audio FIFO, for which 'timestamp' is valid.
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Single-producer single-consumer byte ring, header-only so reads and writes inline
+ * into the audio threads. Usable from C and C++.
+ *
+ * The ring header and the buffer are one allocation; the producer and consumer
+ * indices live on separate cache lines. Capacity is rounded up to a power of two.
+ *
+ * If the reader does not throttle the writer, writes always succeed and overwrite
+ * unread data; the reader then sees -EOVERFLOW once and resumes from the newest data,
+ * like audio_utils_fifo. Laps are detected both before a read and when it is released,
+ * so data overwritten while the reader was copying it is reported too.
+ *
+ * Besides copying read()/write(), data can be accessed in place: *_obtain() returns
+ * up to two spans (the second one after the wrap point) and *_release() commits them.
+ */
+
+#ifndef _AUDIO_RING_H_
+#define _AUDIO_RING_H_
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIO_RING_CACHE_LINE 64
+#define AUDIO_RING_MAX_CAPACITY (1u << 30)
+
+struct audio_ring {
+    /* Producer side */
+    uint32_t rear __attribute__((aligned(AUDIO_RING_CACHE_LINE)));
+    /* Consumer side */
+    uint32_t front __attribute__((aligned(AUDIO_RING_CACHE_LINE)));
+    /* Constant after init */
+    uint32_t capacity __attribute__((aligned(AUDIO_RING_CACHE_LINE)));
+    uint32_t mask;
+    bool reader_throttles_writer;
+    uint8_t data[] __attribute__((aligned(AUDIO_RING_CACHE_LINE)));
+};
+
+struct audio_ring_span {
+    uint8_t *data;
+    size_t bytes;
+};
+
+static inline struct audio_ring *audio_ring_init(uint32_t bytes, bool reader_throttles_writer) {
+    if ((bytes == 0) || (bytes > AUDIO_RING_MAX_CAPACITY)) {
+        return NULL;
+    }
+    uint32_t capacity = 1;
+    while (capacity < bytes) {
+        capacity <<= 1;
+    }
+    void *mem = NULL;
+    if (posix_memalign(&mem, AUDIO_RING_CACHE_LINE, sizeof(struct audio_ring) + capacity)) {
+        return NULL;
+    }
+    struct audio_ring *ring = (struct audio_ring *)mem;
+    memset(ring, 0, sizeof(struct audio_ring));
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    ring->reader_throttles_writer = reader_throttles_writer;
+    return ring;
+}
+
+static inline void audio_ring_release(struct audio_ring *ring) {
+    free(ring);
+}
+
+/* Split 'bytes' starting at index 'pos' into the part before and after the wrap point */
+static inline void audio_ring_spans(struct audio_ring *ring, uint32_t pos, size_t bytes,
+                                    struct audio_ring_span span[2]) {
+    uint32_t offset = pos & ring->mask;
+    size_t first = ring->capacity - offset;
+    if (first > bytes) {
+        first = bytes;
+    }
+    span[0].data = &ring->data[offset];
+    span[0].bytes = first;
+    span[1].data = ring->data;
+    span[1].bytes = bytes - first;
+}
+
+/* Consumer. Returns the number of readable bytes, or -EOVERFLOW if the writer lapped
+ * the reader, in which case the unread data is discarded. */
+static inline ssize_t audio_ring_available_to_read(struct audio_ring *ring) {
+    uint32_t rear = __atomic_load_n(&ring->rear, __ATOMIC_ACQUIRE);
+    uint32_t front = ring->front;
+    uint32_t filled = rear - front;
+    if (filled > ring->capacity) {
+        __atomic_store_n(&ring->front, rear, __ATOMIC_RELEASE);
+        return -EOVERFLOW;
+    }
+    return filled;
+}
+
+/* Consumer. Exposes up to 'bytes' of readable data in place, without consuming it. */
+static inline ssize_t audio_ring_read_obtain(struct audio_ring *ring, struct audio_ring_span span[2],
+                                             size_t bytes) {
+    ssize_t available = audio_ring_available_to_read(ring);
+    if (available < 0) {
+        return available;
+    }
+    if (bytes > (size_t)available) {
+        bytes = available;
+    }
+    audio_ring_spans(ring, ring->front, bytes, span);
+    return bytes;
+}
+
+/* Consumer. Consumes 'bytes' previously returned by audio_ring_read_obtain(). Returns
+ * 'bytes', or -EOVERFLOW if the writer lapped the reader while the spans were in use:
+ * what was read from them may be torn, and the unread data is discarded. */
+static inline ssize_t audio_ring_read_release(struct audio_ring *ring, size_t bytes) {
+    uint32_t front = ring->front;
+    /* Order the caller's reads of the spans before the check of the writer's index */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t rear = __atomic_load_n(&ring->rear, __ATOMIC_RELAXED);
+    if (rear - front > ring->capacity) {
+        __atomic_store_n(&ring->front, rear, __ATOMIC_RELEASE);
+        return -EOVERFLOW;
+    }
+    __atomic_store_n(&ring->front, front + (uint32_t)bytes, __ATOMIC_RELEASE);
+    return bytes;
+}
+
+static inline ssize_t audio_ring_read(struct audio_ring *ring, void *buffer, size_t bytes) {
+    struct audio_ring_span span[2];
+    ssize_t ret = audio_ring_read_obtain(ring, span, bytes);
+    if (ret <= 0) {
+        return ret;
+    }
+    memcpy(buffer, span[0].data, span[0].bytes);
+    memcpy((uint8_t *)buffer + span[0].bytes, span[1].data, span[1].bytes);
+    return audio_ring_read_release(ring, ret);
+}
+
+/* Consumer. Drops all unread data. */
+static inline void audio_ring_flush(struct audio_ring *ring) {
+    __atomic_store_n(&ring->front, __atomic_load_n(&ring->rear, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+/* Producer */
+static inline ssize_t audio_ring_available_to_write(struct audio_ring *ring) {
+    if (!ring->reader_throttles_writer) {
+        return ring->capacity;
+    }
+    uint32_t front = __atomic_load_n(&ring->front, __ATOMIC_ACQUIRE);
+    return ring->capacity - (ring->rear - front);
+}
+
+/* Producer. Exposes up to 'bytes' of writable space in place. */
+static inline ssize_t audio_ring_write_obtain(struct audio_ring *ring,
+                                              struct audio_ring_span span[2], size_t bytes) {
+    size_t available = audio_ring_available_to_write(ring);
+    if (bytes > available) {
+        bytes = available;
+    }
+    audio_ring_spans(ring, ring->rear, bytes, span);
+    return bytes;
+}
+
+/* Producer. Publishes 'bytes' previously returned by audio_ring_write_obtain(). */
+static inline void audio_ring_write_release(struct audio_ring *ring, size_t bytes) {
+    __atomic_store_n(&ring->rear, ring->rear + (uint32_t)bytes, __ATOMIC_RELEASE);
+}
+
+static inline ssize_t audio_ring_write(struct audio_ring *ring, const void *buffer,
+                                       size_t bytes) {
+    struct audio_ring_span span[2];
+    ssize_t ret = audio_ring_write_obtain(ring, span, bytes);
+    if (ret <= 0) {
+        return ret;
+    }
+    memcpy(span[0].data, buffer, span[0].bytes);
+    memcpy(span[1].data, (const uint8_t *)buffer + span[0].bytes, span[1].bytes);
+    audio_ring_write_release(ring, ret);
+    return ret;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* #ifndef _AUDIO_RING_H_ */
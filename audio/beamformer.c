@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_beamformer"
+//#define LOG_NDEBUG 0
+
+#include <assert.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "beamformer.h"
+
+#ifdef __ARM_NEON
+#include "arm_neon.h"
+#endif /* #ifdef __ARM_NEON */
+
+#define Q31_SCALE 2147483648.0f
+
+static int parse_vector(const char* str, float v[3]) {
+    return (sscanf(str, "%f,%f,%f", &v[0], &v[1], &v[2]) == 3) ? 0 : -1;
+}
+
+void beamformer_get_geometry(beamformer_geometry_t* geometry) {
+    char value[PROPERTY_VALUE_MAX];
+    memset(geometry, 0, sizeof(beamformer_geometry_t));
+    geometry->direction[2] = 1.0f;
+
+    if (property_get(BEAMFORMER_MIC_POSITIONS_PROPERTY, value, NULL) > 0) {
+        char* saveptr = NULL;
+        for (char* mic = strtok_r(value, ";", &saveptr);
+             (mic != NULL) && (geometry->num_mics < BEAMFORMER_MAX_MICS);
+             mic = strtok_r(NULL, ";", &saveptr)) {
+            if (parse_vector(mic, geometry->positions[geometry->num_mics])) {
+                ALOGW("%s: Ignoring malformed mic positions", __func__);
+                geometry->num_mics = 0;
+                break;
+            }
+            geometry->num_mics++;
+        }
+    }
+    if (property_get(BEAMFORMER_DIRECTION_PROPERTY, value, NULL) > 0) {
+        float direction[3];
+        float norm = 0.0f;
+        if (!parse_vector(value, direction)) {
+            norm = sqrtf(direction[0] * direction[0] + direction[1] * direction[1] +
+                         direction[2] * direction[2]);
+        }
+        if (norm > 0.0f) {
+            for (int i = 0; i < 3; i++) {
+                geometry->direction[i] = direction[i] / norm;
+            }
+        } else {
+            ALOGW("%s: Ignoring invalid beam direction %s", __func__, value);
+        }
+    }
+}
+
+beamformer_t* beamformer_init(uint32_t num_mics, uint32_t sample_rate,
+                              const beamformer_geometry_t* geometry) {
+    if ((num_mics == 0) || (num_mics > BEAMFORMER_MAX_MICS) || (sample_rate == 0)) {
+        ALOGE("%s: Invalid config: %u mics, rate %u", __func__, num_mics, sample_rate);
+        return NULL;
+    }
+
+    beamformer_t* bf = (beamformer_t*)calloc(1, sizeof(beamformer_t));
+    if (bf == NULL) {
+        ALOGE("%s: Unable to allocate memory for beamformer.", __func__);
+        return NULL;
+    }
+    bf->num_mics = num_mics;
+    bf->sample_rate = sample_rate;
+    bf->fft = fft_init(BEAMFORMER_FFT_SIZE);
+    if (bf->fft == NULL) {
+        free(bf);
+        return NULL;
+    }
+
+    const size_t spectra = (size_t)num_mics * BEAMFORMER_NUM_BINS;
+    const size_t floats = BEAMFORMER_FFT_SIZE                   /* window */
+                          + (size_t)num_mics * BEAMFORMER_FFT_SIZE /* input */
+                          + 2 * spectra                         /* weight_re, weight_im */
+                          + 4 * BEAMFORMER_NUM_BINS             /* spectrum, sum */
+                          + BEAMFORMER_FFT_SIZE                 /* time */
+                          + 2 * BEAMFORMER_HOP_SIZE;            /* overlap, output */
+    float* mem = (float*)memalign(16, floats * sizeof(float));
+    if (mem == NULL) {
+        ALOGE("%s: Unable to allocate memory for beamformer buffers.", __func__);
+        fft_release(bf->fft);
+        free(bf);
+        return NULL;
+    }
+    bf->window = mem;
+    bf->input = bf->window + BEAMFORMER_FFT_SIZE;
+    bf->weight_re = bf->input + (size_t)num_mics * BEAMFORMER_FFT_SIZE;
+    bf->weight_im = bf->weight_re + spectra;
+    bf->spectrum_re = bf->weight_im + spectra;
+    bf->spectrum_im = bf->spectrum_re + BEAMFORMER_NUM_BINS;
+    bf->sum_re = bf->spectrum_im + BEAMFORMER_NUM_BINS;
+    bf->sum_im = bf->sum_re + BEAMFORMER_NUM_BINS;
+    bf->time = bf->sum_im + BEAMFORMER_NUM_BINS;
+    bf->overlap = bf->time + BEAMFORMER_FFT_SIZE;
+    bf->output = bf->overlap + BEAMFORMER_HOP_SIZE;
+
+    /* sqrt-Hann, applied twice it sums to one at 50% overlap */
+    for (uint32_t n = 0; n < BEAMFORMER_FFT_SIZE; n++) {
+        bf->window[n] = sinf((float)M_PI * n / BEAMFORMER_FFT_SIZE);
+    }
+
+    /* A mic further along the look direction hears the source earlier by
+     * (p . d) / c. Delaying it by that much aligns all mics. */
+    bool steered = (geometry != NULL) && (geometry->num_mics >= num_mics);
+    for (uint32_t mic = 0; mic < num_mics; mic++) {
+        float advance_sec = 0.0f;
+        if (steered) {
+            const float* p = geometry->positions[mic];
+            advance_sec = (p[0] * geometry->direction[0] + p[1] * geometry->direction[1] +
+                           p[2] * geometry->direction[2]) / BEAMFORMER_SPEED_OF_SOUND;
+        }
+        float* w_re = &bf->weight_re[mic * BEAMFORMER_NUM_BINS];
+        float* w_im = &bf->weight_im[mic * BEAMFORMER_NUM_BINS];
+        for (uint32_t k = 0; k < BEAMFORMER_NUM_BINS; k++) {
+            float omega = 2.0f * (float)M_PI * k * sample_rate / BEAMFORMER_FFT_SIZE;
+            w_re[k] = cosf(omega * advance_sec) / num_mics;
+            w_im[k] = -sinf(omega * advance_sec) / num_mics;
+        }
+    }
+
+#ifdef __ARM_NEON
+    ALOGI("%s: Using ARM Neon", __func__);
+#endif /* #ifdef __ARM_NEON */
+    ALOGI("%s: %u mics at %u Hz, %s", __func__, num_mics, sample_rate,
+          steered ? "steered" : "broadside");
+
+    beamformer_reset(bf);
+    return bf;
+}
+
+void beamformer_release(beamformer_t* bf) {
+    if (bf == NULL) {
+        return;
+    }
+    fft_release(bf->fft);
+    free(bf->window);
+    free(bf);
+}
+
+void beamformer_reset(beamformer_t* bf) {
+    if (bf == NULL) {
+        return;
+    }
+    memset(bf->input, 0, (size_t)bf->num_mics * BEAMFORMER_FFT_SIZE * sizeof(float));
+    memset(bf->overlap, 0, BEAMFORMER_HOP_SIZE * sizeof(float));
+    memset(bf->output, 0, BEAMFORMER_HOP_SIZE * sizeof(float));
+    bf->fill = 0;
+}
+
+/* acc += a * b, complex, over 'bins' bins */
+static void complex_mac(float* acc_re, float* acc_im, const float* a_re, const float* a_im,
+                        const float* b_re, const float* b_im, uint32_t bins) {
+    uint32_t k = 0;
+#ifdef __ARM_NEON
+    for (; k + 4 <= bins; k += 4) {
+        float32x4_t ar = vld1q_f32(&a_re[k]);
+        float32x4_t ai = vld1q_f32(&a_im[k]);
+        float32x4_t br = vld1q_f32(&b_re[k]);
+        float32x4_t bi = vld1q_f32(&b_im[k]);
+        float32x4_t cr = vld1q_f32(&acc_re[k]);
+        float32x4_t ci = vld1q_f32(&acc_im[k]);
+        cr = vmlsq_f32(vmlaq_f32(cr, ar, br), ai, bi);
+        ci = vmlaq_f32(vmlaq_f32(ci, ar, bi), ai, br);
+        vst1q_f32(&acc_re[k], cr);
+        vst1q_f32(&acc_im[k], ci);
+    }
+#endif /* #ifdef __ARM_NEON */
+    for (; k < bins; k++) {
+        acc_re[k] += a_re[k] * b_re[k] - a_im[k] * b_im[k];
+        acc_im[k] += a_re[k] * b_im[k] + a_im[k] * b_re[k];
+    }
+}
+
+static void multiply(float* out, const float* a, const float* b, uint32_t count) {
+    uint32_t n = 0;
+#ifdef __ARM_NEON
+    for (; n + 4 <= count; n += 4) {
+        vst1q_f32(&out[n], vmulq_f32(vld1q_f32(&a[n]), vld1q_f32(&b[n])));
+    }
+#endif /* #ifdef __ARM_NEON */
+    for (; n < count; n++) {
+        out[n] = a[n] * b[n];
+    }
+}
+
+/* Filter the hop just completed in 'input' into 'output' */
+static void process_hop(beamformer_t* bf) {
+    memset(bf->sum_re, 0, BEAMFORMER_NUM_BINS * sizeof(float));
+    memset(bf->sum_im, 0, BEAMFORMER_NUM_BINS * sizeof(float));
+    for (uint32_t mic = 0; mic < bf->num_mics; mic++) {
+        float* input = &bf->input[mic * BEAMFORMER_FFT_SIZE];
+        multiply(bf->time, input, bf->window, BEAMFORMER_FFT_SIZE);
+        fft_forward_real(bf->fft, bf->time, bf->spectrum_re, bf->spectrum_im);
+        complex_mac(bf->sum_re, bf->sum_im, bf->spectrum_re, bf->spectrum_im,
+                    &bf->weight_re[mic * BEAMFORMER_NUM_BINS],
+                    &bf->weight_im[mic * BEAMFORMER_NUM_BINS], BEAMFORMER_NUM_BINS);
+        /* The new hop is the old one next time */
+        memcpy(input, input + BEAMFORMER_HOP_SIZE, BEAMFORMER_HOP_SIZE * sizeof(float));
+    }
+    fft_inverse_real(bf->fft, bf->sum_re, bf->sum_im, bf->time);
+    multiply(bf->time, bf->time, bf->window, BEAMFORMER_FFT_SIZE);
+    for (uint32_t n = 0; n < BEAMFORMER_HOP_SIZE; n++) {
+        bf->output[n] = bf->overlap[n] + bf->time[n];
+    }
+    memcpy(bf->overlap, bf->time + BEAMFORMER_HOP_SIZE, BEAMFORMER_HOP_SIZE * sizeof(float));
+}
+
+static int32_t float_to_q31(float x) {
+    float scaled = x * Q31_SCALE;
+    if (scaled >= Q31_SCALE) {
+        return INT32_MAX;
+    } else if (scaled <= -Q31_SCALE) {
+        return INT32_MIN;
+    }
+    return (int32_t)scaled;
+}
+
+void beamformer_process(beamformer_t* bf, const int32_t* in, int32_t* out, uint32_t frames) {
+    assert(bf != NULL);
+
+    const uint32_t num_mics = bf->num_mics;
+    while (frames > 0) {
+        uint32_t count = BEAMFORMER_HOP_SIZE - bf->fill;
+        if (count > frames) {
+            count = frames;
+        }
+        for (uint32_t mic = 0; mic < num_mics; mic++) {
+            float* dst = &bf->input[mic * BEAMFORMER_FFT_SIZE + BEAMFORMER_HOP_SIZE + bf->fill];
+            const int32_t* src = &in[mic];
+            for (uint32_t frame = 0; frame < count; frame++, src += num_mics) {
+                dst[frame] = (float)*src / Q31_SCALE;
+            }
+        }
+        /* Hand out the last complete hop while this one fills up */
+        for (uint32_t frame = 0; frame < count; frame++) {
+            out[frame] = float_to_q31(bf->output[bf->fill + frame]);
+        }
+        in += count * num_mics;
+        out += count;
+        frames -= count;
+        bf->fill += count;
+        if (bf->fill == BEAMFORMER_HOP_SIZE) {
+            process_hop(bf);
+            bf->fill = 0;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Frequency domain delay-and-sum beamformer for multi-mic capture.
+ *
+ * Mic channels are transformed in blocks of BEAMFORMER_HOP_SIZE frames with 50%
+ * overlap (sqrt-Hann analysis and synthesis windows), phase aligned towards the look
+ * direction, averaged and transformed back. The output is mono and lags the input by
+ * BEAMFORMER_FFT_SIZE frames. Without a mic geometry all delays are zero and the beam
+ * points broadside. Samples are interleaved S32.
+ */
+
+#ifndef BEAMFORMER_H
+#define BEAMFORMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio_fft.h"
+
+#define BEAMFORMER_PROPERTY "vendor.audio.capture.beamformer"
+/* Mic positions in meters, device coordinates as in audio_microphone_characteristic_t:
+ * "x,y,z;x,y,z;...", one triple per capture channel */
+#define BEAMFORMER_MIC_POSITIONS_PROPERTY "vendor.audio.capture.mic_positions"
+/* Look direction "x,y,z", defaults to the front of the device */
+#define BEAMFORMER_DIRECTION_PROPERTY "vendor.audio.capture.beam_direction"
+
+#define BEAMFORMER_MAX_MICS 8
+#define BEAMFORMER_HOP_SIZE 128
+#define BEAMFORMER_FFT_SIZE (2 * BEAMFORMER_HOP_SIZE)
+#define BEAMFORMER_NUM_BINS (BEAMFORMER_HOP_SIZE + 1)
+#define BEAMFORMER_SPEED_OF_SOUND 343.0f
+
+typedef struct beamformer_geometry {
+    uint32_t num_mics;  /* 0 if unknown */
+    float positions[BEAMFORMER_MAX_MICS][3];
+    float direction[3];
+} beamformer_geometry_t;
+
+typedef struct beamformer {
+    uint32_t num_mics;
+    uint32_t sample_rate;
+    audio_fft_t* fft;
+    float* window;        /* BEAMFORMER_FFT_SIZE */
+    /* Per mic, BEAMFORMER_FFT_SIZE: last hop followed by the one being filled */
+    float* input;
+    /* Per mic steering weights, split complex, already scaled by 1 / num_mics */
+    float* weight_re;
+    float* weight_im;
+    float* spectrum_re;   /* scratch */
+    float* spectrum_im;
+    float* sum_re;
+    float* sum_im;
+    float* time;          /* scratch, BEAMFORMER_FFT_SIZE */
+    float* overlap;       /* second half of the previous inverse transform */
+    float* output;        /* output of the last complete hop */
+    uint32_t fill;        /* frames of the current hop received */
+} beamformer_t;
+
+/* Fill 'geometry' from the vendor.audio.capture.* properties. */
+void beamformer_get_geometry(beamformer_geometry_t* geometry);
+
+/* 'geometry' may be NULL, or describe fewer mics than 'num_mics', in which case
+ * the beam is not steered. */
+beamformer_t* beamformer_init(uint32_t num_mics, uint32_t sample_rate,
+                              const beamformer_geometry_t* geometry);
+void beamformer_release(beamformer_t* bf);
+void beamformer_reset(beamformer_t* bf);
+/* 'in' holds 'frames' frames of num_mics channels, 'out' receives 'frames' mono samples. */
+void beamformer_process(beamformer_t* bf, const int32_t* in, int32_t* out, uint32_t frames);
+
+#endif /* #ifndef BEAMFORMER_H */
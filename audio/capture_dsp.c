@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_capture_dsp"
+//#define LOG_NDEBUG 0
+
+#include <assert.h>
+#include <cutils/properties.h>
+#include <errno.h>
+#include <log/log.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture_dsp.h"
+
+#ifdef __ARM_NEON
+#include "arm_neon.h"
+#endif /* #ifdef __ARM_NEON */
+
+#define Q31_SCALE 2147483648.0f
+
+/* AGC gain smoothing per period, faster when the gain has to come down */
+#define AGC_ATTACK 0.5f
+#define AGC_RELEASE 0.1f
+
+static float db_to_linear(float db) {
+    return powf(10.0f, db / 20.0f);
+}
+
+static float get_float_property(const char* name, float default_value) {
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(name, value, NULL) <= 0) {
+        return default_value;
+    }
+    return strtof(value, NULL);
+}
+
+void capture_dsp_get_config(capture_dsp_config_t* config) {
+    config->dc_block = property_get_bool(CAPTURE_DSP_DC_BLOCK_PROPERTY, false);
+    config->hpf_cutoff_hz = get_float_property(CAPTURE_DSP_HPF_PROPERTY, 0.0f);
+    config->gain_db = get_float_property(CAPTURE_DSP_GAIN_PROPERTY, 0.0f);
+    config->agc = property_get_bool(CAPTURE_DSP_AGC_PROPERTY, false);
+}
+
+capture_dsp_t* capture_dsp_init(uint32_t channels, uint32_t sample_rate,
+                                const capture_dsp_config_t* config) {
+    if ((channels == 0) || (sample_rate == 0) || (config == NULL)) {
+        ALOGE("%s: Invalid channel count, sample rate or config.", __func__);
+        return NULL;
+    }
+
+    capture_dsp_t* dsp = (capture_dsp_t*)calloc(1, sizeof(capture_dsp_t));
+    if (dsp == NULL) {
+        ALOGE("%s: Unable to allocate memory for capture_dsp.", __func__);
+        return NULL;
+    }
+    dsp->state = (capture_dsp_channel_t*)calloc(channels, sizeof(capture_dsp_channel_t));
+    if (dsp->state == NULL) {
+        ALOGE("%s: Unable to allocate memory for capture_dsp state.", __func__);
+        free(dsp);
+        return NULL;
+    }
+    dsp->config = *config;
+    dsp->channels = channels;
+    dsp->sample_rate = sample_rate;
+
+    /* Disabled stages get identity coefficients, so the inner loop never branches */
+    dsp->dc_pole = 0.0f;
+    if (config->dc_block) {
+        dsp->dc_pole = 1.0f - (2.0f * (float)M_PI * CAPTURE_DSP_DC_CUTOFF_HZ / sample_rate);
+    }
+    dsp->hpf_b0 = 1.0f;
+    dsp->hpf_b1 = dsp->hpf_b2 = dsp->hpf_a1 = dsp->hpf_a2 = 0.0f;
+    if ((config->hpf_cutoff_hz > 0.0f) && (config->hpf_cutoff_hz < sample_rate / 2.0f)) {
+        /* Butterworth, Q = 1/sqrt(2) (RBJ cookbook) */
+        float w0 = 2.0f * (float)M_PI * config->hpf_cutoff_hz / sample_rate;
+        float cos_w0 = cosf(w0);
+        float alpha = sinf(w0) / (2.0f * (float)M_SQRT1_2);
+        float a0 = 1.0f + alpha;
+        dsp->hpf_b0 = (1.0f + cos_w0) / 2.0f / a0;
+        dsp->hpf_b1 = -(1.0f + cos_w0) / a0;
+        dsp->hpf_b2 = dsp->hpf_b0;
+        dsp->hpf_a1 = -2.0f * cos_w0 / a0;
+        dsp->hpf_a2 = (1.0f - alpha) / a0;
+    } else if (config->hpf_cutoff_hz != 0.0f) {
+        ALOGW("%s: Ignoring invalid high-pass cutoff %f Hz", __func__, config->hpf_cutoff_hz);
+    }
+    float gain_db = config->gain_db;
+    if (fabsf(gain_db) > CAPTURE_DSP_MAX_GAIN_DB) {
+        gain_db = copysignf(CAPTURE_DSP_MAX_GAIN_DB, gain_db);
+    }
+    dsp->config_gain = db_to_linear(gain_db);
+    dsp->target_gain = dsp->config_gain;
+
+#ifdef __ARM_NEON
+    ALOGI("%s: Using ARM Neon", __func__);
+#endif /* #ifdef __ARM_NEON */
+    ALOGI("%s: dc_block %d, hpf %.1f Hz, gain %.1f dB, agc %d", __func__, config->dc_block,
+          config->hpf_cutoff_hz, gain_db, config->agc);
+
+    capture_dsp_reset(dsp);
+    return dsp;
+}
+
+void capture_dsp_release(capture_dsp_t* dsp) {
+    if (dsp == NULL) {
+        return;
+    }
+    free(dsp->state);
+    free(dsp);
+}
+
+void capture_dsp_reset(capture_dsp_t* dsp) {
+    if (dsp == NULL) {
+        return;
+    }
+    memset(dsp->state, 0, dsp->channels * sizeof(capture_dsp_channel_t));
+    /* Keep any capture_dsp_set_gain(), just skip the ramp to it */
+    dsp->gain = dsp->target_gain;
+    dsp->agc_gain = dsp->agc_target_gain = 1.0f;
+}
+
+void capture_dsp_set_gain(capture_dsp_t* dsp, float gain) {
+    if (dsp == NULL) {
+        return;
+    }
+    if (gain < 0.0f) {
+        gain = 0.0f;
+    }
+    /* Picked up, and ramped to, at the next period */
+    dsp->target_gain = dsp->config_gain * gain;
+}
+
+static int32_t float_to_q31(float x) {
+    float scaled = x * Q31_SCALE;
+    if (scaled >= Q31_SCALE) {
+        return INT32_MAX;
+    } else if (scaled <= -Q31_SCALE) {
+        return INT32_MIN;
+    }
+    return (int32_t)scaled;
+}
+
+void capture_dsp_process(capture_dsp_t* dsp, int32_t* buffer, uint32_t frames) {
+    assert(dsp != NULL);
+
+    bool identity = (dsp->dc_pole == 0.0f) && (dsp->hpf_b0 == 1.0f) && (dsp->hpf_b1 == 0.0f) &&
+                    (dsp->gain == 1.0f) && (dsp->target_gain == 1.0f);
+    if (identity || (frames == 0)) {
+        return;
+    }
+
+    const float target_gain = dsp->target_gain;
+    const float gain_step = (target_gain - dsp->gain) / frames;
+    /* x[n-1] coefficient of the DC blocker: -1 when enabled, 0 for identity */
+    const float dc_zero = (dsp->dc_pole != 0.0f) ? -1.0f : 0.0f;
+    const float dc_pole = dsp->dc_pole;
+    const float b0 = dsp->hpf_b0, b1 = dsp->hpf_b1, b2 = dsp->hpf_b2;
+    const float a1 = dsp->hpf_a1, a2 = dsp->hpf_a2;
+
+#ifdef __ARM_NEON
+    if (dsp->channels == 2) {
+        float32x2_t x1 = {dsp->state[0].dc_x1, dsp->state[1].dc_x1};
+        float32x2_t y1 = {dsp->state[0].dc_y1, dsp->state[1].dc_y1};
+        float32x2_t z1 = {dsp->state[0].hpf_z1, dsp->state[1].hpf_z1};
+        float32x2_t z2 = {dsp->state[0].hpf_z2, dsp->state[1].hpf_z2};
+        float gain = dsp->gain;
+        int32_t* p = buffer;
+        for (uint32_t frame = 0; frame < frames; frame++, p += 2) {
+            float32x2_t x = vcvt_n_f32_s32(vld1_s32(p), 31);
+            /* DC blocker */
+            float32x2_t dc = vmla_n_f32(vmla_n_f32(x, x1, dc_zero), y1, dc_pole);
+            x1 = x;
+            y1 = dc;
+            /* High-pass, transposed direct form II */
+            float32x2_t y = vmla_n_f32(z1, dc, b0);
+            z1 = vmls_n_f32(vmla_n_f32(z2, dc, b1), y, a1);
+            z2 = vmls_n_f32(vmul_n_f32(dc, b2), y, a2);
+            /* Gain, saturated by the conversion */
+            vst1_s32(p, vcvt_n_s32_f32(vmul_n_f32(y, gain), 31));
+            gain += gain_step;
+        }
+        dsp->state[0].dc_x1 = vget_lane_f32(x1, 0);
+        dsp->state[1].dc_x1 = vget_lane_f32(x1, 1);
+        dsp->state[0].dc_y1 = vget_lane_f32(y1, 0);
+        dsp->state[1].dc_y1 = vget_lane_f32(y1, 1);
+        dsp->state[0].hpf_z1 = vget_lane_f32(z1, 0);
+        dsp->state[1].hpf_z1 = vget_lane_f32(z1, 1);
+        dsp->state[0].hpf_z2 = vget_lane_f32(z2, 0);
+        dsp->state[1].hpf_z2 = vget_lane_f32(z2, 1);
+        dsp->gain = target_gain;
+        return;
+    }
+#endif /* #ifdef __ARM_NEON */
+
+    for (uint32_t ch = 0; ch < dsp->channels; ch++) {
+        capture_dsp_channel_t* st = &dsp->state[ch];
+        float x1 = st->dc_x1, y1 = st->dc_y1, z1 = st->hpf_z1, z2 = st->hpf_z2;
+        float gain = dsp->gain;
+        int32_t* p = &buffer[ch];
+        for (uint32_t frame = 0; frame < frames; frame++, p += dsp->channels) {
+            float x = (float)*p / Q31_SCALE;
+            float dc = x + dc_zero * x1 + dc_pole * y1;
+            x1 = x;
+            y1 = dc;
+            float y = b0 * dc + z1;
+            z1 = b1 * dc - a1 * y + z2;
+            z2 = b2 * dc - a2 * y;
+            *p = float_to_q31(y * gain);
+            gain += gain_step;
+        }
+        st->dc_x1 = x1;
+        st->dc_y1 = y1;
+        st->hpf_z1 = z1;
+        st->hpf_z2 = z2;
+    }
+    dsp->gain = target_gain;
+}
+
+void capture_dsp_process_agc(capture_dsp_t* dsp, int32_t* buffer, uint32_t frames) {
+    assert(dsp != NULL);
+
+    if (!dsp->config.agc || (frames == 0)) {
+        return;
+    }
+
+    /* Apply the gain computed from the previous periods, ramped, and measure this one */
+    const uint32_t samples = frames * dsp->channels;
+    const float target_gain = dsp->agc_target_gain;
+    const float gain_step = (target_gain - dsp->agc_gain) / frames;
+    float gain = dsp->agc_gain;
+    double energy = 0.0;
+    int32_t* p = buffer;
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        for (uint32_t ch = 0; ch < dsp->channels; ch++, p++) {
+            float x = (float)*p / Q31_SCALE;
+            energy += x * x;
+            *p = float_to_q31(x * gain);
+        }
+        gain += gain_step;
+    }
+    dsp->agc_gain = target_gain;
+
+    float level_dbfs = 10.0f * log10f((float)(energy / samples) + 1e-12f);
+    if (level_dbfs < CAPTURE_DSP_AGC_NOISE_FLOOR_DBFS) {
+        /* Don't pump up silence or background noise */
+        return;
+    }
+    float wanted_db = CAPTURE_DSP_AGC_TARGET_DBFS - level_dbfs;
+    if (wanted_db > CAPTURE_DSP_MAX_GAIN_DB) {
+        wanted_db = CAPTURE_DSP_MAX_GAIN_DB;
+    } else if (wanted_db < -CAPTURE_DSP_MAX_GAIN_DB) {
+        wanted_db = -CAPTURE_DSP_MAX_GAIN_DB;
+    }
+    float wanted = db_to_linear(wanted_db);
+    float smoothing = (wanted < target_gain) ? AGC_ATTACK : AGC_RELEASE;
+    dsp->agc_target_gain = target_gain + smoothing * (wanted - target_gain);
+}
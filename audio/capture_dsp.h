@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microphone preprocessing run once per period in in_read().
+ *
+ * capture_dsp_process() applies the linear stages (DC removal, 2nd-order Butterworth
+ * high-pass, gain) in one pass, before the echo canceller. Every stage is off unless
+ * enabled by its vendor.audio.capture.* property. The AGC is not linear, so
+ * capture_dsp_process_agc() is applied separately, after the echo canceller.
+ * Samples are interleaved S32.
+ */
+
+#ifndef CAPTURE_DSP_H
+#define CAPTURE_DSP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CAPTURE_DSP_DC_BLOCK_PROPERTY "vendor.audio.capture.dc_block"
+#define CAPTURE_DSP_HPF_PROPERTY "vendor.audio.capture.hpf_hz"
+#define CAPTURE_DSP_GAIN_PROPERTY "vendor.audio.capture.gain_db"
+#define CAPTURE_DSP_AGC_PROPERTY "vendor.audio.capture.agc"
+
+#define CAPTURE_DSP_DC_CUTOFF_HZ 10.0f
+#define CAPTURE_DSP_MAX_GAIN_DB 30.0f
+#define CAPTURE_DSP_AGC_TARGET_DBFS (-20.0f)
+#define CAPTURE_DSP_AGC_NOISE_FLOOR_DBFS (-60.0f)
+
+typedef struct capture_dsp_config {
+    bool dc_block;
+    float hpf_cutoff_hz; /* 0 disables the high-pass */
+    float gain_db;
+    bool agc;
+} capture_dsp_config_t;
+
+typedef struct capture_dsp_channel {
+    float dc_x1;
+    float dc_y1;
+    float hpf_z1;
+    float hpf_z2;
+} capture_dsp_channel_t;
+
+typedef struct capture_dsp {
+    capture_dsp_config_t config;
+    uint32_t channels;
+    uint32_t sample_rate;
+    float dc_pole;
+    float hpf_b0, hpf_b1, hpf_b2, hpf_a1, hpf_a2;
+    float config_gain;
+    /* Gain ramps from 'gain' to 'target_gain' over one period */
+    float gain;
+    float target_gain;
+    float agc_gain;
+    float agc_target_gain;
+    capture_dsp_channel_t* state;
+} capture_dsp_t;
+
+/* Fill 'config' from the vendor.audio.capture.* properties. */
+void capture_dsp_get_config(capture_dsp_config_t* config);
+
+capture_dsp_t* capture_dsp_init(uint32_t channels, uint32_t sample_rate,
+                                const capture_dsp_config_t* config);
+void capture_dsp_release(capture_dsp_t* dsp);
+/* Clear the filter and AGC state, e.g. on stream start. The gain set with
+ * capture_dsp_set_gain() is kept. */
+void capture_dsp_reset(capture_dsp_t* dsp);
+/* Linear gain on top of the configured one, e.g. from audio_stream_in::set_gain(). */
+void capture_dsp_set_gain(capture_dsp_t* dsp, float gain);
+void capture_dsp_process(capture_dsp_t* dsp, int32_t* buffer, uint32_t frames);
+void capture_dsp_process_agc(capture_dsp_t* dsp, int32_t* buffer, uint32_t frames);
+
+#endif /* #ifndef CAPTURE_DSP_H */
@@ -98,7 +98,17 @@ void fir_reset(fir_filter_t* fir) {
     memset(fir->state, 0, fir->buffer_size * sizeof(int16_t));
 }
 
-void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output, uint32_t samples) {
+static int32_t gain_to_q30(float gain) {
+    if (!(gain > 0.0f)) {
+        return 0;
+    }
+    return (gain >= 1.0f) ? FIR_UNITY_GAIN_Q30 : (int32_t)(gain * FIR_UNITY_GAIN_Q30);
+}
+
+/* Gains are Q30 and ramp by 'step' per sample, 'A' for even and 'B' for odd channels */
+static void fir_process(fir_filter_t* fir, int16_t* input, int16_t* output, uint32_t samples,
+                        int32_t gain_A_start, int32_t gain_B_start, int32_t step_A,
+                        int32_t step_B) {
     assert(fir != NULL);
 
     int start_offset = (fir->filter_length - 1) * fir->channels;
@@ -111,6 +121,8 @@ void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output,
     for (int ch = 0; ch < fir->channels; ch += 2) {
         p_output = &output[ch];
         int offset = start_offset + ch;
+        int32_t gain_A = gain_A_start;
+        int32_t gain_B = gain_B_start;
         for (int s = 0; s < samples; s++) {
             int32_t acc_A = 0;
             int32_t acc_B = 0;
@@ -136,10 +148,13 @@ void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output,
             }
 #endif /* #ifdef __ARM_NEON */
 
-            *p_output = clamp16(acc_A >> 15);
+            /* Q30 accumulator times Q30 gain, back to Q15; unity gain is acc >> 15 */
+            *p_output = clamp16((int32_t)(((int64_t)acc_A * gain_A) >> 45));
             if (ch < fir->channels - 1) {
-                *(p_output + 1) = clamp16(acc_B >> 15);
+                *(p_output + 1) = clamp16((int32_t)(((int64_t)acc_B * gain_B) >> 45));
             }
+            gain_A += step_A;
+            gain_B += step_B;
             /* Move to next sample */
             p_output += fir->channels;
             offset += (fir->filter_length + 1) * fir->channels;
@@ -152,3 +167,21 @@ void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output,
     memmove(fir->state, &fir->state[samples * fir->channels],
             (fir->filter_length - 1) * fir->channels * sizeof(int16_t));
 }
+
+void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output, uint32_t samples) {
+    fir_process(fir, input, output, samples, FIR_UNITY_GAIN_Q30, FIR_UNITY_GAIN_Q30, 0, 0);
+}
+
+void fir_process_interleaved_gain(fir_filter_t* fir, int16_t* input, int16_t* output,
+                                  uint32_t samples, const float gain_start[2],
+                                  const float gain_end[2]) {
+    int32_t start_A = gain_to_q30(gain_start[0]);
+    int32_t start_B = gain_to_q30(gain_start[1]);
+    int32_t step_A = 0;
+    int32_t step_B = 0;
+    if (samples > 0) {
+        step_A = (gain_to_q30(gain_end[0]) - start_A) / (int32_t)samples;
+        step_B = (gain_to_q30(gain_end[1]) - start_B) / (int32_t)samples;
+    }
+    fir_process(fir, input, output, samples, start_A, start_B, step_A, step_B);
+}
@@ -19,6 +19,8 @@
 
 #include <stdint.h>
 
+#define FIR_UNITY_GAIN_Q30 (1 << 30)
+
 typedef enum fir_filter_mode { FIR_SINGLE_FILTER = 0, FIR_PER_CHANNEL_FILTER } fir_filter_mode_t;
 
 typedef struct fir_filter {
@@ -35,5 +37,10 @@ fir_filter_t* fir_init(uint32_t channels, fir_filter_mode_t mode, uint32_t filte
 void fir_release(fir_filter_t* fir);
 void fir_reset(fir_filter_t* fir);
 void fir_process_interleaved(fir_filter_t* fir, int16_t* input, int16_t* output, uint32_t samples);
+/* Filter and apply a gain in the same pass, ramping linearly from gain_start to gain_end.
+ * Gains are in [0, 1], index 0 for even and 1 for odd channels. */
+void fir_process_interleaved_gain(fir_filter_t* fir, int16_t* input, int16_t* output,
+                                  uint32_t samples, const float gain_start[2],
+                                  const float gain_end[2]);
 
 #endif /* #ifndef FIR_FILTER_H */
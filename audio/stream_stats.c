@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_stream_stats"
+//#define LOG_NDEBUG 0
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <audio_utils/clock.h>
+
+#include "stream_stats.h"
+
+uint64_t stream_stats_now_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return audio_utils_ns_from_timespec(&now);
+}
+
+void latency_histogram_add(struct latency_histogram* histogram, uint64_t nsec) {
+    uint64_t usec = nsec / 1000;
+    unsigned int bin = (usec == 0) ? 0 : (63 - __builtin_clzll(usec));
+    if (bin >= LATENCY_HISTOGRAM_BINS) {
+        bin = LATENCY_HISTOGRAM_BINS - 1;
+    }
+    histogram->bins[bin]++;
+    histogram->count++;
+    histogram->total_nsec += nsec;
+    if (nsec > histogram->max_nsec) {
+        histogram->max_nsec = nsec;
+    }
+}
+
+static void latency_histogram_dump(const struct latency_histogram* histogram, const char* name,
+                                   int fd) {
+    if (histogram->count == 0) {
+        return;
+    }
+    dprintf(fd, "    %s: count %" PRIu64 ", mean %" PRIu64 " us, max %" PRIu64 " us\n", name,
+            histogram->count, histogram->total_nsec / histogram->count / 1000,
+            histogram->max_nsec / 1000);
+    dprintf(fd, "     ");
+    for (unsigned int bin = 0; bin < LATENCY_HISTOGRAM_BINS; bin++) {
+        if (histogram->bins[bin] != 0) {
+            dprintf(fd, " >=%uus:%u", (bin == 0) ? 0 : (1u << bin), histogram->bins[bin]);
+        }
+    }
+    dprintf(fd, "\n");
+}
+
+void stream_stats_dump(const struct stream_stats* stats, const char* name, int fd) {
+    dprintf(fd, "  %s: frames %" PRIu64 ", xruns %" PRIu64 ", errors %" PRIu64
+            ", standbys %" PRIu64 "\n",
+            name, stats->frames, stats->xruns, stats->errors, stats->standbys);
+    if ((stats->reopens_avoided != 0) || (stats->deferred_closes != 0)) {
+        dprintf(fd, "    Deferred standby: reopens avoided %" PRIu64 ", closes %" PRIu64 "\n",
+                stats->reopens_avoided, stats->deferred_closes);
+    }
+    if (stats->buffer_switches != 0) {
+        dprintf(fd, "    Buffer size switches: %" PRIu64 "\n", stats->buffer_switches);
+    }
+    latency_histogram_dump(&stats->call, "Call", fd);
+    latency_histogram_dump(&stats->lock_wait, "Lock wait", fd);
+    latency_histogram_dump(&stats->blocked, "Blocked in PCM", fd);
+    latency_histogram_dump(&stats->dsp, "DSP", fd);
+}
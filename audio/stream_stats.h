@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-stream timing counters for dumpsys. Updated by the stream's audio thread
+ * without locking; dump() reads them racily, which is fine for diagnostics.
+ */
+
+#ifndef STREAM_STATS_H
+#define STREAM_STATS_H
+
+#include <stdint.h>
+
+/* Bin i counts durations in [2^i, 2^(i+1)) microseconds, the last bin everything above */
+#define LATENCY_HISTOGRAM_BINS 20
+
+struct latency_histogram {
+    uint64_t count;
+    uint64_t total_nsec;
+    uint64_t max_nsec;
+    uint32_t bins[LATENCY_HISTOGRAM_BINS];
+};
+
+struct stream_stats {
+    struct latency_histogram call;       /* whole read()/write() */
+    struct latency_histogram lock_wait;  /* acquiring the device and stream locks */
+    struct latency_histogram blocked;    /* inside pcm_read()/pcm_write() */
+    struct latency_histogram dsp;        /* EQ or capture processing per period */
+    uint64_t frames;
+    uint64_t xruns;                      /* under/overruns, recovered in place */
+    uint64_t errors;                     /* failed writes/reads, incl. stream start */
+    uint64_t standbys;
+    uint64_t reopens_avoided;            /* writes that reused a PCM kept open in standby */
+    uint64_t deferred_closes;            /* PCMs closed after the standby delay expired */
+    uint64_t buffer_switches;            /* PCMs reopened with another buffer size */
+};
+
+uint64_t stream_stats_now_nsec(void);
+void latency_histogram_add(struct latency_histogram* histogram, uint64_t nsec);
+void stream_stats_dump(const struct stream_stats* stats, const char* name, int fd);
+
+#endif /* #ifndef STREAM_STATS_H */
@@ -0,0 +1,103 @@
+# Copyright (C) 2020 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# Host unit tests of the HAL's signal processing, which has no hardware dependency.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_host_tests
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+    aec_process_test.cpp \
+    audio_ring_test.cpp \
+    ../audio_aec_process.c \
+    ../audio_fft.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_CFLAGS := -Wno-unused-parameter
+
+include $(BUILD_HOST_NATIVE_TEST)
+
+# audio_ring.h against the audio_utils_fifo wrapper it replaced.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_ring_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := audio_ring_benchmark.cpp
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+    system/media/audio_utils/include
+LOCAL_STATIC_LIBRARIES := libgoogle-benchmark
+LOCAL_SHARED_LIBRARIES := liblog libaudioutils
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# AEC pipeline benchmark: the reference FIFO, resampling, timestamp checks and canceller of
+# audio_aec.c on a simulated echo path with clock skew and timestamp jitter.
+# Reports ERLE, canceller CPU per period and realignment counts; see aec_pipeline_bench.c.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := aec_pipeline_bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+    aec_pipeline_bench.c \
+    ../audio_aec.c \
+    ../audio_aec_process.c \
+    ../audio_aec_trace.c \
+    ../audio_fft.c
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+    external/tinyalsa/include \
+    system/media/audio_utils/include \
+    system/media/audio_effects/include
+LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils
+LOCAL_CFLAGS := -DAEC_HAL -Wno-unused-parameter
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The whole HAL (adev_open, out_write, in_read with the in-HAL AEC) against fake_tinyalsa.c,
+# which runs the PCMs on real time and loops the speaker back into the mics.
+# Reports end-to-end latency, HAL CPU per period, ERLE and behaviour under injected
+# underruns and overruns; see loopback_bench.c.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hal_loopback_bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+    loopback_bench.c \
+    fake_tinyalsa.c \
+    ../audio_hw.c \
+    ../audio_aec.c \
+    ../audio_aec_process.c \
+    ../audio_aec_trace.c \
+    ../audio_fft.c \
+    ../beamformer.c \
+    ../capture_dsp.c \
+    ../fir_filter.c \
+    ../stream_stats.c \
+    ../volume_ramp.c
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+    external/tinyalsa/include \
+    $(call include-path-for, audio-route) \
+    system/media/audio_utils/include \
+    system/media/audio_effects/include
+# No libtinyalsa or libaudioroute: fake_tinyalsa.c stands in for both
+LOCAL_SHARED_LIBRARIES := liblog libcutils libaudioutils
+LOCAL_CFLAGS := -DAEC_HAL -Wno-unused-parameter
+
+include $(BUILD_HOST_EXECUTABLE)
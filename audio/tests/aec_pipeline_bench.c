@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the AEC pipeline of audio_aec.c (reference FIFO, resampler, timestamp checks and
+ * the canceller) the way out_write() and in_read() do, on a simulated clock, and reports
+ * ERLE, canceller CPU time per period and how often the reference had to be realigned.
+ *
+ * Playback is written in PLAYBACK_PERIOD_SIZE chunks at 48 kHz and heard 'latency' later;
+ * the mic hears it through a synthetic room (bulk delay + decaying impulse response) and
+ * is read in CAPTURE_PERIOD_SIZE chunks at 16 kHz. The mic clock can run off the speaker
+ * clock by 'skew' ppm, and both timestamps can be jittered.
+ *
+ * usage: aec_pipeline_bench [-d seconds] [-l latency_ms] [-b bulk_ms] [-r ir_ms]
+ *                           [-s skew_ppm] [-j jitter_usec] [-n noise_db] [-v]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio_aec.h"
+
+#define SPK_RATE PLAYBACK_CODEC_SAMPLING_RATE
+#define MIC_RATE CAPTURE_CODEC_SAMPLING_RATE
+#define SPK_PERIOD PLAYBACK_PERIOD_SIZE
+#define MIC_PERIOD CAPTURE_PERIOD_SIZE
+#define UPSAMPLE (SPK_RATE / MIC_RATE)
+/* Half length, in 16 kHz samples, of the interpolator that makes the 48 kHz playback */
+#define INTERP_HALF_TAPS 16
+/* Simulated CLOCK_MONOTONIC does not start at zero: process_aec() treats 0 as invalid */
+#define CLOCK_BASE_SEC 1000.0
+
+struct bench_config {
+    double seconds;
+    double latency_ms;
+    double bulk_ms;
+    double ir_ms;
+    double skew_ppm;
+    double jitter_usec;
+    double noise_db;
+    bool verbose;
+};
+
+static uint32_t rand_state = 1;
+
+/* Uniform in [-1, 1) */
+static double rand_uniform(void) {
+    rand_state = rand_state * 1664525u + 1013904223u;
+    return (double)(int32_t)rand_state / 2147483648.0;
+}
+
+/* Band-limited far end whose level changes every 250 ms, like speech or music would */
+static float* make_far_end(size_t frames) {
+    float* x = calloc(frames, sizeof(float));
+    if (x == NULL) {
+        return NULL;
+    }
+    double state = 0.0;
+    double level = 0.0;
+    for (size_t i = 0; i < frames; i++) {
+        if ((i % (MIC_RATE / 4)) == 0) {
+            level = 0.05 + 0.2 * (rand_uniform() + 1.0);
+        }
+        state = 0.8 * state + 0.2 * rand_uniform();
+        x[i] = (float)(level * state * 3.0);
+    }
+    return x;
+}
+
+/* Room impulse response: bulk delay, then exponentially decaying noise */
+static float* make_room(const struct bench_config* config, size_t* length) {
+    size_t bulk = (size_t)(config->bulk_ms * MIC_RATE / 1000);
+    size_t decay = (size_t)(config->ir_ms * MIC_RATE / 1000);
+    *length = bulk + decay + 1;
+    float* h = calloc(*length, sizeof(float));
+    if (h == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i <= decay; i++) {
+        h[bulk + i] = (float)(0.5 * rand_uniform() * exp(-5.0 * i / (decay + 1)));
+    }
+    return h;
+}
+
+static float* convolve(const float* x, size_t frames, const float* h, size_t length) {
+    float* y = calloc(frames, sizeof(float));
+    if (y == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        double acc = 0.0;
+        size_t taps = (i + 1 < length) ? i + 1 : length;
+        for (size_t k = 0; k < taps; k++) {
+            acc += h[k] * x[i - k];
+        }
+        y[i] = (float)acc;
+    }
+    return y;
+}
+
+/* Windowed-sinc value of the 16 kHz signal at fractional index 'pos' */
+static double interpolate(const float* x, size_t frames, double pos) {
+    long center = (long)floor(pos);
+    double acc = 0.0;
+    for (long k = center - INTERP_HALF_TAPS + 1; k <= center + INTERP_HALF_TAPS; k++) {
+        if ((k < 0) || ((size_t)k >= frames)) {
+            continue;
+        }
+        double d = pos - k;
+        double sinc = (fabs(d) < 1e-9) ? 1.0 : sin(M_PI * d) / (M_PI * d);
+        double window = 0.5 + 0.5 * cos(M_PI * d / INTERP_HALF_TAPS);
+        acc += x[k] * sinc * window;
+    }
+    return acc;
+}
+
+static int16_t to_s16(double v) {
+    v *= 32768.0;
+    return (int16_t)(v > 32767.0 ? 32767.0 : (v < -32768.0 ? -32768.0 : v));
+}
+
+static int32_t to_s32(double v) {
+    v *= 2147483648.0;
+    return (int32_t)(v > 2147483647.0 ? 2147483647.0 : (v < -2147483648.0 ? -2147483648.0 : v));
+}
+
+static struct timespec to_timespec(const struct bench_config* config, double seconds) {
+    seconds += CLOCK_BASE_SEC + config->jitter_usec * 1e-6 * rand_uniform();
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    return ts;
+}
+
+static audio_channel_mask_t bench_out_get_channels(const struct audio_stream* stream) {
+    return AUDIO_CHANNEL_OUT_STEREO;
+}
+
+static audio_format_t bench_out_get_format(const struct audio_stream* stream) {
+    return AUDIO_FORMAT_PCM_16_BIT;
+}
+
+static double erle_db(const struct aec_stats* stats) {
+    if ((stats->mic_energy <= 0.0) || (stats->out_energy <= 0.0)) {
+        return 0.0;
+    }
+    return 10.0 * log10(stats->mic_energy / stats->out_energy);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-d seconds] [-l latency_ms] [-b bulk_ms] [-r ir_ms] [-s skew_ppm]\n"
+            "          [-j jitter_usec] [-n noise_db] [-v]\n", name);
+}
+
+static int run(const struct bench_config* config) {
+    int ret = -ENOMEM;
+    struct aec_t* aec = NULL;
+    float* far = NULL;
+    float* room = NULL;
+    float* echo = NULL;
+    const size_t frames = (size_t)((config->seconds + 1.0) * MIC_RATE);
+
+    far = make_far_end(frames);
+    size_t room_length = 0;
+    room = make_room(config, &room_length);
+    if ((far == NULL) || (room == NULL)) {
+        goto exit;
+    }
+    echo = convolve(far, frames, room, room_length);
+    if (echo == NULL) {
+        goto exit;
+    }
+
+    if (init_aec(MIC_RATE, NUM_AEC_REFERENCE_CHANNELS, CHANNEL_STEREO, &aec)) {
+        fprintf(stderr, "init_aec failed\n");
+        ret = -EINVAL;
+        goto exit;
+    }
+    struct alsa_stream_out out;
+    memset(&out, 0, sizeof(out));
+    out.stream.common.get_channels = bench_out_get_channels;
+    out.stream.common.get_format = bench_out_get_format;
+    out.config.channels = CHANNEL_STEREO;
+    out.config.rate = SPK_RATE;
+    out.config.period_size = SPK_PERIOD;
+    out.config.period_count = PLAYBACK_PERIOD_COUNT;
+    out.config.format = PCM_FORMAT_S16_LE;
+    struct alsa_stream_in in;
+    memset(&in, 0, sizeof(in));
+    in.config.channels = CHANNEL_STEREO;
+    in.config.rate = MIC_RATE;
+    in.config.period_size = MIC_PERIOD;
+    in.config.period_count = CAPTURE_PERIOD_COUNT;
+    in.config.format = PCM_FORMAT_S32_LE;
+    if (init_aec_reference_config(aec, &out) || init_aec_mic_config(aec, &in)) {
+        fprintf(stderr, "AEC stream config failed\n");
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    const double latency = config->latency_ms / 1000.0;
+    const double noise = pow(10.0, config->noise_db / 20.0);
+    const double mic_rate = MIC_RATE * (1.0 + config->skew_ppm * 1e-6);
+    const double spk_period_sec = (double)SPK_PERIOD / SPK_RATE;
+    const double mic_period_sec = MIC_PERIOD / mic_rate;
+    int16_t spk_buf[SPK_PERIOD * CHANNEL_STEREO];
+    int32_t mic_buf[MIC_PERIOD * CHANNEL_STEREO];
+    uint64_t spk_index = 0;
+    uint64_t mic_index = 0;
+    uint64_t process_errors = 0;
+    struct aec_stats last = aec->stats;
+    double next_report = 1.0;
+
+    printf("%6s %8s %10s %10s %10s %8s %8s\n", "time", "ERLE_dB", "cpu_us/per", "max_cpu_us",
+           "diff_us", "flushes", "timeouts");
+    while (true) {
+        double spk_time = spk_index * spk_period_sec;
+        double mic_time = (mic_index + 1) * mic_period_sec; /* in_read() returns at period end */
+        if ((spk_time > config->seconds) && (mic_time > config->seconds)) {
+            break;
+        }
+        if (spk_time <= mic_time) {
+            /* out_write(): 'latency' worth of audio is queued ahead of this chunk */
+            for (size_t i = 0; i < SPK_PERIOD; i++) {
+                double pos = (double)(spk_index * SPK_PERIOD + i) / UPSAMPLE;
+                int16_t s = to_s16(interpolate(far, frames, pos));
+                spk_buf[2 * i] = s;
+                spk_buf[2 * i + 1] = s;
+            }
+            struct aec_info info;
+            memset(&info, 0, sizeof(info));
+            info.timestamp = to_timespec(config, spk_time + latency);
+            info.bytes = sizeof(spk_buf);
+            write_to_reference_fifo(aec, spk_buf, &info);
+            if (spk_index == 0) {
+                aec_set_spk_running(aec, true);
+            }
+            spk_index++;
+            continue;
+        }
+
+        /* in_read(): what the mic heard over the last period, timestamped at its start */
+        double start = mic_index * mic_period_sec;
+        for (size_t i = 0; i < MIC_PERIOD; i++) {
+            double t = start + i / mic_rate;
+            double played = (t - latency) * MIC_RATE;
+            double e = 0.0;
+            if (played >= 0.0) {
+                size_t k = (size_t)played;
+                double frac = played - k;
+                e = (k + 1 < frames) ? echo[k] * (1.0 - frac) + echo[k + 1] * frac : 0.0;
+            }
+            mic_buf[2 * i] = to_s32(e + noise * rand_uniform());
+            mic_buf[2 * i + 1] = to_s32(0.7 * e + noise * rand_uniform());
+        }
+        struct aec_info info;
+        memset(&info, 0, sizeof(info));
+        info.timestamp = to_timespec(config, start);
+        info.bytes = sizeof(mic_buf);
+        if (process_aec(aec, mic_buf, &info)) {
+            process_errors++;
+        }
+        mic_index++;
+
+        if (mic_time >= next_report) {
+            const struct aec_stats* stats = &aec->stats;
+            uint64_t processed = stats->processed_periods - last.processed_periods;
+            printf("%6.1f %8.1f %10.1f %10.1f %10" PRId64 " %8" PRIu64 " %8" PRIu64 "\n",
+                   mic_time, erle_db(stats),
+                   processed ? (stats->cpu_time_nsec - last.cpu_time_nsec) / 1e3 / processed
+                             : 0.0,
+                   stats->max_cpu_time_nsec / 1e3, stats->last_time_diff_usec,
+                   stats->fifo_flushes, stats->reference_timeouts);
+            last = *stats;
+            next_report += 1.0;
+        }
+    }
+
+    const struct aec_stats* stats = &aec->stats;
+    printf("\nperiods %" PRIu64 ", processed %" PRIu64 ", errors %" PRIu64 "\n",
+           stats->periods, stats->processed_periods, process_errors);
+    printf("ERLE %.1f dB, cpu %.1f us/period (max %.1f us, %.2f%% of real time)\n",
+           erle_db(stats),
+           stats->processed_periods ? stats->cpu_time_nsec / 1e3 / stats->processed_periods : 0.0,
+           stats->max_cpu_time_nsec / 1e3,
+           stats->processed_periods
+                   ? 100.0 * stats->cpu_time_nsec / 1e9 /
+                             (stats->processed_periods * (double)MIC_PERIOD / MIC_RATE)
+                   : 0.0);
+    printf("fifo flushes %" PRIu64 ", timestamp resets %" PRIu64 ", reference timeouts %" PRIu64
+           ", reference overruns %" PRIu64 "\n",
+           stats->fifo_flushes, stats->timestamp_resets, stats->reference_timeouts,
+           stats->reference_overruns);
+    if (config->verbose) {
+        fflush(stdout);
+        aec_dump(aec, STDOUT_FILENO);
+    }
+    ret = 0;
+
+exit:
+    release_aec(aec);
+    free(echo);
+    free(room);
+    free(far);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    struct bench_config config = {
+        .seconds = 20.0,
+        .latency_ms = 1000.0 * PLAYBACK_PERIOD_COUNT * PLAYBACK_PERIOD_SIZE / SPK_RATE,
+        .bulk_ms = 2.0,
+        .ir_ms = 30.0,
+        .skew_ppm = 0.0,
+        .jitter_usec = 0.0,
+        .noise_db = -70.0,
+        .verbose = false,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "d:l:b:r:s:j:n:v")) != -1) {
+        switch (opt) {
+            case 'd': config.seconds = atof(optarg); break;
+            case 'l': config.latency_ms = atof(optarg); break;
+            case 'b': config.bulk_ms = atof(optarg); break;
+            case 'r': config.ir_ms = atof(optarg); break;
+            case 's': config.skew_ppm = atof(optarg); break;
+            case 'j': config.jitter_usec = atof(optarg); break;
+            case 'n': config.noise_db = atof(optarg); break;
+            case 'v': config.verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    printf("%.0f s, latency %.1f ms, room %.1f + %.1f ms, skew %.0f ppm, jitter %.0f us, "
+           "noise %.0f dBFS\n", config.seconds, config.latency_ms, config.bulk_ms, config.ir_ms,
+           config.skew_ppm, config.jitter_usec, config.noise_db);
+    return run(&config) ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "audio_aec_process.h"
+}
+
+namespace {
+
+constexpr int kRate = 16000;
+constexpr size_t kPeriod = 512;
+constexpr uint64_t kPeriodUsec = kPeriod * 1000000ull / kRate;
+
+/* Deterministic pseudo random numbers in [-0.5, 0.5) */
+class Noise {
+  public:
+    explicit Noise(uint32_t seed) : state_(seed) {}
+    float next() {
+        state_ = state_ * 1103515245u + 12345u;
+        return ((state_ >> 8) & 0xffffff) / 16777216.0f - 0.5f;
+    }
+
+  private:
+    uint32_t state_;
+};
+
+/*
+ * Far-end signal played through a synthetic room: speech-like coloured noise whose level
+ * jumps every quarter second, convolved with an exponentially decaying impulse response.
+ * Near-end noise is added at 'noise_level'; 'drive' scales the far-end, and the mic clips
+ * like a real one would when it is too high.
+ */
+class EchoPath {
+  public:
+    EchoPath(uint32_t seed, size_t length, float noise_level, float drive = 0.03f)
+        : noise_(seed), ir_(length), history_(length), noise_level_(noise_level), drive_(drive) {
+        set_impulse_response(seed);
+    }
+
+    void set_impulse_response(uint32_t seed) {
+        Noise gen(seed);
+        for (size_t i = 0; i < ir_.size(); i++) {
+            ir_[i] = (i < 80) ? 0.0f : 0.8f * expf(-(float)(i - 80) / 300.0f) * gen.next();
+        }
+    }
+
+    /* Fill 'frames' frames of far-end and mic audio, interleaved S32. */
+    void generate(int32_t* spk, uint32_t spk_channels, int32_t* mic, uint32_t mic_channels,
+                  size_t frames) {
+        for (size_t n = 0; n < frames; n++) {
+            if ((sample_++ % (kRate / 4)) == 0) {
+                level_ = 0.05f + noise_.next() + 0.5f;
+            }
+            colour_ = 0.8f * colour_ + noise_.next();
+            float x = drive_ * level_ * colour_;
+            history_[pos_] = x;
+            float y = 0.0f;
+            for (size_t i = 0; i < ir_.size(); i++) {
+                y += ir_[i] * history_[(pos_ + history_.size() - i) % history_.size()];
+            }
+            pos_ = (pos_ + 1) % history_.size();
+            for (uint32_t ch = 0; ch < spk_channels; ch++) {
+                spk[n * spk_channels + ch] = to_s32(x);
+            }
+            for (uint32_t ch = 0; ch < mic_channels; ch++) {
+                mic[n * mic_channels + ch] =
+                        to_s32((ch ? 0.7f : 1.0f) * y + noise_level_ * noise_.next());
+            }
+        }
+    }
+
+  private:
+    static int32_t to_s32(float v) {
+        if (v > 0.99f) v = 0.99f;
+        if (v < -0.99f) v = -0.99f;
+        return (int32_t)(v * 2147483648.0f);
+    }
+
+    Noise noise_;
+    std::vector<float> ir_;
+    std::vector<float> history_;
+    size_t pos_ = 0;
+    uint64_t sample_ = 0;
+    float level_ = 0.5f;
+    float colour_ = 0.0f;
+    float noise_level_;
+    float drive_;
+};
+
+class AecProcessTest : public ::testing::Test {
+  protected:
+    void SetUp() override { ASSERT_EQ(0, aec_spk_mic_init(kRate, kSpkChannels, kMicChannels)); }
+    void TearDown() override { aec_spk_mic_release(); }
+
+    /* Run 'periods' periods and return the ERLE in dB of each window of 'window' periods. */
+    std::vector<double> run(EchoPath& path, int periods, int window) {
+        std::vector<int32_t> spk(kPeriod * kSpkChannels);
+        std::vector<int32_t> mic(kPeriod * kMicChannels);
+        std::vector<int32_t> out(kPeriod * kMicChannels);
+        std::vector<double> erle;
+        double in_energy = 0.0, out_energy = 0.0;
+
+        for (int i = 0; i < periods; i++) {
+            path.generate(spk.data(), kSpkChannels, mic.data(), kMicChannels, kPeriod);
+            EXPECT_NE(0, aec_spk_mic_process(spk.data(), time_, mic.data(), time_ + delay_,
+                                             kPeriod, out.data()));
+            time_ += kPeriodUsec;
+            for (size_t n = 0; n < mic.size(); n++) {
+                in_energy += (double)mic[n] * mic[n];
+                out_energy += (double)out[n] * out[n];
+            }
+            if ((i + 1) % window == 0) {
+                erle.push_back(10.0 * log10(in_energy / (out_energy + 1.0)));
+                in_energy = out_energy = 0.0;
+            }
+        }
+        return erle;
+    }
+
+    static constexpr uint32_t kSpkChannels = 2;
+    static constexpr uint32_t kMicChannels = 2;
+    uint64_t time_ = 1000000;
+    uint64_t delay_ = 5000;
+};
+
+/* ~0.5 s windows */
+constexpr int kWindow = 16;
+
+TEST_F(AecProcessTest, ConvergesAndStaysConverged) {
+    EchoPath path(1, 1200, 1e-5f);
+    std::vector<double> erle = run(path, 60 * kWindow, kWindow);
+
+    /* within 3 s */
+    EXPECT_GT(erle[5], 40.0);
+    for (size_t i = 6; i < erle.size(); i++) {
+        EXPECT_GT(erle[i], 40.0) << "ERLE collapsed in window " << i;
+    }
+}
+
+TEST_F(AecProcessTest, ErleLimitedByNearEndNoise) {
+    EchoPath path(2, 1200, 1e-3f);
+    std::vector<double> erle = run(path, 30 * kWindow, kWindow);
+
+    for (size_t i = 6; i < erle.size(); i++) {
+        EXPECT_GT(erle[i], 15.0) << "window " << i;
+    }
+}
+
+TEST_F(AecProcessTest, ClippedMicDoesNotDiverge) {
+    EchoPath path(6, 1200, 1e-5f, 0.3f);
+    std::vector<double> erle = run(path, 30 * kWindow, kWindow);
+
+    for (size_t i = 6; i < erle.size(); i++) {
+        EXPECT_GT(erle[i], 25.0) << "window " << i;
+    }
+}
+
+TEST_F(AecProcessTest, ReconvergesAfterEchoPathChange) {
+    EchoPath path(3, 1200, 1e-5f);
+    std::vector<double> erle = run(path, 10 * kWindow, kWindow);
+    EXPECT_GT(erle.back(), 40.0);
+
+    path.set_impulse_response(4);
+    erle = run(path, 10 * kWindow, kWindow);
+    EXPECT_GT(erle.back(), 40.0);
+}
+
+TEST_F(AecProcessTest, ResetsOnDelayJump) {
+    EchoPath path(5, 1200, 1e-5f);
+    std::vector<double> erle = run(path, 10 * kWindow, kWindow);
+    EXPECT_GT(erle.back(), 40.0);
+
+    /* a jump in the speaker to mic offset clears the filter, which then reconverges */
+    delay_ += 20000;
+    erle = run(path, 10 * kWindow, kWindow);
+    EXPECT_LT(erle.front(), 40.0);
+    EXPECT_GT(erle.back(), 40.0);
+}
+
+TEST_F(AecProcessTest, RejectsPartialBlocks) {
+    std::vector<int32_t> spk(kPeriod * kSpkChannels);
+    std::vector<int32_t> mic(kPeriod * kMicChannels);
+
+    EXPECT_EQ(0, aec_spk_mic_process(spk.data(), 0, mic.data(), 0, AEC_BLOCK_SIZE + 1,
+                                     mic.data()));
+    EXPECT_EQ(0, aec_spk_mic_process(nullptr, 0, mic.data(), 0, kPeriod, mic.data()));
+}
+
+TEST(AecProcessInitTest, RejectsBadConfig) {
+    EXPECT_EQ(-EINVAL, aec_spk_mic_init(0, 1, 1));
+    EXPECT_EQ(-EINVAL, aec_spk_mic_init(kRate, 0, 1));
+    EXPECT_EQ(-EINVAL, aec_spk_mic_init(kRate, 1, 0));
+}
+
+}  // namespace
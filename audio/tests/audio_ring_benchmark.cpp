@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * audio_ring against the fifo_wrapper it replaced (audio_utils_fifo behind a void* and
+ * separately allocated reader/writer), with the AEC reference FIFO's access pattern:
+ * one playback period written, then read back in capture-sized pieces.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <audio_utils/fifo.h>
+#include <vector>
+
+#include "audio_ring.h"
+
+namespace {
+
+/* Reference FIFO geometry: 4 periods of 1024 stereo 16-bit frames */
+constexpr uint32_t kFifoBytes = 4 * 1024 * 2 * sizeof(int16_t);
+
+/* The removed fifo_wrapper.cpp, kept out of line as it was */
+struct audio_fifo_itfe {
+    audio_utils_fifo* p_fifo;
+    audio_utils_fifo_reader* p_fifo_reader;
+    audio_utils_fifo_writer* p_fifo_writer;
+    int8_t* p_buffer;
+};
+
+__attribute__((noinline)) void* fifo_init(uint32_t bytes, bool reader_throttles_writer) {
+    struct audio_fifo_itfe* interface = new struct audio_fifo_itfe;
+    interface->p_buffer = new int8_t[bytes];
+    interface->p_fifo =
+            new audio_utils_fifo(bytes, 1, interface->p_buffer, reader_throttles_writer);
+    interface->p_fifo_writer = new audio_utils_fifo_writer(*interface->p_fifo);
+    interface->p_fifo_reader = new audio_utils_fifo_reader(*interface->p_fifo);
+    return interface;
+}
+
+__attribute__((noinline)) void fifo_release(void* fifo_itfe) {
+    struct audio_fifo_itfe* interface = static_cast<struct audio_fifo_itfe*>(fifo_itfe);
+    delete interface->p_fifo_writer;
+    delete interface->p_fifo_reader;
+    delete interface->p_fifo;
+    delete[] interface->p_buffer;
+    delete interface;
+}
+
+__attribute__((noinline)) ssize_t fifo_read(void* fifo_itfe, void* buffer, size_t bytes) {
+    return static_cast<struct audio_fifo_itfe*>(fifo_itfe)->p_fifo_reader->read(buffer, bytes);
+}
+
+__attribute__((noinline)) ssize_t fifo_write(void* fifo_itfe, void* buffer, size_t bytes) {
+    return static_cast<struct audio_fifo_itfe*>(fifo_itfe)->p_fifo_writer->write(buffer, bytes);
+}
+
+__attribute__((noinline)) ssize_t fifo_available_to_read(void* fifo_itfe) {
+    return static_cast<struct audio_fifo_itfe*>(fifo_itfe)->p_fifo_reader->available();
+}
+
+void BM_FifoWrapper_InitRelease(benchmark::State& state) {
+    for (auto _ : state) {
+        void* fifo = fifo_init(kFifoBytes, false);
+        benchmark::DoNotOptimize(fifo);
+        fifo_release(fifo);
+    }
+}
+BENCHMARK(BM_FifoWrapper_InitRelease);
+
+void BM_AudioRing_InitRelease(benchmark::State& state) {
+    for (auto _ : state) {
+        struct audio_ring* ring = audio_ring_init(kFifoBytes, false);
+        benchmark::DoNotOptimize(ring);
+        audio_ring_release(ring);
+    }
+}
+BENCHMARK(BM_AudioRing_InitRelease);
+
+/* Write 'period' bytes, then read them back in 'period / 3' pieces (48 kHz to 16 kHz) */
+void BM_FifoWrapper_WriteRead(benchmark::State& state) {
+    const size_t period = state.range(0);
+    std::vector<uint8_t> in(period), out(period);
+    void* fifo = fifo_init(kFifoBytes, false);
+    for (auto _ : state) {
+        fifo_write(fifo, in.data(), period);
+        while (fifo_available_to_read(fifo) > 0) {
+            fifo_read(fifo, out.data(), period / 3);
+        }
+        benchmark::ClobberMemory();
+    }
+    fifo_release(fifo);
+    state.SetBytesProcessed(state.iterations() * period);
+}
+BENCHMARK(BM_FifoWrapper_WriteRead)->Arg(256)->Arg(4096)->Arg(16384);
+
+void BM_AudioRing_WriteRead(benchmark::State& state) {
+    const size_t period = state.range(0);
+    std::vector<uint8_t> in(period), out(period);
+    struct audio_ring* ring = audio_ring_init(kFifoBytes, false);
+    for (auto _ : state) {
+        audio_ring_write(ring, in.data(), period);
+        while (audio_ring_available_to_read(ring) > 0) {
+            audio_ring_read(ring, out.data(), period / 3);
+        }
+        benchmark::ClobberMemory();
+    }
+    audio_ring_release(ring);
+    state.SetBytesProcessed(state.iterations() * period);
+}
+BENCHMARK(BM_AudioRing_WriteRead)->Arg(256)->Arg(4096)->Arg(16384);
+
+/* The reads get_reference_samples() does: consume in place through spans, no copy out */
+void BM_AudioRing_WriteObtainRelease(benchmark::State& state) {
+    const size_t period = state.range(0);
+    std::vector<uint8_t> in(period);
+    struct audio_ring* ring = audio_ring_init(kFifoBytes, false);
+    struct audio_ring_span span[2];
+    for (auto _ : state) {
+        audio_ring_write(ring, in.data(), period);
+        ssize_t bytes;
+        while ((bytes = audio_ring_read_obtain(ring, span, period / 3)) > 0) {
+            benchmark::DoNotOptimize(span[0].data[0]);
+            audio_ring_read_release(ring, bytes);
+        }
+    }
+    audio_ring_release(ring);
+    state.SetBytesProcessed(state.iterations() * period);
+}
+BENCHMARK(BM_AudioRing_WriteObtainRelease)->Arg(256)->Arg(4096)->Arg(16384);
+
+/* Polled up to 80 times per capture period while waiting for the reference */
+void BM_FifoWrapper_AvailableToRead(benchmark::State& state) {
+    void* fifo = fifo_init(kFifoBytes, false);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fifo_available_to_read(fifo));
+    }
+    fifo_release(fifo);
+}
+BENCHMARK(BM_FifoWrapper_AvailableToRead);
+
+void BM_AudioRing_AvailableToRead(benchmark::State& state) {
+    struct audio_ring* ring = audio_ring_init(kFifoBytes, false);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(audio_ring_available_to_read(ring));
+    }
+    audio_ring_release(ring);
+}
+BENCHMARK(BM_AudioRing_AvailableToRead);
+
+}  // namespace
+
+BENCHMARK_MAIN();
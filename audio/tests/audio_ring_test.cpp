@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <numeric>
+#include <vector>
+
+#include "audio_ring.h"
+
+namespace {
+
+class AudioRingTest : public ::testing::Test {
+  protected:
+    void TearDown() override { audio_ring_release(ring_); }
+
+    void init(uint32_t bytes, bool reader_throttles_writer) {
+        ring_ = audio_ring_init(bytes, reader_throttles_writer);
+        ASSERT_NE(ring_, nullptr);
+    }
+
+    std::vector<uint8_t> pattern(size_t bytes, uint8_t first) {
+        std::vector<uint8_t> data(bytes);
+        std::iota(data.begin(), data.end(), first);
+        return data;
+    }
+
+    struct audio_ring* ring_ = nullptr;
+};
+
+TEST_F(AudioRingTest, RoundsCapacityUp) {
+    init(1000, true);
+    EXPECT_EQ(ring_->capacity, 1024u);
+    EXPECT_EQ(audio_ring_available_to_write(ring_), 1024);
+}
+
+TEST_F(AudioRingTest, RejectsBadSizes) {
+    EXPECT_EQ(audio_ring_init(0, true), nullptr);
+    EXPECT_EQ(audio_ring_init(AUDIO_RING_MAX_CAPACITY + 1, true), nullptr);
+}
+
+TEST_F(AudioRingTest, WrapsAround) {
+    init(64, true);
+    std::vector<uint8_t> out(48);
+    for (uint8_t round = 0; round < 10; round++) {
+        std::vector<uint8_t> in = pattern(48, round * 48);
+        ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 48);
+        ASSERT_EQ(audio_ring_available_to_read(ring_), 48);
+        ASSERT_EQ(audio_ring_read(ring_, out.data(), out.size()), 48);
+        EXPECT_EQ(in, out);
+    }
+}
+
+TEST_F(AudioRingTest, SpansSplitAtWrapPoint) {
+    init(64, true);
+    std::vector<uint8_t> in = pattern(40, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 40);
+    std::vector<uint8_t> out(40);
+    ASSERT_EQ(audio_ring_read(ring_, out.data(), out.size()), 40);
+
+    struct audio_ring_span span[2];
+    ASSERT_EQ(audio_ring_write_obtain(ring_, span, 40), 40);
+    EXPECT_EQ(span[0].bytes, 24u);
+    EXPECT_EQ(span[1].bytes, 16u);
+    EXPECT_EQ(span[1].data, ring_->data);
+    memset(span[0].data, 0xaa, span[0].bytes);
+    memset(span[1].data, 0xbb, span[1].bytes);
+    audio_ring_write_release(ring_, 40);
+
+    ASSERT_EQ(audio_ring_read_obtain(ring_, span, 64), 40);
+    EXPECT_EQ(span[0].data[0], 0xaa);
+    EXPECT_EQ(span[1].data[0], 0xbb);
+    EXPECT_EQ(audio_ring_read_release(ring_, 40), 40);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 0);
+}
+
+TEST_F(AudioRingTest, ThrottledWriterStopsWhenFull) {
+    init(64, true);
+    std::vector<uint8_t> in = pattern(100, 0);
+    EXPECT_EQ(audio_ring_write(ring_, in.data(), in.size()), 64);
+    EXPECT_EQ(audio_ring_write(ring_, in.data(), in.size()), 0);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 64);
+}
+
+TEST_F(AudioRingTest, OverrunReportedBeforeRead) {
+    init(64, false);
+    std::vector<uint8_t> in = pattern(48, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 48);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 48);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), -EOVERFLOW);
+    /* Once, then the reader resumes from the newest data */
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), 16), 16);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 16);
+}
+
+TEST_F(AudioRingTest, OverrunReportedAtReleaseWhenSpanOverwritten) {
+    init(64, false);
+    std::vector<uint8_t> in = pattern(48, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 48);
+
+    struct audio_ring_span span[2];
+    ASSERT_EQ(audio_ring_read_obtain(ring_, span, 48), 48);
+    /* The writer laps the reader while it still holds the span */
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 48);
+    EXPECT_EQ(audio_ring_read_release(ring_, 48), -EOVERFLOW);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 0);
+}
+
+TEST_F(AudioRingTest, WriteIntoFreeSpaceDuringReadIsNotAnOverrun) {
+    init(64, false);
+    std::vector<uint8_t> in = pattern(32, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 32);
+
+    struct audio_ring_span span[2];
+    ASSERT_EQ(audio_ring_read_obtain(ring_, span, 32), 32);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 32);
+    EXPECT_EQ(audio_ring_read_release(ring_, 32), 32);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 32);
+}
+
+TEST_F(AudioRingTest, ReadsFullRing) {
+    init(64, false);
+    std::vector<uint8_t> in = pattern(64, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 64);
+    std::vector<uint8_t> out(64);
+    EXPECT_EQ(audio_ring_read(ring_, out.data(), out.size()), 64);
+    EXPECT_EQ(in, out);
+}
+
+TEST_F(AudioRingTest, FlushDropsUnreadData) {
+    init(64, true);
+    std::vector<uint8_t> in = pattern(32, 0);
+    ASSERT_EQ(audio_ring_write(ring_, in.data(), in.size()), 32);
+    audio_ring_flush(ring_);
+    EXPECT_EQ(audio_ring_available_to_read(ring_), 0);
+    EXPECT_EQ(audio_ring_available_to_write(ring_), 64);
+}
+
+}  // namespace
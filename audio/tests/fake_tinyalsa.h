@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for the tinyalsa and audio_route calls made by audio_hw.c.
+ *
+ * PCMs run on CLOCK_MONOTONIC at their configured rate: pcm_write() and pcm_read()
+ * block like the kernel would, pcm_get_htimestamp() reports the simulated hardware
+ * position, and a writer that falls behind or a reader that falls behind gets an xrun
+ * (-EPIPE with PCM_NORESTART, silent recovery without). Playback is looped back into
+ * every capture channel after a delay, like a speaker heard by the device's mics.
+ */
+
+#ifndef FAKE_TINYALSA_H
+#define FAKE_TINYALSA_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fake_tinyalsa_loopback {
+    uint32_t delay_usec;        /* speaker to mic */
+    float gain;                 /* speaker to mic */
+    float noise;                /* mic self-noise, fraction of full scale */
+    unsigned int mic_channels;  /* reported by pcm_params_get_max() */
+};
+
+struct fake_tinyalsa_stats {
+    uint64_t frames_written;
+    uint64_t frames_read;
+    uint64_t underruns;
+    uint64_t overruns;
+    /* Thread CPU time spent inside the fake, to be taken out of the caller's */
+    uint64_t playback_cpu_nsec;
+    uint64_t capture_cpu_nsec;
+};
+
+/* Takes effect for PCMs opened afterwards. */
+void fake_tinyalsa_set_loopback(const struct fake_tinyalsa_loopback* loopback);
+
+void fake_tinyalsa_get_stats(struct fake_tinyalsa_stats* stats);
+
+/* CLOCK_MONOTONIC time of the pcm_write() call that carried the playback heard in the
+ * last frame of the last pcm_read(), or 0 if that frame heard no playback. */
+uint64_t fake_tinyalsa_capture_origin_nsec(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef FAKE_TINYALSA_H */
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the whole HAL (adev_open, out_write, in_read with the in-HAL AEC) on the host,
+ * against fake_tinyalsa.c, which plays the speaker back into the mics on real time.
+ * A writer thread plays band-limited noise, a reader thread captures voice
+ * communication, the way AudioFlinger's playback and record threads would.
+ *
+ * Reports the end-to-end latency (pcm_write() of a sample to in_read() returning the
+ * period that heard it), HAL CPU time per period with the fake's own time taken out,
+ * ERLE, and whether injected underruns (writer stalls) and overruns (reader stalls) are
+ * seen and recovered from. -D starts with the screen off (deep buffer playback), -s
+ * turns the screen off and on every so many seconds, to check that out_write() switches
+ * buffer size without underruns.
+ *
+ * usage: audio_hal_loopback_bench [-d seconds] [-D] [-s toggle_seconds] [-c]
+ *                                 [-l delay_usec] [-g gain] [-u underruns] [-o overruns] [-v]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#include "audio_aec.h"
+#include "audio_hw.h"
+#include "fake_tinyalsa.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+/* How much longer than the PCM buffer an injected stall lasts */
+#define STALL_MARGIN_NSEC 50000000ULL
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+struct bench_config {
+    double seconds;
+    bool screen_off;
+    double toggle_seconds;  /* 0: the screen state is left alone */
+    bool convert;           /* capture 48 kHz mono 16-bit, which in_read() converts */
+    struct fake_tinyalsa_loopback loopback;
+    unsigned int underruns;
+    unsigned int overruns;
+    bool verbose;
+};
+
+/* One side of the loopback, owned by its thread until joined */
+struct bench_stream {
+    uint64_t end_nsec;
+    uint64_t stall_nsec;
+    uint64_t stall_interval_nsec;   /* 0: no stalls */
+    unsigned int stalls;
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t cpu_nsec;
+    uint64_t max_cpu_nsec;
+    /* Capture only */
+    uint64_t* latency_nsec;
+    size_t latency_count;
+    size_t latency_capacity;
+};
+
+static uint64_t clock_nsec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_nsec(uint64_t nsec) {
+    struct timespec ts = {.tv_sec = nsec / NSEC_PER_SEC, .tv_nsec = nsec % NSEC_PER_SEC};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+/* HAL time of one call: thread CPU time minus what the fake spent */
+static void account_cpu(struct bench_stream* stream, uint64_t cpu_nsec, uint64_t fake_nsec) {
+    uint64_t hal_nsec = (cpu_nsec > fake_nsec) ? cpu_nsec - fake_nsec : 0;
+    stream->cpu_nsec += hal_nsec;
+    if (hal_nsec > stream->max_cpu_nsec) {
+        stream->max_cpu_nsec = hal_nsec;
+    }
+    stream->calls++;
+}
+
+/* Stall once per interval, starting half an interval in */
+static void maybe_stall(struct bench_stream* stream, uint64_t start_nsec, uint64_t now) {
+    if (stream->stall_interval_nsec == 0) {
+        return;
+    }
+    uint64_t next_nsec = start_nsec + stream->stall_interval_nsec / 2 +
+                         stream->stalls * stream->stall_interval_nsec;
+    if (now >= next_nsec) {
+        stream->stalls++;
+        sleep_nsec(stream->stall_nsec);
+    }
+}
+
+struct writer_args {
+    struct audio_stream_out* out;
+    struct bench_stream* stream;
+};
+
+struct reader_args {
+    struct audio_stream_in* in;
+    struct bench_stream* stream;
+};
+
+static void* writer_thread(void* arg) {
+    struct writer_args* args = (struct writer_args*)arg;
+    struct audio_stream_out* out = args->out;
+    struct bench_stream* stream = args->stream;
+    const size_t bytes = out->common.get_buffer_size(&out->common);
+    const size_t frames = bytes / (2 * sizeof(int16_t));
+    int16_t* buffer = (int16_t*)malloc(bytes);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    /* Band-limited far end whose level changes every 250 ms */
+    uint32_t rand_state = 1;
+    float state = 0.0f;
+    float level = 0.0f;
+    uint64_t frame = 0;
+    const uint64_t start_nsec = clock_nsec(CLOCK_MONOTONIC);
+    uint64_t now = start_nsec;
+    while (now < stream->end_nsec) {
+        for (size_t i = 0; i < frames; i++, frame++) {
+            if ((frame % (PLAYBACK_CODEC_SAMPLING_RATE / 4)) == 0) {
+                rand_state = rand_state * 1664525u + 1013904223u;
+                level = 0.05f + 0.25f * (rand_state >> 8) / 16777216.0f;
+            }
+            rand_state = rand_state * 1664525u + 1013904223u;
+            state = 0.9f * state + 0.1f * ((int32_t)rand_state / 2147483648.0f);
+            int16_t s = (int16_t)(32767.0f * level * 3.0f * state);
+            buffer[2 * i] = s;
+            buffer[2 * i + 1] = s;
+        }
+        struct fake_tinyalsa_stats before;
+        fake_tinyalsa_get_stats(&before);
+        uint64_t cpu_start_nsec = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+        if (out->write(out, buffer, bytes) < 0) {
+            stream->failures++;
+        }
+        uint64_t cpu_nsec = clock_nsec(CLOCK_THREAD_CPUTIME_ID) - cpu_start_nsec;
+        struct fake_tinyalsa_stats after;
+        fake_tinyalsa_get_stats(&after);
+        account_cpu(stream, cpu_nsec, after.playback_cpu_nsec - before.playback_cpu_nsec);
+        now = clock_nsec(CLOCK_MONOTONIC);
+        maybe_stall(stream, start_nsec, now);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void* reader_thread(void* arg) {
+    struct reader_args* args = (struct reader_args*)arg;
+    struct audio_stream_in* in = args->in;
+    struct bench_stream* stream = args->stream;
+    const size_t bytes = in->common.get_buffer_size(&in->common);
+    void* buffer = malloc(bytes);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    const uint64_t start_nsec = clock_nsec(CLOCK_MONOTONIC);
+    uint64_t now = start_nsec;
+    while (now < stream->end_nsec) {
+        struct fake_tinyalsa_stats before;
+        fake_tinyalsa_get_stats(&before);
+        uint64_t cpu_start_nsec = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+        ssize_t ret = in->read(in, buffer, bytes);
+        uint64_t cpu_nsec = clock_nsec(CLOCK_THREAD_CPUTIME_ID) - cpu_start_nsec;
+        now = clock_nsec(CLOCK_MONOTONIC);
+        struct fake_tinyalsa_stats after;
+        fake_tinyalsa_get_stats(&after);
+        account_cpu(stream, cpu_nsec, after.capture_cpu_nsec - before.capture_cpu_nsec);
+        if (ret < 0) {
+            stream->failures++;
+        }
+        uint64_t origin_nsec = fake_tinyalsa_capture_origin_nsec();
+        if ((ret >= 0) && (origin_nsec != 0) && (origin_nsec < now) &&
+            (stream->latency_count < stream->latency_capacity)) {
+            stream->latency_nsec[stream->latency_count++] = now - origin_nsec;
+        }
+        maybe_stall(stream, start_nsec, now);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(struct bench_stream* stream) {
+    if (stream->latency_count == 0) {
+        printf("latency: no capture heard the playback\n");
+        return;
+    }
+    qsort(stream->latency_nsec, stream->latency_count, sizeof(uint64_t), compare_u64);
+    double sum = 0.0;
+    for (size_t i = 0; i < stream->latency_count; i++) {
+        sum += stream->latency_nsec[i];
+    }
+    const uint64_t* sorted = stream->latency_nsec;
+    const size_t n = stream->latency_count;
+    printf("latency ms: min %.1f, avg %.1f, p50 %.1f, p99 %.1f, max %.1f (%zu reads)\n",
+           sorted[0] / 1e6, sum / n / 1e6, sorted[n / 2] / 1e6, sorted[n * 99 / 100] / 1e6,
+           sorted[n - 1] / 1e6, n);
+}
+
+static void report_cpu(const char* name, const struct bench_stream* stream, double period_usec) {
+    double avg_usec = stream->calls ? stream->cpu_nsec / 1e3 / stream->calls : 0.0;
+    printf("%s: %" PRIu64 " calls, %" PRIu64 " failed, cpu %.1f us/period (max %.1f us, "
+           "%.2f%% of real time)\n", name, stream->calls, stream->failures, avg_usec,
+           stream->max_cpu_nsec / 1e3, 100.0 * avg_usec / period_usec);
+}
+
+static double erle_db(const struct aec_stats* stats) {
+    if ((stats->mic_energy <= 0.0) || (stats->out_energy <= 0.0)) {
+        return 0.0;
+    }
+    return 10.0 * log10(stats->mic_energy / stats->out_energy);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-d seconds] [-D] [-s toggle_seconds] [-c] [-l delay_usec] [-g gain]\n"
+            "          [-u underruns] [-o overruns] [-v]\n", name);
+}
+
+static int run(const struct bench_config* config) {
+    int ret = -EINVAL;
+    struct hw_device_t* device = NULL;
+    struct audio_hw_device* adev = NULL;
+    struct audio_stream_out* out = NULL;
+    struct audio_stream_in* in = NULL;
+    struct bench_stream playback;
+    struct bench_stream capture;
+    memset(&playback, 0, sizeof(playback));
+    memset(&capture, 0, sizeof(capture));
+
+    fake_tinyalsa_set_loopback(&config->loopback);
+    struct hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+    if (module->methods->open(module, AUDIO_HARDWARE_INTERFACE, &device)) {
+        fprintf(stderr, "adev_open failed\n");
+        goto exit;
+    }
+    adev = (struct audio_hw_device*)device;
+    bool screen_off = config->screen_off;
+    if (screen_off && adev->set_parameters(adev, SCREEN_STATE_PARAMETER "=off")) {
+        fprintf(stderr, "set_parameters failed\n");
+        goto exit;
+    }
+
+    struct audio_config out_config = {
+        .sample_rate = PLAYBACK_CODEC_SAMPLING_RATE,
+        .channel_mask = AUDIO_CHANNEL_OUT_STEREO,
+        .format = AUDIO_FORMAT_PCM_16_BIT,
+    };
+    if (adev->open_output_stream(adev, 0, AUDIO_DEVICE_OUT_SPEAKER, AUDIO_OUTPUT_FLAG_PRIMARY,
+                                 &out_config, &out, NULL)) {
+        fprintf(stderr, "open_output_stream failed\n");
+        goto exit;
+    }
+    struct audio_config in_config = {
+        .sample_rate = config->convert ? PLAYBACK_CODEC_SAMPLING_RATE
+                                       : CAPTURE_CODEC_SAMPLING_RATE,
+        .channel_mask = config->convert ? AUDIO_CHANNEL_IN_MONO : AUDIO_CHANNEL_IN_STEREO,
+        .format = config->convert ? AUDIO_FORMAT_PCM_16_BIT : AUDIO_FORMAT_PCM_32_BIT,
+    };
+    if (adev->open_input_stream(adev, 1, AUDIO_DEVICE_IN_BUILTIN_MIC, &in_config, &in,
+                                AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_VOICE_COMMUNICATION)) {
+        fprintf(stderr, "open_input_stream failed\n");
+        goto exit;
+    }
+
+    const struct pcm_config* out_pcm = &((struct alsa_stream_out*)out)->config;
+    const struct pcm_config* in_pcm = &((struct alsa_stream_in*)in)->config;
+    const uint64_t end_nsec = clock_nsec(CLOCK_MONOTONIC) + config->seconds * NSEC_PER_SEC;
+    playback.end_nsec = end_nsec;
+    /* Long enough to underrun the deep buffer, which the stream only opens on its first
+     * write, when it may be used */
+    const unsigned int out_buffer_frames = (config->screen_off || config->toggle_seconds > 0)
+            ? DEEP_BUFFER_PERIOD_SIZE * DEEP_BUFFER_PERIOD_COUNT
+            : out_pcm->period_size * out_pcm->period_count;
+    playback.stall_nsec = (uint64_t)out_buffer_frames * NSEC_PER_SEC / out_pcm->rate +
+                          STALL_MARGIN_NSEC;
+    if (config->underruns > 0) {
+        playback.stall_interval_nsec = config->seconds * NSEC_PER_SEC / config->underruns;
+    }
+    capture.end_nsec = end_nsec;
+    capture.stall_nsec = (uint64_t)in_pcm->period_size * in_pcm->period_count * NSEC_PER_SEC /
+                         in_pcm->rate + STALL_MARGIN_NSEC;
+    if (config->overruns > 0) {
+        capture.stall_interval_nsec = config->seconds * NSEC_PER_SEC / config->overruns;
+    }
+    capture.latency_capacity =
+            (size_t)(config->seconds * in_pcm->rate / in_pcm->period_size) + 16;
+    capture.latency_nsec = (uint64_t*)calloc(capture.latency_capacity, sizeof(uint64_t));
+    if (capture.latency_nsec == NULL) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    printf("%.0f s, screen %s (toggled every %.1f s), capture %u Hz %u ch -> %s, "
+           "loopback %u us gain %.2f\n", config->seconds, screen_off ? "off" : "on",
+           config->toggle_seconds, in_pcm->rate, in_pcm->channels,
+           config->convert ? "48 kHz mono 16-bit" : "native", config->loopback.delay_usec,
+           config->loopback.gain);
+
+    struct writer_args writer_args = {.out = out, .stream = &playback};
+    struct reader_args reader_args = {.in = in, .stream = &capture};
+    pthread_t writer;
+    pthread_t reader;
+    if (pthread_create(&writer, NULL, writer_thread, &writer_args)) {
+        goto exit;
+    }
+    if (pthread_create(&reader, NULL, reader_thread, &reader_args)) {
+        pthread_join(writer, NULL);
+        goto exit;
+    }
+    if (config->toggle_seconds > 0) {
+        const uint64_t toggle_nsec = config->toggle_seconds * NSEC_PER_SEC;
+        for (uint64_t now_nsec = clock_nsec(CLOCK_MONOTONIC); now_nsec + toggle_nsec < end_nsec;
+             now_nsec += toggle_nsec) {
+            sleep_nsec(toggle_nsec);
+            screen_off = !screen_off;
+            adev->set_parameters(adev, screen_off ? SCREEN_STATE_PARAMETER "=off"
+                                                  : SCREEN_STATE_PARAMETER "=on");
+        }
+    }
+    pthread_join(writer, NULL);
+    pthread_join(reader, NULL);
+
+    struct fake_tinyalsa_stats pcm_stats;
+    fake_tinyalsa_get_stats(&pcm_stats);
+    const struct alsa_audio_device* ladev = (const struct alsa_audio_device*)adev;
+    const struct aec_stats* aec_stats = &ladev->aec->stats;
+    report_latency(&capture);
+    report_cpu("out_write", &playback, 1e6 * out_pcm->period_size / out_pcm->rate);
+    report_cpu("in_read", &capture, 1e6 * in_pcm->period_size / in_pcm->rate);
+    printf("playback: %s buffer (%u x %u frames) at the end, %" PRIu64 " buffer size switches\n",
+           ((struct alsa_stream_out*)out)->deep_buffer ? "deep" : "normal",
+           out_pcm->period_count, out_pcm->period_size,
+           ((struct alsa_stream_out*)out)->stats.buffer_switches);
+    printf("underruns: %u injected, %" PRIu64 " at the PCM, %" PRIu64 " counted by the HAL\n",
+           playback.stalls, pcm_stats.underruns, ((struct alsa_stream_out*)out)->stats.xruns);
+    printf("overruns: %u injected, %" PRIu64 " at the PCM, %" PRIu64 " counted by the HAL\n",
+           capture.stalls, pcm_stats.overruns, ((struct alsa_stream_in*)in)->stats.xruns);
+    printf("AEC: ERLE %.1f dB, %" PRIu64 " of %" PRIu64 " periods processed, fifo flushes %"
+           PRIu64 ", reference timeouts %" PRIu64 "\n", erle_db(aec_stats),
+           aec_stats->processed_periods, aec_stats->periods, aec_stats->fifo_flushes,
+           aec_stats->reference_timeouts);
+    if (config->verbose) {
+        fflush(stdout);
+        adev->dump(adev, STDOUT_FILENO);
+    }
+    ret = 0;
+
+exit:
+    if (in != NULL) {
+        adev->close_input_stream(adev, in);
+    }
+    if (out != NULL) {
+        adev->close_output_stream(adev, out);
+    }
+    if (device != NULL) {
+        device->close(device);
+    }
+    free(capture.latency_nsec);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    struct bench_config config = {
+        .seconds = 10.0,
+        .screen_off = false,
+        .toggle_seconds = 0.0,
+        .convert = false,
+        .loopback = {.delay_usec = 2000, .gain = 0.25f, .noise = 1e-4f, .mic_channels = 2},
+        .underruns = 0,
+        .overruns = 0,
+        .verbose = false,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "d:Ds:cl:g:u:o:v")) != -1) {
+        switch (opt) {
+            case 'd': config.seconds = atof(optarg); break;
+            case 'D': config.screen_off = true; break;
+            case 's': config.toggle_seconds = atof(optarg); break;
+            case 'c': config.convert = true; break;
+            case 'l': config.loopback.delay_usec = atoi(optarg); break;
+            case 'g': config.loopback.gain = atof(optarg); break;
+            case 'u': config.underruns = atoi(optarg); break;
+            case 'o': config.overruns = atoi(optarg); break;
+            case 'v': config.verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    return run(&config) ? 1 : 0;
+}
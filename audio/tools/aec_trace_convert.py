@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2020 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Convert an AEC trace (see audio_aec_trace.h) to one WAV per stream plus a CSV
+of per-period timestamps.
+
+    adb pull /data/local/traces/aec_trace.bin
+    aec_trace_convert.py aec_trace.bin out_dir
+"""
+
+import argparse
+import csv
+import os
+import struct
+import sys
+import wave
+
+MAGIC = 0x54434541
+VERSION = 1
+
+FILE_HEADER = struct.Struct('<II')
+# type, flags, bytes, sample_rate, channels, bits_per_sample, sequence,
+# stream_time_nsec, aux_time_nsec, write_time_nsec
+RECORD_HEADER = struct.Struct('<IIIIHHIQQQ')
+
+TYPE_NAMES = ['mic_in', 'reference', 'aec_out', 'mic_stream', 'ref_stream']
+FLAG_TRUNCATED = 0x1
+
+
+def read_records(path):
+    with open(path, 'rb') as f:
+        magic, version = FILE_HEADER.unpack(f.read(FILE_HEADER.size))
+        if magic != MAGIC or version != VERSION:
+            sys.exit('%s: not an AEC trace (magic 0x%x, version %d)' % (path, magic, version))
+        while True:
+            raw = f.read(RECORD_HEADER.size)
+            if len(raw) < RECORD_HEADER.size:
+                return
+            header = RECORD_HEADER.unpack(raw)
+            data = f.read(header[2])
+            if len(data) < header[2]:
+                return
+            yield header, data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('trace')
+    parser.add_argument('out_dir')
+    args = parser.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    wavs = {}
+    last_sequence = None
+    with open(os.path.join(args.out_dir, 'aec_trace.csv'), 'w', newline='') as csv_file:
+        writer = csv.writer(csv_file)
+        writer.writerow(['sequence', 'type', 'frames', 'stream_time_nsec', 'aux_time_nsec',
+                         'write_time_nsec', 'truncated', 'gap'])
+        for header, data in read_records(args.trace):
+            (rtype, flags, nbytes, rate, channels, bits, sequence,
+             stream_time, aux_time, write_time) = header
+            name = TYPE_NAMES[rtype] if rtype < len(TYPE_NAMES) else 'type%d' % rtype
+            frame_bytes = channels * bits // 8
+            if name not in wavs:
+                w = wave.open(os.path.join(args.out_dir, name + '.wav'), 'wb')
+                w.setnchannels(channels)
+                w.setsampwidth(bits // 8)
+                w.setframerate(rate)
+                wavs[name] = w
+            wavs[name].writeframes(data)
+            # A sequence gap means records were dropped because the ring was full
+            gap = 0 if last_sequence is None else max(0, sequence - last_sequence - 1)
+            last_sequence = max(sequence, last_sequence or 0)
+            writer.writerow([sequence, name, nbytes // frame_bytes if frame_bytes else 0,
+                             stream_time, aux_time, write_time,
+                             int(bool(flags & FLAG_TRUNCATED)), gap])
+    for w in wavs.values():
+        w.close()
+
+
+if __name__ == '__main__':
+    main()
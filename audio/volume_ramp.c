@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_volume_ramp"
+//#define LOG_NDEBUG 0
+
+#include <assert.h>
+#include <audio_utils/primitives.h>
+#include <log/log.h>
+#include <string.h>
+
+#include "volume_ramp.h"
+
+#ifdef __ARM_NEON
+#include "arm_neon.h"
+#endif /* #ifdef __ARM_NEON */
+
+static float clamp_gain(float gain) {
+    if (!(gain > 0.0f)) {
+        return 0.0f;
+    }
+    return (gain > 1.0f) ? 1.0f : gain;
+}
+
+void volume_ramp_init(volume_ramp_t* ramp, float gain) {
+    gain = clamp_gain(gain);
+    ramp->gain[0] = ramp->gain[1] = gain;
+    ramp->target[0] = ramp->target[1] = gain;
+}
+
+void volume_ramp_set_target(volume_ramp_t* ramp, float left, float right) {
+    ramp->target[0] = clamp_gain(left);
+    ramp->target[1] = clamp_gain(right);
+}
+
+bool volume_ramp_is_unity(const volume_ramp_t* ramp) {
+    return (ramp->gain[0] == 1.0f) && (ramp->gain[1] == 1.0f) && (ramp->target[0] == 1.0f) &&
+           (ramp->target[1] == 1.0f);
+}
+
+void volume_ramp_complete(volume_ramp_t* ramp) {
+    ramp->gain[0] = ramp->target[0];
+    ramp->gain[1] = ramp->target[1];
+}
+
+void volume_ramp_process(volume_ramp_t* ramp, int16_t* buffer, uint32_t frames,
+                         uint32_t channels) {
+    assert(ramp != NULL);
+
+    if (volume_ramp_is_unity(ramp) || (frames == 0)) {
+        return;
+    }
+    if ((ramp->gain[0] == 0.0f) && (ramp->gain[1] == 0.0f) && (ramp->target[0] == 0.0f) &&
+        (ramp->target[1] == 0.0f)) {
+        memset(buffer, 0, (size_t)frames * channels * sizeof(int16_t));
+        return;
+    }
+
+    const float step_l = (ramp->target[0] - ramp->gain[0]) / frames;
+    const float step_r = (ramp->target[1] - ramp->gain[1]) / frames;
+    float gain_l = ramp->gain[0];
+    float gain_r = ramp->gain[1];
+    uint32_t frame = 0;
+
+#ifdef __ARM_NEON
+    if (channels == 2) {
+        /* Two frames per iteration */
+        float32x4_t gain = {gain_l, gain_r, gain_l + step_l, gain_r + step_r};
+        const float32x4_t step = {2.0f * step_l, 2.0f * step_r, 2.0f * step_l, 2.0f * step_r};
+        for (; frame + 2 <= frames; frame += 2) {
+            int16_t* p = &buffer[frame * 2];
+            float32x4_t x = vcvtq_f32_s32(vmovl_s16(vld1_s16(p)));
+            int32x4_t y = vcvtq_s32_f32(vmulq_f32(x, gain));
+            vst1_s16(p, vqmovn_s32(y));
+            gain = vaddq_f32(gain, step);
+        }
+        gain_l = vgetq_lane_f32(gain, 0);
+        gain_r = vgetq_lane_f32(gain, 1);
+    }
+#endif /* #ifdef __ARM_NEON */
+
+    for (; frame < frames; frame++) {
+        int16_t* p = &buffer[frame * channels];
+        for (uint32_t ch = 0; ch < channels; ch++) {
+            p[ch] = clamp16((int32_t)(p[ch] * ((ch & 1) ? gain_r : gain_l)));
+        }
+        gain_l += step_l;
+        gain_r += step_r;
+    }
+    volume_ramp_complete(ramp);
+}
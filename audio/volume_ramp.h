@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Playback gain, left and right. A new target is reached with a linear ramp over the
+ * next buffer, so volume and mute changes do not click. Channels are interleaved S16;
+ * with more than two channels, even channels take the left gain and odd the right.
+ *
+ * When the speaker EQ runs, the gain is applied by fir_process_interleaved_gain()
+ * instead, in the same pass.
+ */
+
+#ifndef VOLUME_RAMP_H
+#define VOLUME_RAMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct volume_ramp {
+    float gain[2];    /* at the end of the last buffer */
+    float target[2];
+} volume_ramp_t;
+
+void volume_ramp_init(volume_ramp_t* ramp, float gain);
+/* Gains are clamped to [0, 1]. */
+void volume_ramp_set_target(volume_ramp_t* ramp, float left, float right);
+/* True if processing would not change the samples. */
+bool volume_ramp_is_unity(const volume_ramp_t* ramp);
+/* Mark the ramp as done, for callers that applied it themselves. */
+void volume_ramp_complete(volume_ramp_t* ramp);
+void volume_ramp_process(volume_ramp_t* ramp, int16_t* buffer, uint32_t frames,
+                         uint32_t channels);
+
+#endif /* #ifndef VOLUME_RAMP_H */
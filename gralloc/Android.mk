@@ -24,6 +24,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	gralloc_gbm.cpp \
+	gralloc_stats.cpp \
 	gralloc.cpp
 
 LOCAL_SHARED_LIBRARIES := \
@@ -38,6 +39,11 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := \
 LOCAL_C_INCLUDES += system/core/include hardware/libhardware/include
 LOCAL_C_INCLUDES += system/core/libsystem/include system/core
 
+# libgbm_mesa from Mesa 21.3 on passes usage flags along with modifiers
+ifeq ($(TARGET_GBM_HAS_CREATE_WITH_MODIFIERS2),true)
+LOCAL_CFLAGS += -DHAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+endif
+
 LOCAL_MODULE := gralloc.gbm
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_RELATIVE_PATH := hw
@@ -55,3 +61,5 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_PROPRIETARY_MODULE := true
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -23,8 +23,10 @@
  */
 
 #define LOG_TAG "GRALLOC-GBM"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 
 #include <log/log.h>
+#include <cutils/trace.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -42,6 +44,7 @@
 struct gbm_module_t {
 	gralloc_module_t base;
 
+	/* only guards device creation, buffers have their own locks */
 	pthread_mutex_t mutex;
 	struct gbm_device *gbm;
 };
@@ -53,10 +56,15 @@ static int gbm_init(struct gbm_module_t *dmod)
 {
 	int err = 0;
 
+	if (__atomic_load_n(&dmod->gbm, __ATOMIC_ACQUIRE))
+		return 0;
+
 	pthread_mutex_lock(&dmod->mutex);
 	if (!dmod->gbm) {
-		dmod->gbm = gbm_dev_create();
-		if (!dmod->gbm)
+		struct gbm_device *gbm = gbm_dev_create();
+		if (gbm)
+			__atomic_store_n(&dmod->gbm, gbm, __ATOMIC_RELEASE);
+		else
 			err = -EINVAL;
 	}
 	pthread_mutex_unlock(&dmod->mutex);
@@ -84,6 +92,31 @@ static int gbm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 			err = 0;
 		}
 		break;
+	case GRALLOC_MODULE_PERFORM_ALLOCATE:
+		{
+			int width = va_arg(args, int);
+			int height = va_arg(args, int);
+			int format = va_arg(args, int);
+			int usage = va_arg(args, int);
+			int count = va_arg(args, int);
+			buffer_handle_t *handles = va_arg(args, buffer_handle_t *);
+			int *stride = va_arg(args, int *);
+
+			ATRACE_BEGIN("gralloc alloc batch");
+			err = gralloc_gbm_bo_create_batch(dmod->gbm, width, height,
+					format, usage, count, handles, stride);
+			ATRACE_END();
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_GET_METADATA:
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			struct gralloc_drm_metadata *metadata =
+				va_arg(args, struct gralloc_drm_metadata *);
+
+			err = gralloc_gbm_get_metadata(handle, metadata);
+		}
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -103,9 +136,9 @@ static int gbm_mod_register_buffer(const gralloc_module_t *mod,
 	if (err)
 		return err;
 
-	pthread_mutex_lock(&dmod->mutex);
+	ATRACE_BEGIN("gralloc register");
 	err = gralloc_gbm_handle_register(handle, dmod->gbm);
-	pthread_mutex_unlock(&dmod->mutex);
+	ATRACE_END();
 
 	return err;
 }
@@ -113,12 +146,11 @@ static int gbm_mod_register_buffer(const gralloc_module_t *mod,
 static int gbm_mod_unregister_buffer(const gralloc_module_t *mod,
 		buffer_handle_t handle)
 {
-	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
+	ATRACE_BEGIN("gralloc unregister");
 	err = gralloc_gbm_handle_unregister(handle);
-	pthread_mutex_unlock(&dmod->mutex);
+	ATRACE_END();
 
 	return err;
 }
@@ -126,26 +158,23 @@ static int gbm_mod_unregister_buffer(const gralloc_module_t *mod,
 static int gbm_mod_lock(const gralloc_module_t *mod, buffer_handle_t handle,
 		int usage, int x, int y, int w, int h, void **ptr)
 {
-	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
-
+	ATRACE_BEGIN("gralloc lock");
 	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, ptr);
+	ATRACE_END();
 	ALOGV("buffer %p lock usage = %08x", handle, usage);
 
-	pthread_mutex_unlock(&dmod->mutex);
 	return err;
 }
 
 static int gbm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 {
-	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
+	ATRACE_BEGIN("gralloc unlock");
 	err = gralloc_gbm_bo_unlock(handle);
-	pthread_mutex_unlock(&dmod->mutex);
+	ATRACE_END();
 
 	return err;
 }
@@ -153,12 +182,11 @@ static int gbm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 static int gbm_mod_lock_ycbcr(gralloc_module_t const *mod, buffer_handle_t handle,
 		int usage, int x, int y, int w, int h, struct android_ycbcr *ycbcr)
 {
-	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
+	ATRACE_BEGIN("gralloc lock_ycbcr");
 	err = gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
-	pthread_mutex_unlock(&dmod->mutex);
+	ATRACE_END();
 
 	return err;
 }
@@ -176,17 +204,20 @@ static int gbm_mod_close_gpu0(struct hw_device_t *dev)
 
 static int gbm_mod_free_gpu0(alloc_device_t *dev, buffer_handle_t handle)
 {
-	struct gbm_module_t *dmod = (struct gbm_module_t *) dev->common.module;
-
-	pthread_mutex_lock(&dmod->mutex);
+	ATRACE_BEGIN("gralloc free");
 	gbm_free(handle);
+	ATRACE_END();
 	native_handle_close(handle);
 	delete handle;
 
-	pthread_mutex_unlock(&dmod->mutex);
 	return 0;
 }
 
+static void gbm_mod_dump_gpu0(alloc_device_t *dev, char *buff, int buff_len)
+{
+	gralloc_stats_dump(buff, buff_len);
+}
+
 static int gbm_mod_alloc_gpu0(alloc_device_t *dev,
 		int w, int h, int format, int usage,
 		buffer_handle_t *handle, int *stride)
@@ -194,14 +225,13 @@ static int gbm_mod_alloc_gpu0(alloc_device_t *dev,
 	struct gbm_module_t *dmod = (struct gbm_module_t *) dev->common.module;
 	int err = 0;
 
-	pthread_mutex_lock(&dmod->mutex);
-
+	ATRACE_BEGIN("gralloc alloc");
 	*handle = gralloc_gbm_bo_create(dmod->gbm, w, h, format, usage, stride);
 	if (!*handle)
 		err = -errno;
+	ATRACE_END();
 
 	ALOGV("buffer %p usage = %08x", *handle, usage);
-	pthread_mutex_unlock(&dmod->mutex);
 	return err;
 }
 
@@ -225,6 +255,7 @@ static int gbm_mod_open_gpu0(struct gbm_module_t *dmod, hw_device_t **dev)
 
 	alloc->alloc = gbm_mod_alloc_gpu0;
 	alloc->free = gbm_mod_free_gpu0;
+	alloc->dump = gbm_mod_dump_gpu0;
 
 	*dev = &alloc->common;
 
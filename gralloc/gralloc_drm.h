@@ -24,6 +24,8 @@
 #ifndef _GRALLOC_DRM_H_
 #define _GRALLOC_DRM_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,6 +36,54 @@ enum {
 	 *	   int *fd);
 	 */
 	GRALLOC_MODULE_PERFORM_GET_DRM_FD                = 0x40000002,
+	/* perform(const struct gralloc_module_t *mod,
+	 *	   int op,
+	 *	   int width, int height, int format, int usage,
+	 *	   int count,
+	 *	   buffer_handle_t *handles,
+	 *	   int *stride);
+	 *
+	 * Allocate 'count' buffers with the same description in one call,
+	 * e.g. a whole swapchain. On failure none are allocated. The handles
+	 * are released with alloc_device_t::free().
+	 */
+	GRALLOC_MODULE_PERFORM_ALLOCATE                  = 0x40000003,
+	/* perform(const struct gralloc_module_t *mod,
+	 *	   int op,
+	 *	   buffer_handle_t handle,
+	 *	   struct gralloc_drm_metadata *metadata);
+	 *
+	 * Describe an allocated or registered buffer.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_METADATA              = 0x40000004,
+};
+
+#define GRALLOC_DRM_MAX_PLANES 4
+
+enum {
+	GRALLOC_DRM_COMPRESSION_NONE = 0,
+	/* tiled or compressed, as described by the modifier */
+	GRALLOC_DRM_COMPRESSION_MODIFIER = 1,
+};
+
+struct gralloc_drm_plane_layout {
+	uint32_t offset;	/* bytes, from the start of the dma-buf */
+	uint32_t stride;	/* bytes */
+	uint32_t width;		/* samples */
+	uint32_t height;	/* samples */
+};
+
+struct gralloc_drm_metadata {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;	/* HAL_PIXEL_FORMAT_* */
+	uint32_t usage;
+	uint32_t drm_format;	/* fourcc the planes are laid out in */
+	uint64_t modifier;
+	int32_t dataspace;	/* not stored in the handle, always unknown */
+	uint32_t compression;
+	uint32_t num_planes;
+	struct gralloc_drm_plane_layout planes[GRALLOC_DRM_MAX_PLANES];
 };
 
 #ifdef __cplusplus
@@ -33,43 +33,395 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/dma-buf.h>
 
 #include <hardware/gralloc.h>
 #include <system/graphics.h>
 
 #include <gbm.h>
+#include <drm_fourcc.h>
 
+#include "gralloc_drm.h"
 #include "gralloc_gbm_priv.h"
 #include <android/gralloc_handle.h>
 
-#include <unordered_map>
-
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-static std::unordered_map<buffer_handle_t, struct gbm_bo *> gbm_bo_handle_map;
-
 struct bo_data_t {
+	pthread_mutex_t lock;
+	int refs;		/* the handle table's, plus one per lookup in use */
 	void *map_data;
+	/* persistent mapping of the dma-buf, for SW_*_OFTEN buffers */
+	void *cpu_addr;
+	size_t cpu_size;
+	uint64_t sync_flags;	/* DMA_BUF_SYNC_* of the current CPU access */
+	size_t map_size;	/* of the gbm_bo_map() while locked */
 	int lock_count;
 	int locked_for;
+	bool allocated;		/* by this process, not imported */
+	/* what gralloc_stats was told, and by which process */
+	pid_t stats_pid;
+	int stats_usage;
+	size_t stats_size;
+};
+
+/*
+ * Registered handles: open addressing, linear probing, keyed by the handle
+ * pointer. Lookups (every lock/unlock) take no lock: they run under a
+ * sequence count and retry if a writer got in between. Writers (register,
+ * alloc, free) serialize on handle_table_lock.
+ *
+ * Removed entries become tombstones until the next rehash. A table replaced
+ * by a rehash may still be probed by a concurrent reader, so it is only
+ * freed once the lookups that started before the switch are over.
+ *
+ * A lookup returns the bo with a reference taken. The table holds one
+ * reference of its own, which a removal only drops once every lookup that
+ * could still have seen the entry is over, so a bo is never destroyed
+ * under a locker.
+ */
+#define HANDLE_TABLE_MIN_CAPACITY 64
+#define HANDLE_TOMBSTONE ((buffer_handle_t)1)
+
+struct handle_slot {
+	buffer_handle_t handle;
+	struct gbm_bo *bo;
+};
+
+struct handle_table {
+	uint32_t capacity;	/* power of two */
+	uint32_t shift;		/* 64 - log2(capacity) */
+	struct handle_slot *slots;
 };
 
+static pthread_mutex_t handle_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t handle_table_seq;
+static struct handle_table *handle_table;
+/* writer side only */
+static uint32_t handle_table_live;
+static uint32_t handle_table_used;	/* live + tombstones */
+
+/*
+ * Lookups in flight, counted in one of two counters picked by the low bit
+ * of the epoch. To wait for the lookups that started before a change, a
+ * writer flips the epoch and waits for the old counter to drain; new
+ * lookups count in the other one, and none of them blocks, so that is
+ * short.
+ */
+static uint32_t handle_table_epoch;
+static uint32_t handle_table_readers[2];
+
+static uint32_t handle_table_read_begin(void)
+{
+	uint32_t idx;
+
+	for (;;) {
+		idx = __atomic_load_n(&handle_table_epoch, __ATOMIC_RELAXED) & 1;
+		__atomic_fetch_add(&handle_table_readers[idx], 1, __ATOMIC_SEQ_CST);
+		/* a flip in between may not have waited for this counter */
+		if ((__atomic_load_n(&handle_table_epoch, __ATOMIC_SEQ_CST) & 1) == idx)
+			return idx;
+		__atomic_fetch_sub(&handle_table_readers[idx], 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void handle_table_read_end(uint32_t idx)
+{
+	__atomic_fetch_sub(&handle_table_readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until no lookup can see what was unpublished before. Writer side. */
+static void handle_table_synchronize(void)
+{
+	uint32_t idx = __atomic_fetch_add(&handle_table_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+	while (__atomic_load_n(&handle_table_readers[idx], __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static uint32_t handle_hash(const struct handle_table *table, buffer_handle_t handle)
+{
+	/* handles are heap pointers: drop the alignment bits, then mix */
+	uint64_t key = (uint64_t)(uintptr_t)handle >> 4;
+
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> table->shift);
+}
+
+static void handle_table_destroy(struct handle_table *table)
+{
+	free(table->slots);
+	delete table;
+}
+
+static struct handle_table *handle_table_create(uint32_t capacity)
+{
+	struct handle_table *table = new struct handle_table();
+
+	table->slots = (struct handle_slot *)calloc(capacity, sizeof(*table->slots));
+	if (!table->slots) {
+		delete table;
+		return NULL;
+	}
+	table->capacity = capacity;
+	table->shift = 64 - __builtin_ctz(capacity);
+
+	return table;
+}
+
+/* Probe for 'handle'; returns its slot, or NULL. Writer side. */
+static struct handle_slot *handle_table_slot(struct handle_table *table,
+		buffer_handle_t handle)
+{
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = handle_hash(table, handle);
+
+	for (uint32_t n = 0; n < table->capacity; n++, i = (i + 1) & mask) {
+		struct handle_slot *slot = &table->slots[i];
+		if (!slot->handle)
+			break;
+		if (slot->handle == handle)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* Writer side: bracket table changes so readers retry */
+static void handle_table_write_begin(void)
+{
+	__atomic_store_n(&handle_table_seq, handle_table_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void handle_table_write_end(void)
+{
+	__atomic_store_n(&handle_table_seq, handle_table_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Rehash into a table sized for the live entries plus one, dropping tombstones */
+static int handle_table_rehash(void)
+{
+	struct handle_table *old = handle_table;
+	struct handle_table *table;
+	uint32_t capacity = HANDLE_TABLE_MIN_CAPACITY;
+
+	while (capacity < (handle_table_live + 1) * 2)
+		capacity <<= 1;
+
+	table = handle_table_create(capacity);
+	if (!table)
+		return -ENOMEM;
+
+	if (old) {
+		uint32_t mask = capacity - 1;
+		for (uint32_t n = 0; n < old->capacity; n++) {
+			struct handle_slot *src = &old->slots[n];
+			if (!src->handle || src->handle == HANDLE_TOMBSTONE)
+				continue;
+			uint32_t i = handle_hash(table, src->handle);
+			while (table->slots[i].handle)
+				i = (i + 1) & mask;
+			table->slots[i] = *src;
+		}
+	}
+
+	handle_table_write_begin();
+	__atomic_store_n(&handle_table, table, __ATOMIC_RELEASE);
+	handle_table_write_end();
+	handle_table_used = handle_table_live;
+
+	if (old) {
+		handle_table_synchronize();
+		handle_table_destroy(old);
+	}
+
+	return 0;
+}
+
+static struct bo_data_t *gbm_bo_data(struct gbm_bo *bo) {
+	return (struct bo_data_t *)gbm_bo_get_user_data(bo);
+}
+
+/* Returns the bo of 'handle' with a reference held, or NULL */
+static struct gbm_bo *handle_table_find(buffer_handle_t handle)
+{
+	struct gbm_bo *bo = NULL;
+	uint32_t seq, idx;
+	int retries = -1;
+
+	idx = handle_table_read_begin();
+	do {
+		retries++;
+		seq = __atomic_load_n(&handle_table_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		bo = NULL;
+		struct handle_table *table = __atomic_load_n(&handle_table, __ATOMIC_ACQUIRE);
+		if (!table)
+			break;
+
+		uint32_t mask = table->capacity - 1;
+		uint32_t i = handle_hash(table, handle);
+		for (uint32_t n = 0; n < table->capacity; n++, i = (i + 1) & mask) {
+			struct handle_slot *slot = &table->slots[i];
+			buffer_handle_t key = __atomic_load_n(&slot->handle, __ATOMIC_RELAXED);
+			if (!key)
+				break;
+			if (key == handle) {
+				bo = __atomic_load_n(&slot->bo, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&handle_table_seq, __ATOMIC_RELAXED) != seq);
+
+	/* the table's reference is not dropped before this lookup ends */
+	if (bo)
+		__atomic_fetch_add(&gbm_bo_data(bo)->refs, 1, __ATOMIC_RELAXED);
+	handle_table_read_end(idx);
+
+	if (retries)
+		gralloc_stats_table_retries(retries);
+
+	return bo;
+}
+
+static int handle_table_insert(buffer_handle_t handle, struct gbm_bo *bo)
+{
+	int err = 0;
+
+	gralloc_stats_mutex_lock(&handle_table_lock, GRALLOC_STATS_MUTEX_TABLE);
+
+	if (handle_table && handle_table_slot(handle_table, handle)) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	/* keep at least a quarter of the slots empty so probes stay short */
+	if (!handle_table || (handle_table_used + 1) * 4 > handle_table->capacity * 3) {
+		err = handle_table_rehash();
+		if (err)
+			goto out;
+	}
+
+	{
+		struct handle_table *table = handle_table;
+		uint32_t mask = table->capacity - 1;
+		uint32_t i = handle_hash(table, handle);
+		while (table->slots[i].handle && table->slots[i].handle != HANDLE_TOMBSTONE)
+			i = (i + 1) & mask;
+		if (!table->slots[i].handle)
+			handle_table_used++;
+
+		handle_table_write_begin();
+		__atomic_store_n(&table->slots[i].bo, bo, __ATOMIC_RELAXED);
+		__atomic_store_n(&table->slots[i].handle, handle, __ATOMIC_RELAXED);
+		handle_table_write_end();
+		handle_table_live++;
+	}
+
+out:
+	pthread_mutex_unlock(&handle_table_lock);
+	return err;
+}
+
+/*
+ * Unpublish 'handle'. Returns its bo, with the table's reference now owned
+ * by the caller, or NULL.
+ */
+static struct gbm_bo *handle_table_remove(buffer_handle_t handle)
+{
+	struct handle_slot *slot = NULL;
+	struct gbm_bo *bo = NULL;
+
+	gralloc_stats_mutex_lock(&handle_table_lock, GRALLOC_STATS_MUTEX_TABLE);
+
+	if (handle_table)
+		slot = handle_table_slot(handle_table, handle);
+	if (slot) {
+		bo = slot->bo;
+		handle_table_write_begin();
+		__atomic_store_n(&slot->handle, HANDLE_TOMBSTONE, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->bo, (struct gbm_bo *)NULL, __ATOMIC_RELAXED);
+		handle_table_write_end();
+		handle_table_live--;
+		handle_table_synchronize();
+	}
+
+	pthread_mutex_unlock(&handle_table_lock);
+	return bo;
+}
+
 void gralloc_gbm_destroy_user_data(struct gbm_bo *bo, void *data)
 {
 	struct bo_data_t *bo_data = (struct bo_data_t *)data;
+
+	/* not from a child that inherited the bo across fork() */
+	if (bo_data->stats_pid && bo_data->stats_pid == getpid()) {
+		if (bo_data->cpu_addr)
+			gralloc_stats_mapped(-(int64_t)bo_data->cpu_size);
+		gralloc_stats_buffer(bo_data->stats_usage, !bo_data->allocated,
+				     -(int64_t)bo_data->stats_size);
+	}
+
+	if (bo_data->cpu_addr)
+		munmap(bo_data->cpu_addr, bo_data->cpu_size);
+	pthread_mutex_destroy(&bo_data->lock);
 	delete bo_data;
 
 	(void)bo;
 }
 
-static struct bo_data_t *gbm_bo_data(struct gbm_bo *bo) {
-	return (struct bo_data_t *)gbm_bo_get_user_data(bo);
+/*
+ * Attach the per-buffer state before the bo is published in the handle
+ * table, so lockers never race to create it.
+ */
+static int gbm_bo_data_create(struct gbm_bo *bo)
+{
+	struct bo_data_t *bo_data = new struct bo_data_t();
+
+	if (!bo_data)
+		return -ENOMEM;
+
+	pthread_mutex_init(&bo_data->lock, NULL);
+	bo_data->refs = 1;
+	gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
+
+	return 0;
 }
 
+/* Account a newly allocated or imported bo to this process */
+static void gbm_bo_stats_add(struct gbm_bo *bo, struct gralloc_handle_t *handle)
+{
+	struct bo_data_t *bo_data = gbm_bo_data(bo);
+	off_t size;
+
+	size = lseek(handle->prime_fd, 0, SEEK_END);
+	if (size <= 0)
+		size = (off_t)handle->stride * gbm_bo_get_height(bo);
+
+	bo_data->stats_usage = handle->usage;
+	bo_data->stats_size = size;
+	bo_data->stats_pid = gralloc_stats_buffer(handle->usage, !bo_data->allocated, size);
+}
+
+static void gbm_bo_stats_mapped(struct bo_data_t *bo_data, int64_t bytes)
+{
+	if (bo_data->stats_pid && bo_data->stats_pid == getpid())
+		gralloc_stats_mapped(bytes);
+}
+
+#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
+
+#define GRALLOC_GBM_MAX_PLANES 3
 
 static uint32_t get_gbm_format(int format)
 {
@@ -92,11 +444,20 @@ static uint32_t get_gbm_format(int format)
 		fmt = GBM_FORMAT_ARGB8888;
 		break;
 	case HAL_PIXEL_FORMAT_YV12:
-		/* YV12 is planar, but must be a single buffer so ask for GR88 */
-		fmt = GBM_FORMAT_GR88;
+		fmt = GBM_FORMAT_YVU420;
+		break;
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+		fmt = GBM_FORMAT_NV12;
 		break;
-	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+		fmt = GBM_FORMAT_NV21;
+		break;
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+		fmt = GBM_FORMAT_NV16;
+		break;
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		fmt = GBM_FORMAT_P010;
+		break;
 	default:
 		fmt = 0;
 		break;
@@ -105,6 +466,85 @@ static uint32_t get_gbm_format(int format)
 	return fmt;
 }
 
+/*
+ * Single plane stand-in for the YUV formats, for drivers that can't
+ * allocate or import them natively: texels as wide as a luma row, with the
+ * chroma rows below the luma. Adjusts the size to match.
+ */
+static uint32_t get_gbm_fallback_format(int format, uint32_t *width, uint32_t *height)
+{
+	uint32_t fmt;
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YV12:
+		/* GR88 is 16bpp, so halve the width */
+		*width /= 2;
+		*height += *height / 2;
+		fmt = GBM_FORMAT_GR88;
+		break;
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+		*height += *height / 2;
+		fmt = GBM_FORMAT_R8;
+		break;
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+		*height *= 2;
+		fmt = GBM_FORMAT_R8;
+		break;
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		*height += *height / 2;
+		fmt = GBM_FORMAT_R16;
+		break;
+	default:
+		fmt = get_gbm_format(format);
+		break;
+	}
+
+	return fmt;
+}
+
+/*
+ * Plane layout of a buffer, from its luma stride in bytes. All planes share
+ * one dma-buf, packed the way Android expects them; allocations that come
+ * out any other way are not used. Returns the number of planes.
+ */
+static int gralloc_gbm_get_planes(int format, uint32_t stride, uint32_t height,
+		uint32_t *offsets, uint32_t *strides)
+{
+	uint32_t cstride;
+
+	offsets[0] = 0;
+	strides[0] = stride;
+
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		/* interleaved chroma, same stride as luma */
+		offsets[1] = stride * height;
+		strides[1] = stride;
+		return 2;
+	case HAL_PIXEL_FORMAT_YV12:
+		/* Y, then V, then U, chroma stride 16 aligned */
+		cstride = GRALLOC_ALIGN(stride / 2, 16);
+		offsets[1] = stride * height;
+		strides[1] = cstride;
+		offsets[2] = offsets[1] + cstride * (height / 2);
+		strides[2] = cstride;
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+static bool gralloc_gbm_is_planar(int format)
+{
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES], strides[GRALLOC_GBM_MAX_PLANES];
+
+	return gralloc_gbm_get_planes(format, 0, 0, offsets, strides) > 1;
+}
+
 static int gralloc_gbm_get_bpp(int format)
 {
 	int bpp;
@@ -123,7 +563,11 @@ static int gralloc_gbm_get_bpp(int format)
 		bpp = 2;
 		break;
 	/* planar; only Y is considered */
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		bpp = 2;
+		break;
 	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
 	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 		bpp = 1;
@@ -161,23 +605,45 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 	struct gralloc_handle_t *handle = gralloc_handle(_handle);
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
 	struct gbm_import_fd_modifier_data data;
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES], strides[GRALLOC_GBM_MAX_PLANES];
+	int planes;
 	#else
 	struct gbm_import_fd_data data;
 	#endif
+	uint32_t width = handle->width;
+	uint32_t height = handle->height;
+	uint32_t format;
 
-	int format = get_gbm_format(handle->format);
 	if (handle->prime_fd < 0)
 		return NULL;
 
 	memset(&data, 0, sizeof(data));
-	data.width = handle->width;
-	data.height = handle->height;
-	data.format = format;
-	/* Adjust the width and height for a GBM GR88 buffer */
-	if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-		data.width /= 2;
-		data.height += handle->height / 2;
+
+	#ifdef GBM_BO_IMPORT_FD_MODIFIER
+	planes = gralloc_gbm_get_planes(handle->format, handle->stride,
+					handle->height, offsets, strides);
+	if (planes > 1) {
+		data.width = width;
+		data.height = height;
+		data.format = get_gbm_format(handle->format);
+		data.num_fds = planes;
+		for (int i = 0; i < planes; i++) {
+			data.fds[i] = handle->prime_fd;
+			data.offsets[i] = offsets[i];
+			data.strides[i] = strides[i];
+		}
+		data.modifier = handle->modifier;
+		bo = gbm_bo_import(gbm, GBM_BO_IMPORT_FD_MODIFIER, &data, 0);
+		if (bo)
+			return bo;
+		memset(&data, 0, sizeof(data));
 	}
+	#endif
+
+	format = get_gbm_fallback_format(handle->format, &width, &height);
+	data.width = width;
+	data.height = height;
+	data.format = format;
 
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
 	data.num_fds = 1;
@@ -194,12 +660,156 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 	return bo;
 }
 
+/* Check that a multi-planar bo came out in the layout the handle implies */
+static bool gbm_bo_check_planes(struct gbm_bo *bo, int format)
+{
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES], strides[GRALLOC_GBM_MAX_PLANES];
+	int planes;
+
+	planes = gralloc_gbm_get_planes(format, gbm_bo_get_stride_for_plane(bo, 0),
+					gbm_bo_get_height(bo), offsets, strides);
+	if (gbm_bo_get_plane_count(bo) != planes)
+		return false;
+
+	for (int i = 0; i < planes; i++) {
+		if (gbm_bo_get_offset(bo, i) != offsets[i] ||
+		    gbm_bo_get_stride_for_plane(bo, i) != strides[i])
+			return false;
+	}
+
+	return true;
+}
+
+#ifdef GBM_BO_IMPORT_FD_MODIFIER
+/*
+ * Layouts offered to the driver for buffers only the GPU and display
+ * touch, so that traffic can use UBWC compression (Adreno, DPU). The driver
+ * picks the best of those it supports. gralloc.gbm.modifiers, a comma
+ * separated list of hex modifiers, replaces the list (e.g. to keep to what
+ * the display can scan out); "none" disables it.
+ */
+#define GRALLOC_GBM_MAX_MODIFIERS 16
+
+static const uint64_t default_modifiers[] = {
+	DRM_FORMAT_MOD_QCOM_COMPRESSED,
+	DRM_FORMAT_MOD_LINEAR,
+};
+
+static uint64_t modifiers[GRALLOC_GBM_MAX_MODIFIERS];
+static unsigned int modifier_count;
+
+static void gbm_modifiers_config(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	char *str, *end;
+
+	property_get("gralloc.gbm.modifiers", value, "");
+	if (!value[0]) {
+		memcpy(modifiers, default_modifiers, sizeof(default_modifiers));
+		modifier_count = sizeof(default_modifiers) / sizeof(default_modifiers[0]);
+		return;
+	}
+
+	modifier_count = 0;
+	if (!strcmp(value, "none"))
+		return;
+
+	for (str = value; *str && modifier_count < GRALLOC_GBM_MAX_MODIFIERS; str = end) {
+		modifiers[modifier_count] = strtoull(str, &end, 16);
+		if (end == str) {
+			ALOGE("bad gralloc.gbm.modifiers at \"%s\"", str);
+			break;
+		}
+		modifier_count++;
+		if (*end == ',')
+			end++;
+	}
+}
+
+static bool gbm_use_modifiers(int hal_format, int hal_usage, uint32_t usage)
+{
+	if (!modifier_count)
+		return false;
+	if (hal_usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+		return false;
+	/* the encoder and camera read and write these without modifiers */
+	if (hal_usage & (GRALLOC_USAGE_HW_VIDEO_ENCODER | GRALLOC_USAGE_HW_CAMERA_MASK))
+		return false;
+	if (usage & (GBM_BO_USE_CURSOR | GBM_BO_USE_LINEAR))
+		return false;
+	#ifndef HAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+	/* the usage can't be passed along, so keep to plain render targets */
+	if (usage & ~GBM_BO_USE_RENDERING)
+		return false;
+	#endif
+	/* YUV layouts are fixed by gralloc_gbm_get_planes() */
+	return !gralloc_gbm_is_planar(hal_format) && get_gbm_format(hal_format);
+}
+#else
+static void gbm_modifiers_config(void)
+{
+}
+#endif
+
+static struct gbm_bo *gbm_create(struct gbm_device *gbm, int hal_format,
+		int hal_usage, uint32_t width, uint32_t height, uint32_t usage)
+{
+	struct gbm_bo *bo = NULL;
+	uint32_t format;
+
+	#ifdef GBM_BO_IMPORT_FD_MODIFIER
+	if (gbm_use_modifiers(hal_format, hal_usage, usage)) {
+		#ifdef HAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+		bo = gbm_bo_create_with_modifiers2(gbm, width, height,
+				get_gbm_format(hal_format), modifiers, modifier_count,
+				usage);
+		#else
+		bo = gbm_bo_create_with_modifiers(gbm, width, height,
+				get_gbm_format(hal_format), modifiers, modifier_count);
+		#endif
+		/* the handle has no room for auxiliary (e.g. CCS) planes */
+		if (bo && gbm_bo_get_plane_count(bo) > 1) {
+			gbm_bo_destroy(bo);
+			bo = NULL;
+		}
+		if (bo) {
+			ALOGV("created BO with modifier 0x%llx",
+			      (unsigned long long)gbm_bo_get_modifier(bo));
+			return bo;
+		}
+	}
+	#endif
+
+	if (gralloc_gbm_is_planar(hal_format)) {
+		bo = gbm_bo_create(gbm, width, height, get_gbm_format(hal_format), usage);
+		if (bo && !gbm_bo_check_planes(bo, hal_format)) {
+			ALOGV("unexpected plane layout for fmt=%d, using a single plane",
+			      hal_format);
+			gbm_bo_destroy(bo);
+			bo = NULL;
+		}
+		if (bo)
+			return bo;
+	}
+
+	format = get_gbm_fallback_format(hal_format, &width, &height);
+	bo = gbm_bo_create(gbm, width, height, format, usage);
+
+	/* the GR88 stand-in only fits two chroma rows per row at this alignment */
+	if (bo && hal_format == HAL_PIXEL_FORMAT_YV12 && gbm_bo_get_stride(bo) % 32) {
+		ALOGE("YV12 stride %u is not 32 byte aligned", gbm_bo_get_stride(bo));
+		gbm_bo_destroy(bo);
+		bo = NULL;
+	}
+
+	return bo;
+}
+
 static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 		buffer_handle_t _handle)
 {
 	struct gbm_bo *bo;
 	struct gralloc_handle_t *handle = gralloc_handle(_handle);
-	int format = get_gbm_format(handle->format);
 	int usage = get_pipe_bind(handle->usage);
 	int width, height;
 
@@ -212,18 +822,9 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 			height = 64;
 	}
 
-	/*
-	 * For YV12, we request GR88, so halve the width since we're getting
-	 * 16bpp. Then increase the height by 1.5 for the U and V planes.
-	 */
-	if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-		width /= 2;
-		height += handle->height / 2;
-	}
-
 	ALOGV("create BO, size=%dx%d, fmt=%d, usage=%x",
 	      handle->width, handle->height, handle->format, usage);
-	bo = gbm_bo_create(gbm, width, height, format, usage);
+	bo = gbm_create(gbm, handle->format, handle->usage, width, height, usage);
 	if (!bo) {
 		ALOGE("failed to create BO, size=%dx%d, fmt=%d, usage=%x",
 		      handle->width, handle->height, handle->format, usage);
@@ -231,7 +832,7 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 	}
 
 	handle->prime_fd = gbm_bo_get_fd(bo);
-	handle->stride = gbm_bo_get_stride(bo);
+	handle->stride = gbm_bo_get_stride_for_plane(bo, 0);
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
 	handle->modifier = gbm_bo_get_modifier(bo);
 	#endif
@@ -241,62 +842,190 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 
 void gbm_free(buffer_handle_t handle)
 {
-	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
+	struct gbm_bo *bo = handle_table_remove(handle);
 
-	if (!bo)
-		return;
-
-	gbm_bo_handle_map.erase(handle);
-	gbm_bo_destroy(bo);
+	if (bo)
+		gralloc_gbm_bo_put(bo);
 }
 
 /*
- * Return the bo of a registered handle.
+ * Return the bo of a registered handle, with a reference held. Drop it
+ * with gralloc_gbm_bo_put().
  */
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle)
 {
-	return gbm_bo_handle_map[handle];
+	return handle_table_find(handle);
 }
 
-static int gbm_map(buffer_handle_t handle, int x, int y, int w, int h,
-		int enable_write, void **addr)
+void gralloc_gbm_bo_put(struct gbm_bo *bo)
+{
+	if (!__atomic_sub_fetch(&gbm_bo_data(bo)->refs, 1, __ATOMIC_ACQ_REL))
+		gbm_bo_destroy(bo);
+}
+
+/*
+ * Buffers the CPU touches every frame keep one mapping of the dma-buf for
+ * their lifetime. Each lock/unlock is bracketed by DMA_BUF_IOCTL_SYNC
+ * instead, which does the cache maintenance without the mmap/munmap.
+ */
+static bool gbm_map_persistent(int usage)
+{
+	return (usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN ||
+	       (usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN;
+}
+
+static int dma_buf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+	int ret;
+
+	do {
+		ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret && (errno == EINTR || errno == EAGAIN));
+
+	return ret ? -errno : 0;
+}
+
+static void *gbm_map_dma_buf(struct gralloc_handle_t *gbm_handle,
+		struct bo_data_t *bo_data)
+{
+	off_t size;
+	void *addr;
+
+	size = lseek(gbm_handle->prime_fd, 0, SEEK_END);
+	if (size <= 0)
+		return NULL;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    gbm_handle->prime_fd, 0);
+	if (addr == MAP_FAILED) {
+		ALOGW("failed to mmap dma-buf: %s, falling back to gbm_bo_map",
+		      strerror(errno));
+		return NULL;
+	}
+
+	bo_data->cpu_addr = addr;
+	bo_data->cpu_size = size;
+	gbm_bo_stats_mapped(bo_data, size);
+
+	return addr;
+}
+
+static int gbm_map(buffer_handle_t handle, struct gbm_bo *bo,
+		int x, int y, int w, int h, int enable_write, void **addr)
 {
 	int err = 0;
 	int flags = GBM_BO_TRANSFER_READ;
 	struct gralloc_gbm_handle_t *gbm_handle = gralloc_handle(handle);
-	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
 	uint32_t stride;
+	void *map;
+
+	/* gbm_bo_map() only reaches the first plane of a multi-planar bo */
+	bool multi_planar = gbm_bo_get_plane_count(bo) > 1;
+
+	if ((gbm_map_persistent(gbm_handle->usage) || multi_planar) &&
+	    (bo_data->cpu_addr || gbm_map_dma_buf(gbm_handle, bo_data))) {
+		/* the first lock syncs for all the compatible ones nested in it */
+		if (!bo_data->lock_count) {
+			bo_data->sync_flags = DMA_BUF_SYNC_READ;
+			if (enable_write)
+				bo_data->sync_flags |= DMA_BUF_SYNC_WRITE;
+			dma_buf_sync(gbm_handle->prime_fd,
+				     DMA_BUF_SYNC_START | bo_data->sync_flags);
+		}
+		*addr = bo_data->cpu_addr;
+		return 0;
+	}
+
+	if (multi_planar)
+		return -ENOMEM;
 
 	if (bo_data->map_data)
 		return -EINVAL;
 
-	if (gbm_handle->format == HAL_PIXEL_FORMAT_YV12) {
-		if (x || y)
-			ALOGE("can't map with offset for planar %p", bo);
-		w /= 2;
-		h += h / 2;
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+	    (uint32_t)x >= gbm_handle->width || (uint32_t)y >= gbm_handle->height)
+		return -EINVAL;
+	if ((uint32_t)(x + w) > gbm_handle->width)
+		w = gbm_handle->width - x;
+	if ((uint32_t)(y + h) > gbm_handle->height)
+		h = gbm_handle->height - y;
+
+	if (gralloc_gbm_is_planar(gbm_handle->format)) {
+		/*
+		 * The chroma of any rect lies below all of the luma, so map
+		 * whole rows of the single plane stand-in from y to its end.
+		 */
+		uint32_t width = gbm_handle->width;
+		uint32_t height = gbm_handle->height;
+
+		get_gbm_fallback_format(gbm_handle->format, &width, &height);
+		x = 0;
+		w = width;
+		h = height - y;
 	}
 
 	if (enable_write)
 		flags |= GBM_BO_TRANSFER_WRITE;
 
-	*addr = gbm_bo_map(bo, 0, 0, x + w, y + h, flags, &stride, &bo_data->map_data);
-	ALOGV("mapped bo %p (%d, %d)-(%d, %d) at %p", bo, x, y, w, h, *addr);
-	if (*addr == NULL)
+	/*
+	 * Only the locked rect is mapped, so the driver reads back and
+	 * flushes just those rows and columns. Callers index from the buffer
+	 * origin, so hand back the address the origin would have.
+	 */
+	map = gbm_bo_map(bo, x, y, w, h, flags, &stride, &bo_data->map_data);
+	if (map && stride != gbm_bo_get_stride(bo)) {
+		/*
+		 * A driver that maps through a staging copy may pack the rect
+		 * at its own pitch, which callers indexing with the handle's
+		 * stride can't follow. Map the whole buffer instead.
+		 */
+		ALOGV("rect mapped at stride %u, not %u: mapping the whole bo",
+		      stride, gbm_bo_get_stride(bo));
+		gbm_bo_unmap(bo, bo_data->map_data);
+		x = 0;
+		y = 0;
+		w = gbm_bo_get_width(bo);
+		h = gbm_bo_get_height(bo);
+		map = gbm_bo_map(bo, x, y, w, h, flags, &stride, &bo_data->map_data);
+		if (map && stride != gbm_bo_get_stride(bo)) {
+			ALOGE("bo mapped at stride %u, not %u", stride,
+			      gbm_bo_get_stride(bo));
+			gbm_bo_unmap(bo, bo_data->map_data);
+			map = NULL;
+		}
+	}
+	ALOGV("mapped bo %p (%d, %d) %dx%d at %p", bo, x, y, w, h, map);
+	if (map == NULL) {
+		bo_data->map_data = NULL;
 		return -ENOMEM;
+	}
+
+	bo_data->map_size = (size_t)stride * h;
+	gbm_bo_stats_mapped(bo_data, bo_data->map_size);
 
-	assert(stride == gbm_bo_get_stride(bo));
+	*addr = (uint8_t *)map - (size_t)y * stride -
+		(size_t)x * gralloc_gbm_get_bpp(gbm_handle->format);
 
 	return err;
 }
 
-static void gbm_unmap(struct gbm_bo *bo)
+static void gbm_unmap(buffer_handle_t handle, struct gbm_bo *bo)
 {
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
 
+	if (bo_data->cpu_addr) {
+		if (bo_data->lock_count == 1)
+			dma_buf_sync(gralloc_handle(handle)->prime_fd,
+				     DMA_BUF_SYNC_END | bo_data->sync_flags);
+		return;
+	}
+
 	gbm_bo_unmap(bo, bo_data->map_data);
 	bo_data->map_data = NULL;
+	gbm_bo_stats_mapped(bo_data, -(int64_t)bo_data->map_size);
+	bo_data->map_size = 0;
 }
 
 void gbm_dev_destroy(struct gbm_device *gbm)
@@ -324,8 +1053,11 @@ struct gbm_device *gbm_dev_create(void)
 	if (!gbm) {
 		ALOGE("failed to create gbm device");
 		close(fd);
+		return NULL;
 	}
 
+	gbm_modifiers_config();
+
 	return gbm;
 }
 
@@ -339,14 +1071,28 @@ int gralloc_gbm_handle_register(buffer_handle_t _handle, struct gbm_device *gbm)
 	if (!_handle)
 		return -EINVAL;
 
-	if (gbm_bo_handle_map.count(_handle))
+	bo = handle_table_find(_handle);
+	if (bo) {
+		gralloc_gbm_bo_put(bo);
 		return -EINVAL;
+	}
 
 	bo = gbm_import(gbm, _handle);
 	if (!bo)
 		return -EINVAL;
 
-	gbm_bo_handle_map.emplace(_handle, bo);
+	if (gbm_bo_data_create(bo)) {
+		gbm_bo_destroy(bo);
+		return -ENOMEM;
+	}
+
+	/* another thread may have registered the same handle meanwhile */
+	if (handle_table_insert(_handle, bo)) {
+		gbm_bo_destroy(bo);
+		return -EINVAL;
+	}
+
+	gbm_bo_stats_add(bo, gralloc_handle(_handle));
 
 	return 0;
 }
@@ -380,7 +1126,16 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 		return NULL;
 	}
 
-	gbm_bo_handle_map.emplace(handle, bo);
+	if (gbm_bo_data_create(bo) || handle_table_insert(handle, bo)) {
+		gbm_bo_destroy(bo);
+		/* the dma-buf fd gbm_alloc() exported */
+		native_handle_close(handle);
+		native_handle_delete(handle);
+		errno = ENOMEM;
+		return NULL;
+	}
+	gbm_bo_data(bo)->allocated = true;
+	gbm_bo_stats_add(bo, gralloc_handle(handle));
 
 	/* in pixels */
 	*stride = gralloc_handle(handle)->stride / gralloc_gbm_get_bpp(format);
@@ -389,18 +1144,50 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 }
 
 /*
- * Lock a bo.  XXX thread-safety?
+ * Create 'count' bos with the same description, or none.
+ */
+int gralloc_gbm_bo_create_batch(struct gbm_device *gbm,
+		int width, int height, int format, int usage, int count,
+		buffer_handle_t *handles, int *stride)
+{
+	int err = 0;
+	int i;
+
+	if (count <= 0)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		handles[i] = gralloc_gbm_bo_create(gbm, width, height, format,
+						   usage, stride);
+		if (!handles[i]) {
+			err = errno ? -errno : -ENOMEM;
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	while (i--) {
+		gbm_free(handles[i]);
+		native_handle_close(handles[i]);
+		native_handle_delete((native_handle_t *)handles[i]);
+		handles[i] = NULL;
+	}
+	return err;
+}
+
+/*
+ * Lock a bo.  Serialized per bo by bo_data_t::lock.
  */
 int gralloc_gbm_bo_lock(buffer_handle_t handle,
 		int usage, int x, int y, int w, int h,
 		void **addr)
 {
 	struct gralloc_handle_t *gbm_handle = gralloc_handle(handle);
-	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
+	struct gbm_bo *bo;
 	struct bo_data_t *bo_data;
-
-	if (!bo)
-		return -EINVAL;
+	int err = 0;
 
 	if ((gbm_handle->usage & usage) != (uint32_t)usage) {
 		/* make FB special for testing software renderer with */
@@ -414,17 +1201,20 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
 		}
 	}
 
+	bo = gralloc_gbm_bo_from_handle(handle);
+	if (!bo)
+		return -EINVAL;
+
 	bo_data = gbm_bo_data(bo);
-	if (!bo_data) {
-		bo_data = new struct bo_data_t();
-		gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
-	}
+	gralloc_stats_mutex_lock(&bo_data->lock, GRALLOC_STATS_MUTEX_BO);
 
 	ALOGV("lock bo %p, cnt=%d, usage=%x", bo, bo_data->lock_count, usage);
 
 	/* allow multiple locks with compatible usages */
-	if (bo_data->lock_count && (bo_data->locked_for & usage) != usage)
-		return -EINVAL;
+	if (bo_data->lock_count && (bo_data->locked_for & usage) != usage) {
+		err = -EINVAL;
+		goto out;
+	}
 
 	usage |= bo_data->locked_for;
 
@@ -441,9 +1231,9 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
 		     GRALLOC_USAGE_SW_READ_MASK)) {
 		/* the driver is supposed to wait for the bo */
 		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = gbm_map(handle, x, y, w, h, write, addr);
+		err = gbm_map(handle, bo, x, y, w, h, write, addr);
 		if (err)
-			return err;
+			goto out;
 	}
 	else {
 		/* kernel handles the synchronization here */
@@ -451,8 +1241,12 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
 
 	bo_data->lock_count++;
 	bo_data->locked_for |= usage;
+	gralloc_stats_lock();
 
-	return 0;
+out:
+	pthread_mutex_unlock(&bo_data->lock);
+	gralloc_gbm_bo_put(bo);
+	return err;
 }
 
 /*
@@ -466,65 +1260,126 @@ int gralloc_gbm_bo_unlock(buffer_handle_t handle)
 		return -EINVAL;
 
 	bo_data = gbm_bo_data(bo);
+	gralloc_stats_mutex_lock(&bo_data->lock, GRALLOC_STATS_MUTEX_BO);
 
 	int mapped = bo_data->locked_for &
 		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
 
 	if (!bo_data->lock_count)
-		return 0;
+		goto out;
 
 	if (mapped)
-		gbm_unmap(bo);
+		gbm_unmap(handle, bo);
 
 	bo_data->lock_count--;
 	if (!bo_data->lock_count)
 		bo_data->locked_for = 0;
 
+out:
+	pthread_mutex_unlock(&bo_data->lock);
+	gralloc_gbm_bo_put(bo);
 	return 0;
 }
 
-#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
-
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
 		int usage, int x, int y, int w, int h,
 		struct android_ycbcr *ycbcr)
 {
 	struct gralloc_handle_t *hnd = gralloc_handle(handle);
-	int ystride, cstride;
-	void *addr = 0;
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES], strides[GRALLOC_GBM_MAX_PLANES];
+	unsigned char *addr = 0;
 	int err;
 
 	ALOGV("handle %p, hnd %p, usage 0x%x", handle, hnd, usage);
 
-	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, &addr);
+	if (!gralloc_gbm_is_planar(hnd->format)) {
+		ALOGE("Can not lock buffer, invalid format: 0x%x", hnd->format);
+		return -EINVAL;
+	}
+
+	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, (void **)&addr);
 	if (err)
 		return err;
 
+	gralloc_gbm_get_planes(hnd->format, hnd->stride, hnd->height, offsets, strides);
+
 	memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
+	ycbcr->y = addr;
+	ycbcr->ystride = strides[0];
+	ycbcr->cstride = strides[1];
 
 	switch (hnd->format) {
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-		ystride = cstride = GRALLOC_ALIGN(hnd->width, 16);
-		ycbcr->y = addr;
-		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + 1;
-		ycbcr->ystride = ystride;
-		ycbcr->cstride = cstride;
+		ycbcr->cr = addr + offsets[1];
+		ycbcr->cb = addr + offsets[1] + 1;
 		ycbcr->chroma_step = 2;
 		break;
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+		ycbcr->cb = addr + offsets[1];
+		ycbcr->cr = addr + offsets[1] + 1;
+		ycbcr->chroma_step = 2;
+		break;
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		ycbcr->cb = addr + offsets[1];
+		ycbcr->cr = addr + offsets[1] + 2;
+		ycbcr->chroma_step = 4;
+		break;
 	case HAL_PIXEL_FORMAT_YV12:
-		ystride = hnd->width;
-		cstride = GRALLOC_ALIGN(ystride / 2, 16);
-		ycbcr->y = addr;
-		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + cstride * hnd->height / 2;
-		ycbcr->ystride = ystride;
-		ycbcr->cstride = cstride;
+		ycbcr->cr = addr + offsets[1];
+		ycbcr->cb = addr + offsets[2];
 		ycbcr->chroma_step = 1;
 		break;
-	default:
-		ALOGE("Can not lock buffer, invalid format: 0x%x", hnd->format);
+	}
+
+	return 0;
+}
+
+int gralloc_gbm_get_metadata(buffer_handle_t handle,
+		struct gralloc_drm_metadata *metadata)
+{
+	struct gralloc_handle_t *hnd = gralloc_handle(handle);
+	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES], strides[GRALLOC_GBM_MAX_PLANES];
+	int planes;
+
+	if (!bo)
 		return -EINVAL;
+	gralloc_gbm_bo_put(bo);
+
+	memset(metadata, 0, sizeof(*metadata));
+	metadata->width = hnd->width;
+	metadata->height = hnd->height;
+	metadata->format = hnd->format;
+	metadata->usage = hnd->usage;
+	metadata->drm_format = get_gbm_format(hnd->format);
+	metadata->dataspace = HAL_DATASPACE_UNKNOWN;
+
+	#ifdef GBM_BO_IMPORT_FD_MODIFIER
+	metadata->modifier = hnd->modifier;
+	#else
+	metadata->modifier = DRM_FORMAT_MOD_INVALID;
+	#endif
+	if (metadata->modifier != DRM_FORMAT_MOD_LINEAR &&
+	    metadata->modifier != DRM_FORMAT_MOD_INVALID)
+		metadata->compression = GRALLOC_DRM_COMPRESSION_MODIFIER;
+
+	planes = gralloc_gbm_get_planes(hnd->format, hnd->stride, hnd->height,
+					offsets, strides);
+	metadata->num_planes = planes;
+	for (int i = 0; i < planes; i++) {
+		struct gralloc_drm_plane_layout *plane = &metadata->planes[i];
+
+		plane->offset = offsets[i];
+		plane->stride = strides[i];
+		plane->width = hnd->width;
+		plane->height = hnd->height;
+		if (i) {
+			/* 4:2:0 subsampled, except NV16 which only halves the width */
+			plane->width = (hnd->width + 1) / 2;
+			if (hnd->format != HAL_PIXEL_FORMAT_YCbCr_422_SP)
+				plane->height = (hnd->height + 1) / 2;
+		}
 	}
 
 	return 0;
@@ -31,15 +31,20 @@ extern "C" {
 
 struct gbm_device;
 struct gbm_bo;
+struct gralloc_drm_metadata;
 
 int gralloc_gbm_handle_register(buffer_handle_t handle, struct gbm_device *gbm);
 int gralloc_gbm_handle_unregister(buffer_handle_t handle);
 
 buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 		int width, int height, int format, int usage, int *stride);
+int gralloc_gbm_bo_create_batch(struct gbm_device *gbm,
+		int width, int height, int format, int usage, int count,
+		buffer_handle_t *handles, int *stride);
 void gbm_free(buffer_handle_t handle);
 
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle);
+void gralloc_gbm_bo_put(struct gbm_bo *bo);
 buffer_handle_t gralloc_gbm_bo_get_handle(struct gbm_bo *bo);
 int gralloc_gbm_get_gem_handle(buffer_handle_t handle);
 
@@ -47,6 +52,23 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle, int usage, int x, int y, int w,
 int gralloc_gbm_bo_unlock(buffer_handle_t handle);
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle, int usage,
 		int x, int y, int w, int h, struct android_ycbcr *ycbcr);
+int gralloc_gbm_get_metadata(buffer_handle_t handle,
+		struct gralloc_drm_metadata *metadata);
+
+pid_t gralloc_stats_buffer(int usage, bool imported, int64_t bytes);
+void gralloc_stats_mapped(int64_t bytes);
+void gralloc_stats_lock(void);
+int gralloc_stats_dump(char *buf, int len);
+
+/* internal locks whose contention is counted */
+enum {
+	GRALLOC_STATS_MUTEX_TABLE,
+	GRALLOC_STATS_MUTEX_BO,
+	GRALLOC_STATS_MUTEX_COUNT,
+};
+
+void gralloc_stats_mutex_lock(pthread_mutex_t *mutex, int which);
+void gralloc_stats_table_retries(int retries);
 
 struct gbm_device *gbm_dev_create(void);
 void gbm_dev_destroy(struct gbm_device *gbm);
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ * Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define LOG_TAG "GRALLOC-GBM"
+
+#include <log/log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_stats.h"
+#include "gralloc_gbm_priv.h"
+
+#define likely(x) __builtin_expect(!!(x), 1)
+
+/* process local, unlike the slots below */
+static uint64_t stats_contended[GRALLOC_STATS_MUTEX_COUNT];
+static uint64_t stats_wait_ns[GRALLOC_STATS_MUTEX_COUNT];
+static uint64_t stats_retries;
+
+static const char *const stats_mutex_names[GRALLOC_STATS_MUTEX_COUNT] = {
+	"handle table", "bo",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gralloc_stats *stats;
+static bool stats_mapped;
+/* our slot; pid tells whether it was claimed by this process or a parent */
+static pid_t self_pid;
+static struct gralloc_stats_process *self;
+
+static struct gralloc_stats *stats_map(void)
+{
+	struct gralloc_stats *region;
+	uint32_t magic = 0;
+	struct stat st;
+	int fd;
+
+	fd = open(GRALLOC_STATS_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+	if (fd < 0) {
+		ALOGV("no buffer stats: %s", strerror(errno));
+		return NULL;
+	}
+
+	/* whoever comes first sizes it; the new pages read as zero */
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*region) &&
+			       ftruncate(fd, sizeof(*region)))) {
+		ALOGE("failed to size %s: %s", GRALLOC_STATS_PATH, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	region = (struct gralloc_stats *)mmap(NULL, sizeof(*region),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		ALOGE("failed to map %s: %s", GRALLOC_STATS_PATH, strerror(errno));
+		return NULL;
+	}
+
+	if (__atomic_compare_exchange_n(&region->magic, &magic, GRALLOC_STATS_MAGIC,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		__atomic_store_n(&region->num_processes, GRALLOC_STATS_MAX_PROCESSES,
+				 __ATOMIC_RELEASE);
+	else if (magic != GRALLOC_STATS_MAGIC) {
+		ALOGE("%s has a bad magic 0x%x", GRALLOC_STATS_PATH, magic);
+		munmap(region, sizeof(*region));
+		return NULL;
+	}
+
+	return region;
+}
+
+/*
+ * Readers match a slot on pid and start time, so a slot mid-claim, with the
+ * new pid but the old or no start time yet, belongs to nobody.
+ */
+static bool stats_claim(struct gralloc_stats_process *slot, int32_t old, pid_t pid,
+			uint64_t start_time)
+{
+	if (!__atomic_compare_exchange_n(&slot->pid, &old, pid, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return false;
+
+	memset((char *)slot + sizeof(slot->pid), 0, sizeof(*slot) - sizeof(slot->pid));
+	__atomic_store_n(&slot->start_time, start_time, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* whether the process that claimed 'slot' is gone, its pid maybe reused */
+static bool stats_slot_stale(struct gralloc_stats_process *slot, int32_t owner)
+{
+	return __atomic_load_n(&slot->start_time, __ATOMIC_RELAXED) !=
+	       gralloc_stats_start_time(owner);
+}
+
+static struct gralloc_stats_process *stats_find_slot(pid_t pid)
+{
+	struct gralloc_stats_process *slots = stats->processes;
+	uint64_t start_time = gralloc_stats_start_time(pid);
+	int i;
+
+	/* a previous process with our pid, or a free slot */
+	for (i = 0; i < GRALLOC_STATS_MAX_PROCESSES; i++) {
+		int32_t owner = __atomic_load_n(&slots[i].pid, __ATOMIC_RELAXED);
+		if (owner == pid && stats_claim(&slots[i], owner, pid, start_time))
+			return &slots[i];
+	}
+	for (i = 0; i < GRALLOC_STATS_MAX_PROCESSES; i++) {
+		if (stats_claim(&slots[i], 0, pid, start_time))
+			return &slots[i];
+	}
+	/* take over the slot of a process that is gone */
+	for (i = 0; i < GRALLOC_STATS_MAX_PROCESSES; i++) {
+		int32_t owner = __atomic_load_n(&slots[i].pid, __ATOMIC_RELAXED);
+		if (stats_slot_stale(&slots[i], owner) &&
+		    stats_claim(&slots[i], owner, pid, start_time))
+			return &slots[i];
+	}
+
+	ALOGW("no free buffer stats slot for pid %d", pid);
+	return NULL;
+}
+
+static struct gralloc_stats_process *stats_self(void)
+{
+	pid_t pid = getpid();
+
+	if (likely(__atomic_load_n(&self_pid, __ATOMIC_ACQUIRE) == pid))
+		return self;
+
+	pthread_mutex_lock(&stats_lock);
+	if (self_pid != pid) {
+		if (!stats_mapped) {
+			stats = stats_map();
+			stats_mapped = true;
+		}
+		self = stats ? stats_find_slot(pid) : NULL;
+		__atomic_store_n(&self_pid, pid, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return self;
+}
+
+static void stats_add(uint64_t *counter, int64_t value)
+{
+	__atomic_fetch_add(counter, (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+int gralloc_stats_usage(int usage)
+{
+	if (usage & GRALLOC_USAGE_HW_CAMERA_MASK)
+		return GRALLOC_STATS_USAGE_CAMERA;
+	if (usage & GRALLOC_USAGE_HW_VIDEO_ENCODER)
+		return GRALLOC_STATS_USAGE_VIDEO;
+	if (usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_CURSOR))
+		return GRALLOC_STATS_USAGE_DISPLAY;
+	if (!(usage & GRALLOC_USAGE_HW_MASK) &&
+	    (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)))
+		return GRALLOC_STATS_USAGE_CPU;
+	return GRALLOC_STATS_USAGE_GPU;
+}
+
+/*
+ * Account 'bytes' (negative on release) to the calling process. Returns the
+ * pid it was accounted to, or 0 if there are no stats.
+ */
+pid_t gralloc_stats_buffer(int usage, bool imported, int64_t bytes)
+{
+	struct gralloc_stats_process *slot = stats_self();
+	int bucket = gralloc_stats_usage(usage);
+
+	if (!slot)
+		return 0;
+
+	if (imported) {
+		stats_add(&slot->imported[bucket], bytes);
+		if (bytes > 0)
+			stats_add(&slot->imports, 1);
+	} else {
+		stats_add(&slot->allocated[bucket], bytes);
+		if (bytes > 0)
+			stats_add(&slot->allocations, 1);
+	}
+
+	return self_pid;
+}
+
+void gralloc_stats_mapped(int64_t bytes)
+{
+	struct gralloc_stats_process *slot = stats_self();
+
+	if (slot)
+		stats_add(&slot->mapped, bytes);
+}
+
+void gralloc_stats_lock(void)
+{
+	struct gralloc_stats_process *slot = stats_self();
+
+	if (slot)
+		stats_add(&slot->locks, 1);
+}
+
+static uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * pthread_mutex_lock() that counts how often, and for how long, the caller
+ * had to wait. The uncontended path is just the trylock.
+ */
+void gralloc_stats_mutex_lock(pthread_mutex_t *mutex, int which)
+{
+	uint64_t begin;
+
+	if (likely(!pthread_mutex_trylock(mutex)))
+		return;
+
+	begin = stats_now_ns();
+	pthread_mutex_lock(mutex);
+	stats_add(&stats_contended[which], 1);
+	stats_add(&stats_wait_ns[which], stats_now_ns() - begin);
+}
+
+/* lookups that raced with a handle table update and had to go again */
+void gralloc_stats_table_retries(int retries)
+{
+	stats_add(&stats_retries, retries);
+}
+
+static int stats_dump_contention(char *buf, int len)
+{
+	int n = 0;
+
+	if (n < len)
+		n += snprintf(buf + n, len - n, "  contention:");
+	for (int i = 0; i < GRALLOC_STATS_MUTEX_COUNT && n < len; i++)
+		n += snprintf(buf + n, len - n, " %s %llu (%llu us),",
+			      stats_mutex_names[i],
+			      (unsigned long long)stats_contended[i],
+			      (unsigned long long)(stats_wait_ns[i] / 1000));
+	if (n < len)
+		n += snprintf(buf + n, len - n, " table retries %llu\n",
+			      (unsigned long long)stats_retries);
+
+	return n;
+}
+
+int gralloc_stats_dump(char *buf, int len)
+{
+	struct gralloc_stats_process *slot = stats_self();
+	uint64_t allocated = 0, imported = 0;
+	int n;
+
+	if (!slot) {
+		n = snprintf(buf, len, "buffer stats: not available\n");
+		goto contention;
+	}
+
+	for (int i = 0; i < GRALLOC_STATS_USAGE_COUNT; i++) {
+		allocated += __atomic_load_n(&slot->allocated[i], __ATOMIC_RELAXED);
+		imported += __atomic_load_n(&slot->imported[i], __ATOMIC_RELAXED);
+	}
+
+	n = snprintf(buf, len,
+			"buffer stats: allocated %llu KiB (%llu), imported %llu KiB (%llu), "
+			"mapped %llu KiB, locks %llu\n",
+			(unsigned long long)(allocated >> 10),
+			(unsigned long long)slot->allocations,
+			(unsigned long long)(imported >> 10),
+			(unsigned long long)slot->imports,
+			(unsigned long long)(slot->mapped >> 10),
+			(unsigned long long)slot->locks);
+
+contention:
+	if (n >= 0 && n < len)
+		n += stats_dump_contention(buf + n, len - n);
+
+	return n;
+}
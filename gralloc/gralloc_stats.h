@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010-2011 Chia-I Wu <olvaffe@gmail.com>
+ * Copyright (C) 2010-2011 LunarG Inc.
+ * Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef _GRALLOC_STATS_H_
+#define _GRALLOC_STATS_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-process buffer accounting, kept in a small file on tmpfs that every
+ * process using gralloc maps. Each process claims a slot by pid and start
+ * time, so a slot left behind by a process that is gone is never taken for
+ * a later one with the same pid, and only ever updates its own slot, with
+ * atomic adds; readers (memtrack) take a racy snapshot. Processes that can't
+ * open the file (apps) keep no stats.
+ */
+#define GRALLOC_STATS_PATH "/dev/gralloc/stats"
+#define GRALLOC_STATS_MAGIC 0x32545347		/* "GST2" */
+#define GRALLOC_STATS_MAX_PROCESSES 256
+
+enum {
+	GRALLOC_STATS_USAGE_GPU,	/* rendering, texturing, anything else */
+	GRALLOC_STATS_USAGE_DISPLAY,	/* framebuffer, composer, cursor */
+	GRALLOC_STATS_USAGE_CAMERA,
+	GRALLOC_STATS_USAGE_VIDEO,
+	GRALLOC_STATS_USAGE_CPU,	/* software only */
+	GRALLOC_STATS_USAGE_COUNT,
+};
+
+struct gralloc_stats_process {
+	int32_t pid;			/* 0 for a free slot */
+	uint32_t reserved;
+	uint64_t start_time;		/* of pid, see gralloc_stats_start_time() */
+	/* bytes held now, allocated by this process or imported into it */
+	uint64_t allocated[GRALLOC_STATS_USAGE_COUNT];
+	uint64_t imported[GRALLOC_STATS_USAGE_COUNT];
+	uint64_t mapped;		/* bytes CPU mapped now */
+	/* totals since the slot was claimed */
+	uint64_t allocations;
+	uint64_t imports;
+	uint64_t locks;
+};
+
+struct gralloc_stats {
+	uint32_t magic;
+	uint32_t num_processes;
+	struct gralloc_stats_process processes[GRALLOC_STATS_MAX_PROCESSES];
+};
+
+/*
+ * When 'pid' started, in clock ticks since boot, from /proc/<pid>/stat; 0 if
+ * it is gone. Together with the pid, it tells processes apart across pid
+ * reuse.
+ */
+static inline uint64_t gralloc_stats_start_time(pid_t pid)
+{
+	unsigned long long start_time;
+	char path[32], buf[512], *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* comm may hold spaces and parentheses; starttime is field 22 */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+			 " %*d %*d %*d %*d %*d %*d %llu", &start_time) != 1)
+		return 0;
+
+	return start_time;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GRALLOC_STATS_H_ */
@@ -0,0 +1,69 @@
+# Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included
+# in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+LOCAL_PATH := $(call my-dir)
+
+# Sources and includes of gralloc_gbm.cpp on the host, with fake_gbm.c in
+# place of libgbm_mesa
+gralloc_host_src_files := \
+	fake_gbm.c \
+	../gralloc_gbm.cpp \
+	../gralloc_stats.cpp
+
+gralloc_host_c_includes := \
+	$(LOCAL_PATH)/.. \
+	external/mesa3d/src/gbm/main \
+	external/libdrm \
+	external/libdrm/include/drm \
+	external/libdrm/android
+
+# Handle lookup and lock/unlock cost, with and without concurrent
+# register/unregister traffic; see handle_table_benchmark.cpp.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gralloc_gbm_handle_table_benchmark
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+	handle_table_benchmark.cpp \
+	$(gralloc_host_src_files)
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES := $(gralloc_host_c_includes)
+LOCAL_CFLAGS := -DHAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+LOCAL_STATIC_LIBRARIES := libgoogle-benchmark
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# SurfaceFlinger-, app- and camera-like threads allocating, importing,
+# locking and freeing at once; reports per-op latency percentiles and lock
+# contention. See stress_bench.cpp.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gralloc_gbm_stress_bench
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_SRC_FILES := \
+	stress_bench.cpp \
+	$(gralloc_host_src_files)
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES := $(gralloc_host_c_includes)
+LOCAL_CFLAGS := -DHAVE_GBM_BO_CREATE_WITH_MODIFIERS2
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+
+include $(BUILD_HOST_EXECUTABLE)
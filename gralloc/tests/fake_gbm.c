@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host stand-in for the GBM calls made by gralloc_gbm.cpp, for machines
+ * without a GPU: every bo is a linear, single plane buffer in a memfd,
+ * which mmap()s and lseek()s like a dma-buf. Formats the driver would
+ * allocate as several planes are refused, so gralloc takes its single plane
+ * fallback. With fake_gbm_set_packed_map(), rect maps go through a packed
+ * staging copy instead, see fake_gbm.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <gbm.h>
+#include <drm_fourcc.h>
+
+#include "fake_gbm.h"
+
+#define FAKE_GBM_PITCH_ALIGN 64
+
+struct gbm_device {
+	int fd;
+};
+
+struct gbm_bo {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t stride;
+	size_t size;
+	int fd;
+	uint64_t modifier;
+	void *user_data;
+	void (*destroy_user_data)(struct gbm_bo *, void *);
+};
+
+struct fake_gbm_map {
+	void *addr;
+	size_t size;
+	/* packed copy of the rect at (x, y), written back on unmap if 'write' */
+	uint8_t *staging;
+	uint32_t x, y, width, height;
+	bool write;
+};
+
+static bool fake_gbm_packed_map;
+
+void fake_gbm_set_packed_map(bool packed)
+{
+	__atomic_store_n(&fake_gbm_packed_map, packed, __ATOMIC_RELAXED);
+}
+
+static uint32_t fake_gbm_cpp(uint32_t format)
+{
+	switch (format) {
+	case GBM_FORMAT_R8:
+		return 1;
+	case GBM_FORMAT_R16:
+	case GBM_FORMAT_GR88:
+	case GBM_FORMAT_RGB565:
+		return 2;
+	case GBM_FORMAT_RGB888:
+		return 3;
+	case GBM_FORMAT_XBGR8888:
+	case GBM_FORMAT_ABGR8888:
+	case GBM_FORMAT_ARGB8888:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static struct gbm_bo *fake_gbm_bo_new(uint32_t width, uint32_t height,
+		uint32_t format, uint32_t stride, int fd)
+{
+	struct gbm_bo *bo = calloc(1, sizeof(*bo));
+
+	if (!bo)
+		return NULL;
+
+	bo->width = width;
+	bo->height = height;
+	bo->format = format;
+	bo->stride = stride;
+	bo->size = (size_t)stride * height;
+	bo->fd = fd;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+
+	return bo;
+}
+
+struct gbm_device *gbm_create_device(int fd)
+{
+	struct gbm_device *gbm = calloc(1, sizeof(*gbm));
+
+	if (gbm)
+		gbm->fd = fd;
+	return gbm;
+}
+
+void gbm_device_destroy(struct gbm_device *gbm)
+{
+	free(gbm);
+}
+
+int gbm_device_get_fd(struct gbm_device *gbm)
+{
+	return gbm->fd;
+}
+
+struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width,
+		uint32_t height, uint32_t format, uint32_t flags)
+{
+	uint32_t cpp = fake_gbm_cpp(format);
+	uint32_t stride;
+	struct gbm_bo *bo;
+	int fd;
+
+	(void)gbm;
+	(void)flags;
+
+	if (!cpp || !width || !height) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	stride = (width * cpp + FAKE_GBM_PITCH_ALIGN - 1) & ~(FAKE_GBM_PITCH_ALIGN - 1);
+
+	fd = memfd_create("fake-gbm-bo", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, (off_t)stride * height)) {
+		close(fd);
+		return NULL;
+	}
+
+	bo = fake_gbm_bo_new(width, height, format, stride, fd);
+	if (!bo)
+		close(fd);
+	return bo;
+}
+
+/* Only the linear layout is supported */
+struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format,
+		const uint64_t *modifiers, const unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			return gbm_bo_create(gbm, width, height, format, 0);
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+struct gbm_bo *gbm_bo_create_with_modifiers2(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format,
+		const uint64_t *modifiers, const unsigned int count, uint32_t flags)
+{
+	(void)flags;
+	return gbm_bo_create_with_modifiers(gbm, width, height, format,
+					    modifiers, count);
+}
+
+struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type,
+		void *buffer, uint32_t usage)
+{
+	uint32_t width, height, format, stride;
+	struct gbm_bo *bo;
+	struct stat st;
+	int fd;
+
+	(void)gbm;
+	(void)usage;
+
+	if (type == GBM_BO_IMPORT_FD_MODIFIER) {
+		struct gbm_import_fd_modifier_data *data =
+			(struct gbm_import_fd_modifier_data *)buffer;
+
+		if (data->num_fds != 1 || data->offsets[0] ||
+		    (data->modifier != DRM_FORMAT_MOD_LINEAR &&
+		     data->modifier != DRM_FORMAT_MOD_INVALID))
+			goto inval;
+		width = data->width;
+		height = data->height;
+		format = data->format;
+		stride = data->strides[0];
+		fd = data->fds[0];
+	} else if (type == GBM_BO_IMPORT_FD) {
+		struct gbm_import_fd_data *data = (struct gbm_import_fd_data *)buffer;
+
+		width = data->width;
+		height = data->height;
+		format = data->format;
+		stride = data->stride;
+		fd = data->fd;
+	} else {
+		goto inval;
+	}
+
+	if (!fake_gbm_cpp(format) || stride < width * fake_gbm_cpp(format) ||
+	    fstat(fd, &st) || (uint64_t)st.st_size < (uint64_t)stride * height)
+		goto inval;
+
+	/* the kernel keeps its own reference, not the caller's fd */
+	fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	bo = fake_gbm_bo_new(width, height, format, stride, fd);
+	if (!bo)
+		close(fd);
+	return bo;
+
+inval:
+	errno = EINVAL;
+	return NULL;
+}
+
+void gbm_bo_destroy(struct gbm_bo *bo)
+{
+	if (bo->destroy_user_data)
+		bo->destroy_user_data(bo, bo->user_data);
+	close(bo->fd);
+	free(bo);
+}
+
+/* Copy the rect between the bo mapping and its packed staging copy */
+static void fake_gbm_copy_rect(struct gbm_bo *bo, struct fake_gbm_map *map,
+		bool to_staging)
+{
+	uint32_t cpp = fake_gbm_cpp(bo->format);
+	size_t row = (size_t)map->width * cpp;
+
+	for (uint32_t i = 0; i < map->height; i++) {
+		uint8_t *src = (uint8_t *)map->addr + (size_t)(map->y + i) * bo->stride +
+			(size_t)map->x * cpp;
+		uint8_t *dst = map->staging + i * row;
+
+		if (to_staging)
+			memcpy(dst, src, row);
+		else
+			memcpy(src, dst, row);
+	}
+}
+
+void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t flags,
+		uint32_t *stride, void **map_data)
+{
+	struct fake_gbm_map *map;
+	bool packed;
+	int prot = 0;
+
+	if (!width || !height || x + width > bo->width || y + height > bo->height) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (flags & GBM_BO_TRANSFER_READ)
+		prot |= PROT_READ;
+	if (flags & GBM_BO_TRANSFER_WRITE)
+		prot |= PROT_WRITE;
+
+	packed = __atomic_load_n(&fake_gbm_packed_map, __ATOMIC_RELAXED) &&
+		 (x || y || width != bo->width || height != bo->height);
+	if (packed)
+		prot = PROT_READ | PROT_WRITE;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+
+	map->size = bo->size;
+	map->addr = mmap(NULL, map->size, prot, MAP_SHARED, bo->fd, 0);
+	if (map->addr == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+
+	if (packed) {
+		map->x = x;
+		map->y = y;
+		map->width = width;
+		map->height = height;
+		map->write = flags & GBM_BO_TRANSFER_WRITE;
+		map->staging = malloc((size_t)width * fake_gbm_cpp(bo->format) * height);
+		if (!map->staging) {
+			munmap(map->addr, map->size);
+			free(map);
+			return NULL;
+		}
+		if (flags & GBM_BO_TRANSFER_READ)
+			fake_gbm_copy_rect(bo, map, true);
+
+		*stride = width * fake_gbm_cpp(bo->format);
+		*map_data = map;
+		return map->staging;
+	}
+
+	*stride = bo->stride;
+	*map_data = map;
+
+	return (uint8_t *)map->addr + (size_t)y * bo->stride +
+		(size_t)x * fake_gbm_cpp(bo->format);
+}
+
+void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
+{
+	struct fake_gbm_map *map = (struct fake_gbm_map *)map_data;
+
+	if (map->staging) {
+		if (map->write)
+			fake_gbm_copy_rect(bo, map, false);
+		free(map->staging);
+	}
+	munmap(map->addr, map->size);
+	free(map);
+}
+
+uint32_t gbm_bo_get_width(struct gbm_bo *bo)
+{
+	return bo->width;
+}
+
+uint32_t gbm_bo_get_height(struct gbm_bo *bo)
+{
+	return bo->height;
+}
+
+uint32_t gbm_bo_get_stride(struct gbm_bo *bo)
+{
+	return bo->stride;
+}
+
+uint32_t gbm_bo_get_stride_for_plane(struct gbm_bo *bo, int plane)
+{
+	return plane ? 0 : bo->stride;
+}
+
+uint32_t gbm_bo_get_format(struct gbm_bo *bo)
+{
+	return bo->format;
+}
+
+uint32_t gbm_bo_get_offset(struct gbm_bo *bo, int plane)
+{
+	(void)bo;
+	(void)plane;
+	return 0;
+}
+
+uint64_t gbm_bo_get_modifier(struct gbm_bo *bo)
+{
+	return bo->modifier;
+}
+
+int gbm_bo_get_plane_count(struct gbm_bo *bo)
+{
+	(void)bo;
+	return 1;
+}
+
+int gbm_bo_get_fd(struct gbm_bo *bo)
+{
+	return fcntl(bo->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void gbm_bo_set_user_data(struct gbm_bo *bo, void *data,
+		void (*destroy_user_data)(struct gbm_bo *, void *))
+{
+	bo->user_data = data;
+	bo->destroy_user_data = destroy_user_data;
+}
+
+void *gbm_bo_get_user_data(struct gbm_bo *bo)
+{
+	return bo->user_data;
+}
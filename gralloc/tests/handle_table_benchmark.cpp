@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Cost of the handle -> bo lookup behind every lock and unlock, from one or
+ * more threads, alone or while another thread keeps registering and
+ * unregistering imports (which inserts, removes and rehashes). Runs on
+ * fake_gbm.c, so only gralloc's own work is measured.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cutils/native_handle.h>
+#include <hardware/gralloc.h>
+#include <gbm.h>
+
+#include "gralloc_gbm_priv.h"
+
+namespace {
+
+/* about what SurfaceFlinger has registered with a few apps running */
+constexpr int kBuffers = 128;
+
+struct gbm_device* gbm;
+std::vector<buffer_handle_t> handles;
+
+void setup() {
+    gbm = gbm_create_device(open("/dev/null", O_RDWR | O_CLOEXEC));
+    for (int i = 0; i < kBuffers; i++) {
+        int stride;
+        buffer_handle_t handle = gralloc_gbm_bo_create(gbm, 64, 64, HAL_PIXEL_FORMAT_RGBA_8888,
+                                                       GRALLOC_USAGE_HW_TEXTURE, &stride);
+        if (handle)
+            handles.push_back(handle);
+    }
+}
+
+/* Imports of clones of our own buffers, registered and unregistered in a loop */
+class Churn {
+  public:
+    void start() {
+        stop_ = false;
+        thread_ = std::thread([this] {
+            for (size_t i = 0; !stop_.load(std::memory_order_relaxed); i++) {
+                native_handle_t* clone = native_handle_clone(handles[i % handles.size()]);
+                if (!gralloc_gbm_handle_register(clone, gbm))
+                    gralloc_gbm_handle_unregister(clone);
+                native_handle_close(clone);
+                native_handle_delete(clone);
+                registrations_++;
+            }
+        });
+    }
+
+    uint64_t stop() {
+        stop_ = true;
+        thread_.join();
+        return registrations_.exchange(0);
+    }
+
+  private:
+    std::thread thread_;
+    std::atomic<bool> stop_;
+    std::atomic<uint64_t> registrations_{0};
+};
+
+Churn churn;
+
+void churn_begin(benchmark::State& state) {
+    if (state.thread_index() == 0 && state.range(0))
+        churn.start();
+}
+
+void churn_end(benchmark::State& state) {
+    if (state.thread_index() == 0 && state.range(0))
+        state.counters["registrations"] =
+                benchmark::Counter(churn.stop(), benchmark::Counter::kIsRate);
+}
+
+void BM_Lookup(benchmark::State& state) {
+    size_t i = state.thread_index();
+    churn_begin(state);
+    for (auto _ : state) {
+        struct gbm_bo* bo = gralloc_gbm_bo_from_handle(handles[i++ % handles.size()]);
+        benchmark::DoNotOptimize(bo);
+        gralloc_gbm_bo_put(bo);
+    }
+    churn_end(state);
+}
+BENCHMARK(BM_Lookup)->ArgName("churn")->Arg(0)->Arg(1)->ThreadRange(1, 8)->UseRealTime();
+
+/* GPU-only usage, so lock and unlock are the lookup and the bo mutex */
+void BM_LockUnlock(benchmark::State& state) {
+    size_t i = state.thread_index();
+    churn_begin(state);
+    for (auto _ : state) {
+        buffer_handle_t handle = handles[i++ % handles.size()];
+        void* addr;
+        gralloc_gbm_bo_lock(handle, GRALLOC_USAGE_HW_TEXTURE, 0, 0, 0, 0, &addr);
+        gralloc_gbm_bo_unlock(handle);
+    }
+    churn_end(state);
+}
+BENCHMARK(BM_LockUnlock)->ArgName("churn")->Arg(0)->Arg(1)->ThreadRange(1, 8)->UseRealTime();
+
+/* All threads on one buffer: the bo mutex, not the table, is what's shared */
+void BM_LockUnlockSameBuffer(benchmark::State& state) {
+    churn_begin(state);
+    for (auto _ : state) {
+        void* addr;
+        gralloc_gbm_bo_lock(handles[0], GRALLOC_USAGE_HW_TEXTURE, 0, 0, 0, 0, &addr);
+        gralloc_gbm_bo_unlock(handles[0]);
+    }
+    churn_end(state);
+}
+BENCHMARK(BM_LockUnlockSameBuffer)->ArgName("churn")->Arg(0)->Arg(1)->ThreadRange(1, 8)
+        ->UseRealTime();
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    setup();
+    if (handles.size() != kBuffers) {
+        fprintf(stderr, "failed to allocate the buffers\n");
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
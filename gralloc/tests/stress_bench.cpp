@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2016 Linaro, Ltd., Rob Herring <robh@kernel.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Concurrent alloc/register/lock/unlock/free traffic through gralloc_gbm.cpp,
+ * on fake_gbm.c:
+ *
+ *  - app threads render into a swapchain of three buffers, some on the GPU
+ *    and some in software, and queue every frame to the compositor; every
+ *    few hundred frames the swapchain is reallocated, as on a resize.
+ *  - a compositor thread imports each new buffer once, locks and unlocks
+ *    it for composition on every frame it is queued, and unregisters it
+ *    when the app frees it, like SurfaceFlinger.
+ *  - a camera thread fills a pool of YCbCr buffers for an image reader
+ *    thread, which imports them and reads every frame through lock_ycbcr;
+ *    the pool is reallocated on every session reconfiguration.
+ *
+ * Reports p50/p99/p99.9/max latency per operation and the lock contention
+ * counted by gralloc_stats_mutex_lock(). Before that, checks that a write
+ * through a rect lock reads back in place through a full lock while
+ * fake_gbm.c packs rect maps, as some drivers do; exits with 1 if not.
+ *
+ * usage: gralloc_gbm_stress_bench [-d seconds] [-a apps] [-r frames] [-C]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cutils/native_handle.h>
+#include <hardware/gralloc.h>
+#include <gbm.h>
+
+#include "fake_gbm.h"
+#include "gralloc_gbm_priv.h"
+
+namespace {
+
+enum Op { kAlloc, kFree, kRegister, kUnregister, kLock, kUnlock, kOpCount };
+
+const char* const kOpNames[kOpCount] = {
+        "alloc", "free", "register", "unregister", "lock", "unlock",
+};
+
+constexpr int kSwapchainBuffers = 3;
+constexpr int kCameraBuffers = 8;
+/* frames an app or the camera may run ahead of its consumer */
+constexpr size_t kQueueDepth = 8;
+
+struct Config {
+    double seconds = 5;
+    int apps = 4;
+    int realloc_frames = 300;
+    bool camera = true;
+};
+
+struct gbm_device* gbm;
+std::atomic<bool> stop;
+
+/* Per thread, merged once the threads are done */
+struct Latencies {
+    std::vector<uint32_t> ns[kOpCount];
+    uint64_t failures = 0;
+
+    template <typename F>
+    int time(Op op, F&& f) {
+        auto begin = std::chrono::steady_clock::now();
+        int err = f();
+        auto end = std::chrono::steady_clock::now();
+        ns[op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+        if (err)
+            failures++;
+        return err;
+    }
+};
+
+std::mutex results_lock;
+Latencies results;
+
+void merge(Latencies& l) {
+    std::lock_guard<std::mutex> guard(results_lock);
+    for (int op = 0; op < kOpCount; op++)
+        results.ns[op].insert(results.ns[op].end(), l.ns[op].begin(), l.ns[op].end());
+    results.failures += l.failures;
+}
+
+/*
+ * What crosses the process boundary in a real system: the producer's
+ * handle is cloned, as binder would dup its fds, and the consumer
+ * registers the clone the first time it sees the buffer.
+ */
+struct Message {
+    enum { kNew, kQueue, kRelease, kStop } type;
+    int slot;
+    native_handle_t* clone;
+};
+
+class Queue {
+  public:
+    void push(Message m) {
+        std::unique_lock<std::mutex> lock(lock_);
+        space_.wait(lock, [this] { return messages_.size() < kQueueDepth; });
+        messages_.push_back(m);
+        ready_.notify_one();
+    }
+
+    Message pop() {
+        std::unique_lock<std::mutex> lock(lock_);
+        ready_.wait(lock, [this] { return !messages_.empty(); });
+        Message m = messages_.front();
+        messages_.pop_front();
+        space_.notify_one();
+        return m;
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::deque<Message> messages_;
+};
+
+class Producer {
+  public:
+    Producer(Queue* queue, int base, int count, int width, int height, int format, int usage,
+             int lock_usage, int realloc_frames)
+        : queue_(queue), base_(base), count_(count), width_(width), height_(height),
+          format_(format), usage_(usage), lock_usage_(lock_usage),
+          realloc_frames_(realloc_frames) {}
+
+    void run() {
+        std::vector<buffer_handle_t> buffers(count_);
+
+        for (unsigned frame = 0; !stop.load(std::memory_order_relaxed); frame++) {
+            int i = frame % count_;
+
+            if (frame % realloc_frames_ == 0) {
+                release(buffers);
+                if (!allocate(buffers))
+                    break;
+            }
+            render(buffers[i]);
+            queue_->push({Message::kQueue, base_ + i, nullptr});
+        }
+
+        release(buffers);
+        merge(latencies_);
+    }
+
+  private:
+    bool allocate(std::vector<buffer_handle_t>& buffers) {
+        for (int i = 0; i < count_; i++) {
+            int stride;
+            buffer_handle_t handle = nullptr;
+
+            latencies_.time(kAlloc, [&] {
+                handle = gralloc_gbm_bo_create(gbm, width_, height_, format_, usage_, &stride);
+                return handle ? 0 : -1;
+            });
+            if (!handle) {
+                fprintf(stderr, "failed to allocate %dx%d format %d\n", width_, height_,
+                        format_);
+                stop = true;
+                return false;
+            }
+            buffers[i] = handle;
+            queue_->push({Message::kNew, base_ + i, native_handle_clone(handle)});
+        }
+        return true;
+    }
+
+    void release(std::vector<buffer_handle_t>& buffers) {
+        for (int i = 0; i < count_; i++) {
+            if (!buffers[i])
+                continue;
+            queue_->push({Message::kRelease, base_ + i, nullptr});
+            latencies_.time(kFree, [&] {
+                gbm_free(buffers[i]);
+                return 0;
+            });
+            native_handle_close(buffers[i]);
+            native_handle_delete(const_cast<native_handle_t*>(buffers[i]));
+            buffers[i] = nullptr;
+        }
+    }
+
+    void render(buffer_handle_t handle) {
+        void* addr;
+
+        if (latencies_.time(kLock, [&] {
+                return gralloc_gbm_bo_lock(handle, lock_usage_, 0, 0, width_, height_, &addr);
+            }))
+            return;
+        if (lock_usage_ & GRALLOC_USAGE_SW_WRITE_MASK)
+            memset(addr, 0x80, 64);
+        latencies_.time(kUnlock, [&] { return gralloc_gbm_bo_unlock(handle); });
+    }
+
+    Queue* queue_;
+    int base_;
+    int count_;
+    int width_;
+    int height_;
+    int format_;
+    int usage_;
+    int lock_usage_;
+    int realloc_frames_;
+    Latencies latencies_;
+};
+
+class Consumer {
+  public:
+    Consumer(Queue* queue, int lock_usage, bool ycbcr)
+        : queue_(queue), lock_usage_(lock_usage), ycbcr_(ycbcr) {}
+
+    void run() {
+        for (;;) {
+            Message m = queue_->pop();
+
+            if (m.type == Message::kStop)
+                break;
+            if (m.type == Message::kNew)
+                import(m.slot, m.clone);
+            else if (m.type == Message::kQueue)
+                consume(m.slot);
+            else
+                release(m.slot);
+        }
+
+        while (!buffers_.empty())
+            release(buffers_.begin()->first);
+        merge(latencies_);
+    }
+
+  private:
+    void import(int slot, native_handle_t* clone) {
+        if (latencies_.time(kRegister, [&] { return gralloc_gbm_handle_register(clone, gbm); })) {
+            native_handle_close(clone);
+            native_handle_delete(clone);
+            return;
+        }
+        buffers_[slot] = clone;
+    }
+
+    void release(int slot) {
+        auto it = buffers_.find(slot);
+
+        if (it == buffers_.end())
+            return;
+        latencies_.time(kUnregister, [&] { return gralloc_gbm_handle_unregister(it->second); });
+        native_handle_close(it->second);
+        native_handle_delete(it->second);
+        buffers_.erase(it);
+    }
+
+    void consume(int slot) {
+        auto it = buffers_.find(slot);
+        volatile uint8_t sink;
+
+        if (it == buffers_.end())
+            return;
+
+        if (ycbcr_) {
+            struct android_ycbcr ycbcr;
+
+            if (latencies_.time(kLock, [&] {
+                    return gralloc_gbm_bo_lock_ycbcr(it->second, lock_usage_, 0, 0, 0, 0,
+                                                     &ycbcr);
+                }))
+                return;
+            sink = *(uint8_t*)ycbcr.y + *(uint8_t*)ycbcr.cb;
+        } else {
+            void* addr;
+
+            if (latencies_.time(kLock, [&] {
+                    return gralloc_gbm_bo_lock(it->second, lock_usage_, 0, 0, 0, 0, &addr);
+                }))
+                return;
+        }
+        (void)sink;
+        latencies_.time(kUnlock, [&] { return gralloc_gbm_bo_unlock(it->second); });
+    }
+
+    Queue* queue_;
+    int lock_usage_;
+    bool ycbcr_;
+    std::map<int, native_handle_t*> buffers_;
+    Latencies latencies_;
+};
+
+/*
+ * Write a pattern through a lock of a rect, with rect maps packed at their
+ * own pitch, and read the whole buffer back through a lock of all of it:
+ * the pattern must be where the rect is and nowhere else.
+ */
+bool check_rect_lock() {
+    constexpr int kWidth = 100, kHeight = 50;
+    constexpr int kX = 13, kY = 7, kW = 30, kH = 20;
+    int usage = GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY;
+    int stride, errors = 0;
+    buffer_handle_t handle;
+    void* addr;
+
+    handle = gralloc_gbm_bo_create(gbm, kWidth, kHeight, HAL_PIXEL_FORMAT_RGBA_8888, usage,
+                                   &stride);
+    if (!handle) {
+        fprintf(stderr, "rect lock: failed to allocate\n");
+        return false;
+    }
+
+    fake_gbm_set_packed_map(true);
+    if (!gralloc_gbm_bo_lock(handle, GRALLOC_USAGE_SW_WRITE_RARELY, kX, kY, kW, kH, &addr)) {
+        for (int y = kY; y < kY + kH; y++)
+            for (int x = kX; x < kX + kW; x++)
+                ((uint32_t*)addr)[y * stride + x] = y << 16 | x;
+        gralloc_gbm_bo_unlock(handle);
+    } else {
+        errors++;
+    }
+
+    if (!gralloc_gbm_bo_lock(handle, GRALLOC_USAGE_SW_READ_RARELY, 0, 0, kWidth, kHeight,
+                             &addr)) {
+        for (int y = 0; y < kHeight; y++) {
+            for (int x = 0; x < kWidth; x++) {
+                bool inside = x >= kX && x < kX + kW && y >= kY && y < kY + kH;
+                uint32_t expected = inside ? y << 16 | x : 0;
+
+                if (((uint32_t*)addr)[y * stride + x] != expected)
+                    errors++;
+            }
+        }
+        gralloc_gbm_bo_unlock(handle);
+    } else {
+        errors++;
+    }
+    fake_gbm_set_packed_map(false);
+
+    gbm_free(handle);
+    native_handle_close(handle);
+    native_handle_delete(const_cast<native_handle_t*>(handle));
+
+    printf("rect lock with packed maps: %s (%d pixels wrong)\n", errors ? "FAILED" : "ok",
+           errors);
+    return !errors;
+}
+
+void report(double seconds) {
+    char buf[1024];
+
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "per sec", "p50 us",
+           "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < kOpCount; op++) {
+        std::vector<uint32_t>& ns = results.ns[op];
+        auto percentile = [&](double p) {
+            return ns[std::min(ns.size() - 1, (size_t)(ns.size() * p / 100))] / 1000.0;
+        };
+
+        if (ns.empty())
+            continue;
+        std::sort(ns.begin(), ns.end());
+        printf("%-10s %10zu %10.0f %10.1f %10.1f %10.1f %10.1f\n", kOpNames[op], ns.size(),
+               ns.size() / seconds, percentile(50), percentile(99), percentile(99.9),
+               ns.back() / 1000.0);
+    }
+    if (results.failures)
+        printf("%llu calls failed\n", (unsigned long long)results.failures);
+
+    gralloc_stats_dump(buf, sizeof(buf));
+    printf("%s", buf);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Config config;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:a:r:C")) != -1) {
+        switch (opt) {
+        case 'd':
+            config.seconds = atof(optarg);
+            break;
+        case 'a':
+            config.apps = atoi(optarg);
+            break;
+        case 'r':
+            config.realloc_frames = std::max(1, atoi(optarg));
+            break;
+        case 'C':
+            config.camera = false;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d seconds] [-a apps] [-r frames] [-C]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    gbm = gbm_create_device(open("/dev/null", O_RDWR | O_CLOEXEC));
+    if (!gbm) {
+        fprintf(stderr, "failed to create the gbm device\n");
+        return 1;
+    }
+
+    if (!check_rect_lock())
+        return 1;
+
+    Queue compositor_queue, camera_queue;
+    Consumer compositor(&compositor_queue, GRALLOC_USAGE_HW_COMPOSER, false);
+    Consumer image_reader(&camera_queue, GRALLOC_USAGE_SW_READ_OFTEN, true);
+    std::vector<Producer> producers;
+
+    /* half of the apps draw on the GPU, the others in software */
+    for (int i = 0; i < config.apps; i++) {
+        bool gpu = i % 2 == 0;
+
+        producers.emplace_back(&compositor_queue, i * kSwapchainBuffers, kSwapchainBuffers,
+                               gpu ? 1080 : 540, gpu ? 1920 : 960, HAL_PIXEL_FORMAT_RGBA_8888,
+                               GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE |
+                                       GRALLOC_USAGE_HW_COMPOSER |
+                                       (gpu ? 0 : GRALLOC_USAGE_SW_WRITE_OFTEN),
+                               gpu ? GRALLOC_USAGE_HW_RENDER : GRALLOC_USAGE_SW_WRITE_OFTEN,
+                               config.realloc_frames);
+    }
+    if (config.camera)
+        producers.emplace_back(&camera_queue, 0, kCameraBuffers, 1280, 720,
+                               HAL_PIXEL_FORMAT_YCbCr_420_888,
+                               GRALLOC_USAGE_HW_CAMERA_WRITE | GRALLOC_USAGE_SW_READ_OFTEN,
+                               GRALLOC_USAGE_HW_CAMERA_WRITE, config.realloc_frames);
+
+    std::vector<std::thread> threads;
+    threads.emplace_back([&] { compositor.run(); });
+    threads.emplace_back([&] { image_reader.run(); });
+    for (Producer& p : producers)
+        threads.emplace_back([&p] { p.run(); });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+    stop = true;
+    for (size_t i = 2; i < threads.size(); i++)
+        threads[i].join();
+    compositor_queue.push({Message::kStop, 0, nullptr});
+    camera_queue.push({Message::kStop, 0, nullptr});
+    threads[0].join();
+    threads[1].join();
+
+    report(config.seconds);
+    return 0;
+}
@@ -23,7 +23,7 @@ LOCAL_PROPRIETARY_MODULE := true
 LOCAL_C_INCLUDES += hardware/libhardware/include
 LOCAL_CFLAGS := -Wconversion -Wall -Werror -Wno-sign-conversion
 LOCAL_CLANG  := true
-LOCAL_SHARED_LIBRARIES := liblog libhardware
+LOCAL_SHARED_LIBRARIES := liblog libhardware libgralloc_drm
 LOCAL_SRC_FILES := memtrack_generic.c
 LOCAL_MODULE := memtrack.default
 include $(BUILD_SHARED_LIBRARY)
@@ -14,15 +14,156 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "memtrack_generic"
+
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <gralloc_stats.h>
 #include <hardware/memtrack.h>
+#include <log/log.h>
+
+/* Graphics buffers accounted by gralloc, see gralloc_stats.h */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct gralloc_stats* stats;
+
+static const struct gralloc_stats* get_stats(void)
+{
+    const struct gralloc_stats* region;
+    int fd;
+
+    pthread_mutex_lock(&stats_lock);
+    if (stats)
+        goto out;
+
+    /* Retried on every call until the first gralloc user creates it */
+    fd = open(GRALLOC_STATS_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto out;
+    region = mmap(NULL, sizeof(*region), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        goto out;
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != GRALLOC_STATS_MAGIC) {
+        munmap((void*)region, sizeof(*region));
+        goto out;
+    }
+    stats = region;
+
+out:
+    pthread_mutex_unlock(&stats_lock);
+    return stats;
+}
 
 int generic_memtrack_init(const struct memtrack_module *module)
 {
     if (!module)
         return -1;
 
+    if (!get_stats())
+        ALOGI("%s not available yet", GRALLOC_STATS_PATH);
+
+    return 0;
+}
+
+/* The slot of 'pid', if it is still the process that claimed it */
+static const struct gralloc_stats_process* find_stats_slot(const struct gralloc_stats* region,
+                                                           pid_t pid)
+{
+    for (unsigned int i = 0; i < GRALLOC_STATS_MAX_PROCESSES; i++) {
+        const struct gralloc_stats_process* slot = &region->processes[i];
+        if (__atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE) != pid)
+            continue;
+        /* A slot left behind by an earlier process with this pid is not ours */
+        if (__atomic_load_n(&slot->start_time, __ATOMIC_RELAXED) ==
+            gralloc_stats_start_time(pid))
+            return slot;
+        break;
+    }
+    return NULL;
+}
+
+/* Bytes of buffers in 'slot' with the given usages, and how much of all it maps */
+static uint64_t get_buffer_bytes(const struct gralloc_stats_process* slot,
+                                 unsigned int usage_mask, uint64_t* mapped)
+{
+    uint64_t bytes = 0;
+
+    for (unsigned int usage = 0; usage < GRALLOC_STATS_USAGE_COUNT; usage++) {
+        if (!(usage_mask & (1u << usage)))
+            continue;
+        bytes += __atomic_load_n(&slot->allocated[usage], __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&slot->imported[usage], __ATOMIC_RELAXED);
+    }
+    *mapped = __atomic_load_n(&slot->mapped, __ATOMIC_RELAXED);
+
+    return bytes;
+}
+
+int generic_memtrack_get_memory(const struct memtrack_module *module, pid_t pid, int type,
+                                struct memtrack_record *records, size_t *num_records)
+{
+    const struct gralloc_stats* region;
+    const struct gralloc_stats_process* slot = NULL;
+    unsigned int usage_mask;
+    uint64_t bytes, mapped;
+    size_t count;
+
+    if (!module || !num_records || pid <= 0)
+        return -EINVAL;
+
+    switch (type) {
+    case MEMTRACK_TYPE_GRAPHICS:
+        usage_mask = (1u << GRALLOC_STATS_USAGE_GPU) | (1u << GRALLOC_STATS_USAGE_DISPLAY) |
+                     (1u << GRALLOC_STATS_USAGE_CPU);
+        break;
+    case MEMTRACK_TYPE_CAMERA:
+        usage_mask = 1u << GRALLOC_STATS_USAGE_CAMERA;
+        break;
+    case MEMTRACK_TYPE_MULTIMEDIA:
+        usage_mask = 1u << GRALLOC_STATS_USAGE_VIDEO;
+        break;
+    default:
+        /* Nothing known about GPU driver internal or other memory */
+        *num_records = 0;
+        return 0;
+    }
+
+    /* Mapped buffers already show up in smaps, the rest does not */
+    count = *num_records;
+    *num_records = 2;
+    if (count == 0)
+        return 0;
+    if (!records)
+        return -EINVAL;
+
+    bytes = mapped = 0;
+    region = get_stats();
+    if (region)
+        slot = find_stats_slot(region, pid);
+    /* Processes without stats (apps) report nothing */
+    if (slot)
+        bytes = get_buffer_bytes(slot, usage_mask, &mapped);
+    /* Mappings are not split by usage, count them against graphics */
+    if (type != MEMTRACK_TYPE_GRAPHICS)
+        mapped = 0;
+    if (mapped > bytes)
+        mapped = bytes;
+
+    records[0].flags = MEMTRACK_FLAG_SMAPS_ACCOUNTED | MEMTRACK_FLAG_SHARED |
+                       MEMTRACK_FLAG_NONSECURE;
+    records[0].size_in_bytes = (size_t)mapped;
+    if (count > 1) {
+        records[1].flags = MEMTRACK_FLAG_SMAPS_UNACCOUNTED | MEMTRACK_FLAG_SHARED |
+                           MEMTRACK_FLAG_NONSECURE;
+        records[1].size_in_bytes = (size_t)(bytes - mapped);
+    }
+
     return 0;
 }
 
@@ -36,10 +177,11 @@ struct memtrack_module HAL_MODULE_INFO_SYM = {
         .module_api_version = MEMTRACK_MODULE_API_VERSION_0_1,
         .hal_api_version = HARDWARE_HAL_API_VERSION,
         .id = MEMTRACK_HARDWARE_MODULE_ID,
-        .name = "Dummy Memory Tracker HAL",
+        .name = "Generic Memory Tracker HAL",
         .author = "The Android Open Source Project",
         .methods = &memtrack_module_methods,
     },
 
     .init = generic_memtrack_init,
+    .getMemory = generic_memtrack_get_memory,
 };